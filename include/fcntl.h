@@ -0,0 +1,30 @@
+#ifndef	_FCNTL_H_
+#define	_FCNTL_H_
+
+#include <sys/types.h>
+
+/*
+ * File status flags
+ */
+#define	O_RDONLY	0x0000		/* open for reading only */
+#define	O_WRONLY	0x0001		/* open for writing only */
+#define	O_RDWR		0x0002		/* open for reading and writing */
+#define	O_ACCMODE	0x0003		/* mask for above modes */
+
+#define	O_CREAT		0x0200		/* create if nonexistent */
+
+/*
+ * Whence values for lseek(2)
+ */
+#define	SEEK_SET	0		/* set file offset to offset */
+#define	SEEK_CUR	1		/* set file offset to current plus offset */
+#define	SEEK_END	2		/* set file offset to EOF plus offset */
+
+/*
+ * Advice to fadvise
+ */
+#define	POSIX_FADV_NORMAL	0	/* adaptive read-ahead */
+#define	POSIX_FADV_RANDOM	1	/* no read-ahead */
+#define	POSIX_FADV_SEQUENTIAL	2	/* read ahead a full window from the start */
+
+#endif /* _FCNTL_H_ */
@@ -22,4 +22,17 @@ char *strrchr(const char *s, int c);
 int strcasecmp(const char *s1, const char *s2);
 int strncasecmp(const char *s1, const char *s2, size_t length);
 
+/*
+ * memcpy/memset/memmove are dispatched through function pointers to
+ * CPU-specific versions (lib/memx86.c). memx_init() picks the best of
+ * the features in `allowed' that CPUID reports, and returns the ones
+ * picked. Until it is called the portable C versions are used.
+ */
+#define MEMX_REP    0x01    /* rep movsl/stosl */
+#define MEMX_ERMS   0x02    /* rep movsb/stosb on CPUs with enhanced rep strings */
+#define MEMX_MMX    0x04    /* 64-bit MMX moves; touches the FPU state */
+#define MEMX_NT     0x08    /* SSE2 non-temporal stores (movnti) for big blocks */
+#define MEMX_ALL    0x0f
+unsigned memx_init(unsigned allowed);
+
 #endif /* _STRING_H */
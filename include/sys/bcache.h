@@ -0,0 +1,20 @@
+#ifndef _SYS_BCACHE_H_
+#define _SYS_BCACHE_H_
+
+#include <stdint.h>
+
+/*
+ * Block buffer cache statistics, returned by bcache_stat()
+ */
+struct bcache_stat {
+    uint32_t hits;          /* sector reads served from the cache */
+    uint32_t misses;        /* sector reads that went to the disk */
+    uint32_t writes;        /* sector writes absorbed by the cache */
+    uint32_t writebacks;    /* dirty sectors written to the disk */
+    uint32_t flushes;       /* write commands issued for them */
+    uint32_t bypassed;      /* sectors of large requests that skip the cache */
+    uint32_t dirty;         /* sectors currently dirty */
+    uint32_t nbufs;         /* capacity of the cache in sectors */
+};
+
+#endif /* _SYS_BCACHE_H_ */
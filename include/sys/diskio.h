@@ -0,0 +1,10 @@
+#ifndef _SYS_DISKIO_H_
+#define _SYS_DISKIO_H_
+
+/*
+ * Flags of diskread()
+ */
+#define DISKIO_PIO  0x01    /* do not use bus-master DMA */
+#define DISKIO_POLL 0x02    /* spin on the status register, no interrupts */
+
+#endif /* _SYS_DISKIO_H_ */
@@ -0,0 +1,47 @@
+#ifndef _SYS_MEMINFO_H_
+#define _SYS_MEMINFO_H_
+
+#include <stdint.h>
+
+#define MEMINFO_NZONE 8
+
+/*
+ * One physical memory zone
+ */
+struct meminfo_zone {
+    uint32_t base;      /* physical address of the first frame */
+    uint32_t frames;    /* frames managed by the zone */
+    uint32_t free;      /* frames currently free */
+    uint32_t maxrun;    /* longest run of contiguous free frames */
+};
+
+/*
+ * Memory statistics, returned by meminfo()
+ */
+struct meminfo {
+    uint32_t nzones;
+    struct meminfo_zone zone[MEMINFO_NZONE];
+
+    uint32_t kheap_size;    /* bytes in the kernel heap */
+    uint32_t kheap_used;    /* bytes allocated by kmalloc */
+    uint32_t kheap_peak;    /* high-water mark of kheap_used */
+
+    uint32_t minflt;        /* faults served without I/O, system wide */
+    uint32_t majflt;        /* faults that read the swap area */
+    uint32_t task_minflt;   /* minflt of the task asked for */
+    uint32_t task_majflt;   /* majflt of the task asked for */
+
+    uint32_t zero_fills;        /* anonymous pages cleared on fault */
+    uint64_t zero_fill_cycles;  /* TSC cycles spent clearing them */
+
+    uint32_t swapouts;      /* pages written to the swap area */
+    uint32_t mmaps;         /* successful mmap() calls */
+    uint32_t munmaps;       /* successful munmap() calls */
+
+    uint32_t compact_runs;      /* zones compacted */
+    uint32_t compact_moved;     /* user pages migrated by compaction */
+    uint32_t compact_failed;    /* unmovable pages compaction ran into */
+    uint32_t compact_gained;    /* frames added to the longest free runs */
+};
+
+#endif /* _SYS_MEMINFO_H_ */
@@ -21,6 +21,22 @@
 #define	MAP_FILE	0x0000		/* map from file (default) */
 #define	MAP_ANON	0x1000		/* allocated from memory, swap space */
 
+/*
+ * Flags to msync
+ */
+#define	MS_SYNC		0x0000	/* [MF|SIO] msync synchronously */
+#define	MS_ASYNC	0x0001	/* [MF] return immediately */
+#define	MS_INVALIDATE	0x0002	/* [MF] invalidate all cached data */
+
+/*
+ * Advice to madvise
+ */
+#define	MADV_NORMAL	0	/* [MC1] no further special treatment */
+#define	MADV_RANDOM	1	/* [MC1] expect random page refs */
+#define	MADV_SEQUENTIAL	2	/* [MC1] expect sequential page refs */
+#define	MADV_WILLNEED	3	/* [MC1] will need these pages */
+#define	MADV_DONTNEED	4	/* [MC1] dont need these pages */
+
 /*
  * Error return from mmap()
  */
@@ -0,0 +1,19 @@
+#ifndef _SYS_PCACHE_H_
+#define _SYS_PCACHE_H_
+
+#include <stdint.h>
+
+/*
+ * Page cache statistics, returned by pcache_stat()
+ */
+struct pcache_stat {
+    uint32_t hits;      /* lookups served from the cache */
+    uint32_t misses;    /* lookups that had to read the file */
+    uint32_t reclaims;  /* pages evicted or reclaimed */
+    uint32_t pages;     /* pages currently holding a frame */
+    uint32_t maxpages;  /* capacity of the cache */
+    uint32_t ra_pages;  /* pages read ahead in the background */
+    uint32_t ra_hits;   /* read-ahead pages later asked for */
+};
+
+#endif /* _SYS_PCACHE_H_ */
@@ -30,9 +30,22 @@
 #define SYSCALL_munmap        8
 #define SYSCALL_sleep         9
 #define SYSCALL_nanosleep     10
+#define SYSCALL_open          11
+#define SYSCALL_close         12
+#define SYSCALL_read          13
+#define SYSCALL_write         14
+#define SYSCALL_lseek         15
+#define SYSCALL_msync         16
+#define SYSCALL_pcache_stat   17
+#define SYSCALL_madvise       18
+#define SYSCALL_meminfo       19
+#define SYSCALL_diskread      20
+#define SYSCALL_sync          21
 
 #define SYSCALL_getpriority   22
 #define SYSCALL_setpriority   23
+#define SYSCALL_bcache_stat   24
+#define SYSCALL_fadvise       25
 
 #define SYSCALL_beep          181
 #define SYSCALL_vm86          182
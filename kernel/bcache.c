@@ -0,0 +1,577 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include <sys/bcache.h>
+#include "kernel.h"
+#include "dosfs.h"
+
+/**
+ * 块缓存
+ *
+ * 位于DOSFS和IDE驱动之间，以（单元，扇区号）为键缓存扇区，按LRU淘汰。
+ * 写扇区只修改缓存，脏扇区由内核线程bflush定期写回，系统调用sync
+ * 立即写回。写回时按扇区号排序，连续的脏扇区合并成一条写命令。
+ * 一次读写BCACHE_BYPASS个以上扇区的请求（交换区的页面、整簇的文件数据）
+ * 不进缓存，直接访问磁盘
+ */
+#define BCACHE_HASH       256
+#define BCACHE_BYPASS     8     /*一次读写这么多扇区就绕过缓存*/
+#define BCACHE_RUN        64    /*写回时一条命令最多写的扇区数*/
+#define BCACHE_FLUSH_SECS 5     /*bflush写回脏扇区的周期*/
+
+struct buf {
+    uint32_t  lba;
+    uint8_t   unit;
+    uint8_t   flags;
+#define B_VALID 1               /*data是扇区的内容*/
+#define B_DIRTY 2               /*比磁盘上的新*/
+#define B_BUSY  4               /*有线程正在使用，或正在读写磁盘*/
+    uint8_t  *data;
+    struct buf *hnext;          /*哈希链*/
+    struct buf *prev, *next;    /*LRU链表*/
+};
+
+static struct buf  *g_buf;
+static struct buf **g_bsort;    /*写回时排序用*/
+static int          g_nbuf;
+static struct buf  *g_bhash[BCACHE_HASH];
+static struct buf  *g_blru_head, *g_blru_tail;
+
+static struct wait_queue *g_bwait;      /*等待B_BUSY的缓冲区*/
+static struct wait_queue *g_bflush_wq;  /*bflush在这里睡眠*/
+
+/*写回时把连续的脏扇区拼在这里，同一时刻只有一个线程在写回*/
+static uint8_t g_bstage[BCACHE_RUN * SECTOR_SIZE];
+static int g_bsyncing;
+static struct wait_queue *g_bsync_wq;
+
+/*用户空间的缓冲区经过这里中转，同一时刻只有一个线程在用*/
+static uint8_t g_bbounce[BCACHE_RUN * SECTOR_SIZE];
+static int g_bbouncing;
+static struct wait_queue *g_bbounce_wq;
+
+static struct bcache_stat g_bstat;
+
+#define BHASH(unit, lba) (((lba) ^ ((uint32_t)(unit) << 7)) % BCACHE_HASH)
+
+/**
+ * 直接读写磁盘，一条命令最多IDE_MAX_SECTORS个扇区。buffer的页面必须已经有物理帧
+ */
+static int bdev_rw(uint8_t unit, uint32_t lba, uint32_t count,
+                   uint8_t *buffer, int write)
+{
+    uint32_t n;
+    int r;
+
+    while(count > 0) {
+        n = (count > IDE_MAX_SECTORS) ? IDE_MAX_SECTORS : count;
+        if(write)
+            r = ide_write_sectors(0x1f0, 0, lba, n, buffer);
+        else
+            r = ide_read_sectors(0x1f0, 0, lba, n, buffer);
+        if(r != 0)
+            return -1;
+
+        lba += n;
+        buffer += n * SECTOR_SIZE;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * 经过g_bbounce读写用户空间的缓冲区buffer
+ */
+static int bdev_bounce(uint8_t unit, uint32_t lba, uint32_t count,
+                       uint8_t *buffer, int write)
+{
+    uint32_t flags, n;
+    int r = 0;
+
+    save_flags_cli(flags);
+    while(g_bbouncing)
+        sleep_on(&g_bbounce_wq);
+    g_bbouncing = 1;
+    restore_flags(flags);
+
+    while(count > 0 && r == 0) {
+        n = (count > BCACHE_RUN) ? BCACHE_RUN : count;
+        if(write)
+            memcpy(g_bbounce, buffer, n * SECTOR_SIZE);
+        r = bdev_rw(unit, lba, n, g_bbounce, write);
+        if(!write && r == 0)
+            memcpy(buffer, g_bbounce, n * SECTOR_SIZE);
+
+        lba += n;
+        buffer += n * SECTOR_SIZE;
+        count -= n;
+    }
+
+    save_flags_cli(flags);
+    g_bbouncing = 0;
+    wake_up(&g_bbounce_wq, 1);
+    restore_flags(flags);
+
+    return r;
+}
+
+/**
+ * 读写磁盘。IDE驱动持有通道锁时不能在buffer上引发PF，否则PF换出页面时
+ * 要用同一个通道，就死锁了：用户空间的页面随时可能被换出或迁移，经过
+ * g_bbounce中转；内核空间的页面先逐页访问一遍，让它们有物理帧
+ */
+static int bdev_io(uint8_t unit, uint32_t lba, uint32_t count,
+                   uint8_t *buffer, int write)
+{
+    uint32_t va;
+
+    if((uint32_t)buffer < USER_MAX_ADDR)
+        return bdev_bounce(unit, lba, count, buffer, write);
+
+    for(va = PAGE_TRUNCATE((uint32_t)buffer);
+        va < (uint32_t)buffer + count * SECTOR_SIZE; va += PAGE_SIZE)
+        (void)*(volatile uint8_t *)va;
+
+    return bdev_rw(unit, lba, count, buffer, write);
+}
+
+static void lru_remove(struct buf *b)
+{
+    if(b->prev) b->prev->next = b->next; else g_blru_head = b->next;
+    if(b->next) b->next->prev = b->prev; else g_blru_tail = b->prev;
+    b->prev = b->next = NULL;
+}
+
+static void lru_insert(struct buf *b)
+{
+    b->prev = NULL;
+    b->next = g_blru_head;
+    if(g_blru_head) g_blru_head->prev = b; else g_blru_tail = b;
+    g_blru_head = b;
+}
+
+static void hash_remove(struct buf *b)
+{
+    struct buf **pp = &g_bhash[BHASH(b->unit, b->lba)];
+    while(*pp != NULL) {
+        if(*pp == b) {
+            *pp = b->hnext;
+            break;
+        }
+        pp = &(*pp)->hnext;
+    }
+    b->hnext = NULL;
+}
+
+static struct buf *hash_lookup(uint8_t unit, uint32_t lba)
+{
+    struct buf *b;
+    for(b = g_bhash[BHASH(unit, lba)]; b != NULL; b = b->hnext)
+        if(b->lba == lba && b->unit == unit)
+            return b;
+    return NULL;
+}
+
+static void bflush(void *pv);
+
+/**
+ * 初始化块缓存，size是缓存占用的字节数。必须在task0加入用户进程之前调用，
+ * bflush线程属于proc0
+ */
+void init_bcache(uint32_t size)
+{
+    uint8_t *data;
+    int i;
+
+    g_nbuf = size / SECTOR_SIZE;
+    g_buf = (struct buf *)kmalloc(g_nbuf * sizeof(struct buf));
+    g_bsort = (struct buf **)kmalloc(g_nbuf * sizeof(struct buf *));
+    data = (uint8_t *)kmemalign(PAGE_SIZE, g_nbuf * SECTOR_SIZE);
+    if(g_buf == NULL || g_bsort == NULL || data == NULL) {
+        kfree(g_buf);
+        kfree(g_bsort);
+        kfree(data);
+        g_nbuf = 0;
+        return;
+    }
+
+    memset(g_bhash, 0, sizeof(g_bhash));
+    g_blru_head = g_blru_tail = NULL;
+    for(i = 0; i < g_nbuf; i++) {
+        memset(&g_buf[i], 0, sizeof(struct buf));
+        g_buf[i].data = data + i * SECTOR_SIZE;
+        lru_insert(&g_buf[i]);
+    }
+
+    memset(&g_bstat, 0, sizeof(g_bstat));
+    g_bstat.nbufs = g_nbuf;
+
+    sys_task_create(NULL, bflush, NULL);
+}
+
+/**
+ * 释放缓冲区b
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static void brelse(struct buf *b)
+{
+    b->flags &= ~B_BUSY;
+    wake_up(&g_bwait, -1);
+}
+
+/**
+ * 取得扇区(unit, lba)的缓冲区并置B_BUSY，它可能还不是B_VALID。
+ * 不在缓存中就淘汰最久没有使用的缓冲区，被淘汰的是脏缓冲区时先写回，
+ * 写回期间恢复调用者的中断状态flags
+ *
+ * 注意：调用者关了中断
+ */
+static struct buf *bget(uint8_t unit, uint32_t lba, uint32_t flags)
+{
+    struct buf *b;
+    int r;
+
+again:
+    b = hash_lookup(unit, lba);
+    if(b != NULL) {
+        if(b->flags & B_BUSY) {
+            sleep_on(&g_bwait);
+            goto again;
+        }
+        b->flags |= B_BUSY;
+        lru_remove(b);
+        lru_insert(b);
+        return b;
+    }
+
+    for(b = g_blru_tail; b != NULL; b = b->prev)
+        if(!(b->flags & B_BUSY))
+            break;
+    if(b == NULL) {
+        sleep_on(&g_bwait);
+        goto again;
+    }
+
+    if(b->flags & B_DIRTY) {
+        b->flags = (b->flags & ~B_DIRTY) | B_BUSY;
+        g_bstat.dirty--;
+        restore_flags(flags);
+        r = bdev_io(b->unit, b->lba, 1, b->data, 1);
+        save_flags_cli(flags);
+        if(r != 0)
+            printk("bcache: lost write of sector %d\r\n", b->lba);
+        g_bstat.writebacks++;
+        g_bstat.flushes++;
+        brelse(b);
+        goto again;     /*期间别的线程可能读入了(unit, lba)*/
+    }
+
+    hash_remove(b);
+    b->unit = unit;
+    b->lba = lba;
+    b->flags = B_BUSY;
+    b->hnext = g_bhash[BHASH(unit, lba)];
+    g_bhash[BHASH(unit, lba)] = b;
+    lru_remove(b);
+    lru_insert(b);
+
+    return b;
+}
+
+/**
+ * 绕过缓存的读与缓存中的扇区保持一致：读之后用缓存中的扇区覆盖读到的旧内容
+ */
+static void bcache_overlap(uint8_t unit, uint32_t lba, uint32_t count,
+                           uint8_t *buffer)
+{
+    struct buf *b;
+    uint32_t flags, i;
+
+    save_flags_cli(flags);
+    for(i = 0; i < count; i++) {
+        b = hash_lookup(unit, lba + i);
+        if(b == NULL)
+            continue;
+        if(b->flags & B_BUSY) {
+            sleep_on(&g_bwait);
+            i--;
+            continue;
+        }
+        if(b->flags & B_VALID)
+            memcpy(buffer + i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * 绕过缓存写之前，把缓存中这count个扇区的缓冲区置B_BUSY。
+ * 写盘期间bflush不会用旧内容覆盖它们，别的线程也要等写完才能访问
+ */
+static void bcache_claim(uint8_t unit, uint32_t lba, uint32_t count)
+{
+    struct buf *b;
+    uint32_t flags, i;
+
+    save_flags_cli(flags);
+    for(i = 0; i < count; i++) {
+        b = hash_lookup(unit, lba + i);
+        if(b == NULL)
+            continue;
+        if(b->flags & B_BUSY) {
+            sleep_on(&g_bwait);
+            i--;
+            continue;
+        }
+        b->flags |= B_BUSY;
+    }
+    restore_flags(flags);
+}
+
+/**
+ * 释放bcache_claim取得的缓冲区。写盘成功时复制新内容，它们不再是脏的；
+ * 失败时磁盘上的内容不确定，把它们从缓存中去掉
+ */
+static void bcache_settle(uint8_t unit, uint32_t lba, uint32_t count,
+                          uint8_t *buffer, int ok)
+{
+    struct buf *b;
+    uint32_t flags, i;
+
+    save_flags_cli(flags);
+    for(i = 0; i < count; i++) {
+        b = hash_lookup(unit, lba + i);
+        if(b == NULL)
+            continue;
+        if(b->flags & B_DIRTY)
+            g_bstat.dirty--;
+        if(ok) {
+            memcpy(b->data, buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+            b->flags = B_VALID | B_BUSY;
+        } else {
+            hash_remove(b);
+            b->flags = B_BUSY;
+        }
+        brelse(b);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * 从单元unit的扇区lba开始读count个扇区到buffer。成功返回0，失败返回-1
+ */
+int bcache_read(uint8_t unit, uint8_t *buffer, uint32_t lba, uint32_t count)
+{
+    struct buf *b;
+    uint32_t flags;
+    int r;
+
+    if(count >= BCACHE_BYPASS || g_nbuf == 0) {
+        if(bdev_io(unit, lba, count, buffer, 0) != 0)
+            return -1;
+        bcache_overlap(unit, lba, count, buffer);
+        g_bstat.bypassed += count;
+        return 0;
+    }
+
+    for(; count > 0; count--, lba++, buffer += SECTOR_SIZE) {
+        save_flags_cli(flags);
+        b = bget(unit, lba, flags);
+        if(b->flags & B_VALID) {
+            g_bstat.hits++;
+        } else {
+            g_bstat.misses++;
+            restore_flags(flags);
+            r = bdev_io(unit, lba, 1, b->data, 0);
+            save_flags_cli(flags);
+            if(r != 0) {
+                hash_remove(b);
+                brelse(b);
+                restore_flags(flags);
+                return -1;
+            }
+            b->flags |= B_VALID;
+        }
+        restore_flags(flags);
+
+        /*B_BUSY的缓冲区不会被淘汰或修改*/
+        memcpy(buffer, b->data, SECTOR_SIZE);
+
+        save_flags_cli(flags);
+        brelse(b);
+        restore_flags(flags);
+    }
+
+    return 0;
+}
+
+/**
+ * 把buffer中的count个扇区写到单元unit从lba开始的扇区。
+ * 小的请求只写进缓存，由bflush或sync写回。成功返回0，失败返回-1
+ */
+int bcache_write(uint8_t unit, uint8_t *buffer, uint32_t lba, uint32_t count)
+{
+    struct buf *b;
+    uint32_t flags;
+    int r;
+
+    if(count >= BCACHE_BYPASS || g_nbuf == 0) {
+        bcache_claim(unit, lba, count);
+        r = bdev_io(unit, lba, count, buffer, 1);
+        bcache_settle(unit, lba, count, buffer, r == 0);
+        g_bstat.bypassed += count;
+        return r;
+    }
+
+    for(; count > 0; count--, lba++, buffer += SECTOR_SIZE) {
+        save_flags_cli(flags);
+        b = bget(unit, lba, flags);
+        restore_flags(flags);
+
+        memcpy(b->data, buffer, SECTOR_SIZE);
+
+        save_flags_cli(flags);
+        if(!(b->flags & B_DIRTY))
+            g_bstat.dirty++;
+        b->flags |= B_VALID | B_DIRTY;
+        g_bstat.writes++;
+        brelse(b);
+
+        /*脏扇区超过一半，提前唤醒bflush*/
+        if(g_bstat.dirty > g_nbuf / 2)
+            wake_up(&g_bflush_wq, 1);
+        restore_flags(flags);
+    }
+
+    return 0;
+}
+
+/**
+ * 把所有的脏扇区写回磁盘，返回写回的扇区数，出错返回-1
+ */
+int bcache_sync()
+{
+    struct buf *b, **v = g_bsort;
+    uint32_t flags, lba;
+    uint8_t unit;
+    int n, i, j, k, gap, total = 0, err = 0;
+
+    save_flags_cli(flags);
+    while(g_bsyncing)
+        sleep_on(&g_bsync_wq);
+    g_bsyncing = 1;
+
+    for(n = 0, i = 0; i < g_nbuf; i++)
+        if(g_buf[i].flags & B_DIRTY)
+            v[n++] = &g_buf[i];
+    restore_flags(flags);
+
+    /*按(unit, lba)排序，希尔排序*/
+    for(gap = n / 2; gap > 0; gap /= 2)
+        for(i = gap; i < n; i++)
+            for(j = i - gap; j >= 0 &&
+                (v[j]->unit > v[j+gap]->unit ||
+                 (v[j]->unit == v[j+gap]->unit && v[j]->lba > v[j+gap]->lba));
+                j -= gap) {
+                b = v[j]; v[j] = v[j+gap]; v[j+gap] = b;
+            }
+
+    save_flags_cli(flags);
+    for(i = 0; i < n; ) {
+        b = v[i];
+        if(b->flags & B_BUSY) {
+            sleep_on(&g_bwait);
+            continue;
+        }
+        if(!(b->flags & B_DIRTY)) {
+            i++;
+            continue;
+        }
+
+        /*从v[i]开始收集扇区号连续的脏缓冲区，它们在写回期间B_BUSY*/
+        unit = b->unit;
+        lba = b->lba;
+        for(j = i; j < n && j - i < BCACHE_RUN; j++) {
+            b = v[j];
+            if(b->unit != unit || b->lba != lba + (j - i) ||
+               (b->flags & (B_BUSY|B_DIRTY)) != B_DIRTY)
+                break;
+            b->flags = (b->flags & ~B_DIRTY) | B_BUSY;
+            g_bstat.dirty--;
+        }
+        restore_flags(flags);
+
+        for(k = i; k < j; k++)
+            memcpy(g_bstage + (k - i) * SECTOR_SIZE, v[k]->data, SECTOR_SIZE);
+        if(bdev_io(unit, lba, j - i, g_bstage, 1) != 0) {
+            printk("bcache: failed to write back sector %d\r\n", lba);
+            err = 1;
+        }
+
+        save_flags_cli(flags);
+        for(k = i; k < j; k++)
+            brelse(v[k]);
+        g_bstat.writebacks += j - i;
+        g_bstat.flushes++;
+        total += j - i;
+        i = j;
+    }
+
+    g_bsyncing = 0;
+    wake_up(&g_bsync_wq, 1);
+    restore_flags(flags);
+
+    return err ? -1 : total;
+}
+
+/**
+ * 内核线程，被定时器或写满一半的缓存唤醒后写回脏扇区
+ */
+static void bflush(void *pv)
+{
+    uint32_t flags;
+
+    while(1) {
+        save_flags_cli(flags);
+        sleep_on(&g_bflush_wq);
+        restore_flags(flags);
+
+        bcache_sync();
+    }
+}
+
+/**
+ * 被定时器的中断处理程序调用，每BCACHE_FLUSH_SECS秒唤醒一次bflush
+ */
+void bcache_timer()
+{
+    if(g_bstat.dirty > 0 && g_timer_ticks % (BCACHE_FLUSH_SECS * HZ) == 0)
+        wake_up(&g_bflush_wq, 1);
+}
+
+/**
+ * 取得块缓存的统计信息
+ */
+void bcache_getstat(struct bcache_stat *st)
+{
+    uint32_t flags;
+    save_flags_cli(flags);
+    *st = g_bstat;
+    restore_flags(flags);
+}
@@ -14,6 +14,14 @@
 #include "filesys/file.h"
 #endif
 
+/* With BITMAP_SUMMARY, a second-level bitmap records which
+   elements have every bit set, so searches for false bits skip
+   ELEM_BITS * ELEM_BITS bits at a time over full regions.  It
+   costs one extra bit per element. */
+#ifndef BITMAP_SUMMARY
+#define BITMAP_SUMMARY 1
+#endif
+
 /* Element type.
 
    This must be an unsigned integer type at least as wide as int.
@@ -34,6 +42,9 @@ struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+#if BITMAP_SUMMARY
+    elem_type *full;    /* Bit I is set if element I is all ones. */
+#endif
   };
 
 /* Returns the index of the element that contains the bit
@@ -75,6 +86,108 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns an elem_type with the CNT bits starting at bit OFS
+   turned on.  OFS + CNT must not exceed ELEM_BITS. */
+static __inline elem_type
+range_mask (size_t ofs, size_t cnt)
+{
+  return (cnt == ELEM_BITS ? (elem_type) -1 : ((elem_type) 1 << cnt) - 1) << ofs;
+}
+
+/* Returns the index of the lowest set bit in X, which must not
+   be zero. */
+static __inline size_t
+first_bit (elem_type x)
+{
+  size_t idx;
+  asm ("bsfl %1, %0" : "=r" (idx) : "rm" (x) : "cc");
+  return idx;
+}
+
+/* Returns the index of the highest set bit in X, which must not
+   be zero. */
+static __inline size_t
+last_bit (elem_type x)
+{
+  size_t idx;
+  asm ("bsrl %1, %0" : "=r" (idx) : "rm" (x) : "cc");
+  return idx;
+}
+
+/* Returns the number of set bits in X. */
+static __inline size_t
+pop_count (elem_type x)
+{
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0f0f0f0f;
+  return (x * 0x01010101) >> 24;
+}
+
+/* Brings the summary bit of element IDX of B up to date. */
+static __inline void
+update_full (struct bitmap *b UNUSED, size_t idx UNUSED)
+{
+#if BITMAP_SUMMARY
+  if (b->bits[idx] == (elem_type) -1)
+    b->full[elem_idx (idx)] |= bit_mask (idx);
+  else
+    b->full[elem_idx (idx)] &= ~bit_mask (idx);
+#endif
+}
+
+#if BITMAP_SUMMARY
+/* Returns the index of the first element of B at or after IDX
+   that has a false bit, or a value not less than elem_cnt() if
+   there is none. */
+static size_t
+next_nonfull (const struct bitmap *b, size_t idx)
+{
+  size_t i = elem_idx (idx);
+  size_t last = elem_cnt (elem_cnt (b->bit_cnt));
+  elem_type e = ~b->full[i] & ((elem_type) -1 << (idx % ELEM_BITS));
+
+  while (e == 0)
+    {
+      if (++i >= last)
+        return elem_cnt (b->bit_cnt);
+      e = ~b->full[i];
+    }
+  return i * ELEM_BITS + first_bit (e);
+}
+#endif
+
+/* Returns the index of the first bit in B at or after START and
+   before END that is set to VALUE, or END if there is none.
+   END must not exceed the size of B. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  elem_type inv = value ? 0 : (elem_type) -1;
+  size_t idx, last;
+  elem_type e;
+
+  if (start >= end)
+    return end;
+
+  idx = elem_idx (start);
+  last = elem_idx (end - 1);
+  e = (b->bits[idx] ^ inv) & ((elem_type) -1 << (start % ELEM_BITS));
+  while (e == 0)
+    {
+      if (++idx > last)
+        return end;
+#if BITMAP_SUMMARY
+      if (!value && (idx = next_nonfull (b, idx)) > last)
+        return end;
+#endif
+      e = b->bits[idx] ^ inv;
+    }
+
+  idx = idx * ELEM_BITS + first_bit (e);
+  return idx < end ? idx : end;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -111,6 +224,14 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+#if BITMAP_SUMMARY
+  {
+    size_t i;
+    b->full = b->bits + elem_cnt (bit_cnt);
+    for (i = 0; i < elem_cnt (elem_cnt (bit_cnt)); i++)
+      b->full[i] = 0;
+  }
+#endif
   bitmap_set_all (b, false);
   return b;
 }
@@ -120,7 +241,12 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt)
 {
+#if BITMAP_SUMMARY
+  return sizeof (struct bitmap) + byte_cnt (bit_cnt)
+         + byte_cnt (elem_cnt (bit_cnt));
+#else
   return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+#endif
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -145,7 +271,12 @@ bitmap_size (const struct bitmap *b)
   return b->bit_cnt;
 }
 
-/* Setting and testing single bits. */
+/* Setting and testing single bits.
+
+   The element holding a bit is updated atomically.  The summary
+   bit is updated right after; callers that update B from
+   several threads must serialize (the kernel disables
+   interrupts) for the summary to stay exact. */
 
 /* Atomically sets the bit numbered IDX in B to VALUE. */
 void
@@ -174,6 +305,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
 #else
   atomic_or(&b->bits[idx], mask);
 #endif
+  update_full (b, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -191,6 +323,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
 #else
   atomic_and(&b->bits[idx], ~mask);
 #endif
+  update_full (b, idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -210,6 +343,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
 #else
   atomic_xor(&b->bits[idx], mask);
 #endif
+  update_full (b, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -232,18 +366,31 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Whole elements are written at once. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
+  size_t end = start + cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t ofs = start % ELEM_BITS;
+      size_t n = ELEM_BITS - ofs < end - start ? ELEM_BITS - ofs : end - start;
+      elem_type mask = range_mask (ofs, n);
+
+      if (value)
+        b->bits[idx] |= mask;
+      else
+        b->bits[idx] &= ~mask;
+      update_full (b, idx);
+      start += n;
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -258,10 +405,14 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (start + cnt <= b->bit_cnt);
 
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
-  return value_cnt;
+  for (i = start; i < start + cnt; )
+    {
+      size_t ofs = i % ELEM_BITS;
+      size_t n = ELEM_BITS - ofs < start + cnt - i ? ELEM_BITS - ofs : start + cnt - i;
+      value_cnt += pop_count (b->bits[elem_idx (i)] & range_mask (ofs, n));
+      i += n;
+    }
+  return value ? value_cnt : cnt - value_cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -269,16 +420,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
-
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -320,14 +466,55 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   if (cnt <= b->bit_cnt)
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i;
+      size_t i, j;
+
+      if (cnt == 0)
+        return start;
+
+      /* Jump to the next bit set to VALUE, then to the end of its
+         run; each step moves at least one element's worth of
+         bits unless a run boundary is found. */
+      while (start <= last)
+        {
+          i = find_next (b, start, b->bit_cnt, value);
+          if (i > last)
+            break;
+          j = find_next (b, i, i + cnt, !value);
+          if (j == i + cnt)
+            return i;
+          start = j;
+        }
     }
   return BITMAP_ERROR;
 }
 
+/* Returns the index of the last bit in B before END that is set
+   to VALUE, or BITMAP_ERROR if there is none. */
+size_t
+bitmap_scan_last (const struct bitmap *b, size_t end, bool value)
+{
+  elem_type inv = value ? 0 : (elem_type) -1;
+  size_t idx;
+  elem_type e;
+
+  ASSERT (b != NULL);
+
+  if (end > b->bit_cnt)
+    end = b->bit_cnt;
+  if (end == 0)
+    return BITMAP_ERROR;
+
+  idx = elem_idx (end - 1);
+  e = (b->bits[idx] ^ inv) & range_mask (0, (end - 1) % ELEM_BITS + 1);
+  while (e == 0)
+    {
+      if (idx == 0)
+        return BITMAP_ERROR;
+      e = b->bits[--idx] ^ inv;
+    }
+  return idx * ELEM_BITS + last_bit (e);
+}
+
 /* Finds the first group of CNT consecutive bits in B at or after
    START that are all set to VALUE, flips them all to !VALUE,
    and returns the index of the first bit in the group.
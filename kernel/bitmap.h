@@ -38,6 +38,7 @@ bool bitmap_all (const struct bitmap *, size_t start, size_t cnt);
 #define BITMAP_ERROR SIZE_MAX
 size_t bitmap_scan (const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan_and_flip (struct bitmap *, size_t start, size_t cnt, bool);
+size_t bitmap_scan_last (const struct bitmap *, size_t end, bool);
 
 /* File input and output. */
 #ifdef FILESYS
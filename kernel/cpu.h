@@ -147,6 +147,53 @@ read_eflags(void)
     return (ef);
 }
 
+static __inline uint32_t
+rcr3(void)
+{
+    uint32_t data;
+    __asm__ __volatile__("movl %%cr3, %0" : "=r" (data));
+    return (data);
+}
+
+static __inline void
+load_cr3(uint32_t data)
+{
+    __asm__ __volatile__("movl %0, %%cr3" : : "r" (data) : "memory");
+}
+
+static __inline uint64_t
+rdtsc(void)
+{
+    uint64_t tsc;
+    __asm__ __volatile__("rdtsc" : "=A" (tsc));
+    return (tsc);
+}
+
+static __inline uint32_t
+rcr4(void)
+{
+    uint32_t data;
+    __asm__ __volatile__("movl %%cr4, %0" : "=r" (data));
+    return (data);
+}
+
+static __inline void
+load_cr4(uint32_t data)
+{
+    __asm__ __volatile__("movl %0, %%cr4" : : "r" (data));
+}
+
+static __inline void
+do_cpuid(uint32_t ax, uint32_t *p)
+{
+    __asm__ __volatile__("cpuid"
+            : "=a" (p[0]), "=b" (p[1]), "=c" (p[2]), "=d" (p[3])
+            :  "0" (ax));
+}
+
+#define CR4_PGE     0x00000080 /* Page global enable */
+#define CPUID_PGE   0x00002000 /* EDX of CPUID(1) */
+
 #define PAGE_SHIFT  12
 #define PGDR_SHIFT  22
 #define PAGE_SIZE   (1<<PAGE_SHIFT)
@@ -159,5 +206,6 @@ read_eflags(void)
 #define PTE_U   0x004 /* User/Supervisor */
 #define PTE_A   0x020 /* Accessed */
 #define PTE_M   0x040 /* Dirty */
+#define PTE_G   0x100 /* Global */
 
 #endif /*_CPU_H*/
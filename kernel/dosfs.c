@@ -11,6 +11,7 @@
 #include <string.h>
 
 #include "dosfs.h"
+#include "bitmap.h"
 
 typedef struct _div_t {
   int quot;
@@ -110,6 +111,15 @@ uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsect
 	PLBR lbr = (PLBR) scratchsector;
 	volinfo->unit = unit;
 	volinfo->startsector = startsector;
+	volinfo->fat = NULL;
+	volinfo->fatdirty = NULL;
+	volinfo->dcache = NULL;
+	volinfo->dcachesize = 0;
+	volinfo->freemap = NULL;
+	volinfo->freecount = 0xffffffff;
+	volinfo->nextfree = 0xffffffff;
+	volinfo->fsinfo = 0;
+	volinfo->fsinfodirty = 0;
 
 	if(DFS_ReadSector(unit,scratchsector,startsector,1))
 		return DFS_ERRMISC;
@@ -178,6 +188,12 @@ uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsect
 		  (((uint32_t) lbr->ebpb.ebpb32.root_1) << 8) |
 		  (((uint32_t) lbr->ebpb.ebpb32.root_2) << 16) |
 		  (((uint32_t) lbr->ebpb.ebpb32.root_3) << 24);
+		volinfo->fsinfo = (uint16_t) lbr->ebpb.ebpb32.fsinfo_l |
+		  (((uint16_t) lbr->ebpb.ebpb32.fsinfo_h) << 8);
+		if (volinfo->fsinfo == 0 || volinfo->fsinfo >= volinfo->reservedsecs)
+			volinfo->fsinfo = 0;
+		else
+			volinfo->fsinfo += startsector;
 	}
 
 	// Calculate number of clusters in data area and infer FAT type from this information.
@@ -189,9 +205,55 @@ uint32_t DFS_GetVolInfo(uint8_t unit, uint8_t *scratchsector, uint32_t startsect
 	else
 		volinfo->filesystem = FAT32;
 
+	// Pick up the free cluster hints. A damaged FSInfo sector is simply not used.
+	if (volinfo->fsinfo) {
+		PFSINFO fsi = (PFSINFO) scratchsector;
+
+		if (DFS_ReadSector(unit, scratchsector, volinfo->fsinfo, 1) ||
+		  memcmp(fsi->leadsig, "RRaA", 4) || memcmp(fsi->strucsig, "rrAa", 4) ||
+		  fsi->trailsig[2] != 0x55 || fsi->trailsig[3] != 0xaa)
+			volinfo->fsinfo = 0;
+		else {
+			volinfo->freecount = (uint32_t) fsi->free_0 |
+			  (((uint32_t) fsi->free_1) << 8) |
+			  (((uint32_t) fsi->free_2) << 16) |
+			  (((uint32_t) fsi->free_3) << 24);
+			volinfo->nextfree = (uint32_t) fsi->next_0 |
+			  (((uint32_t) fsi->next_1) << 8) |
+			  (((uint32_t) fsi->next_2) << 16) |
+			  (((uint32_t) fsi->next_3) << 24);
+			if (volinfo->freecount > volinfo->numclusters)
+				volinfo->freecount = 0xffffffff;
+		}
+	}
+
 	return DFS_OK;
 }
 
+/*
+	INTERNAL
+	Account for cluster becoming free or in use. Called by DFS_SetFAT for every
+	change, so the free map and count follow the FAT.
+*/
+static void DFS_MarkFree(PVOLINFO volinfo, uint32_t cluster, int isfree)
+{
+	if (cluster < 2 || cluster >= volinfo->numclusters + 2)
+		return;
+
+	if (volinfo->freemap) {
+		if (bitmap_test(volinfo->freemap, cluster - 2) == (isfree != 0))
+			return;
+		bitmap_set(volinfo->freemap, cluster - 2, isfree != 0);
+		volinfo->freecount += isfree ? 1 : -1;
+	}
+	// Without the map we can't tell whether this changes the count
+	else if (volinfo->freecount == 0xffffffff)
+		return;
+	else
+		volinfo->freecount = 0xffffffff;
+	volinfo->fsinfodirty = 1;
+}
+
 /*
 	Fetch FAT entry for specified cluster number
 	You must provide a scratch buffer for one sector (SECTOR_SIZE) and a populated VOLINFO
@@ -216,6 +278,27 @@ uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	else
 		return 0x0ffffff7;	// FAT32 bad cluster
 
+	// The whole FAT is in RAM: no I/O, and a FAT12 entry that spans a sector
+	// boundary is simply two adjacent bytes.
+	if (volinfo->fat) {
+		uint8_t *p = volinfo->fat + offset;
+
+		if (offset + ((volinfo->filesystem == FAT32) ? 4 : 2) > volinfo->secperfat * SECTOR_SIZE)
+			return 0x0ffffff7;	// FAT32 bad cluster
+
+		if (volinfo->filesystem == FAT12) {
+			result = (uint32_t) p[0] | ((uint32_t) p[1]) << 8;
+			return (cluster & 1) ? (result >> 4) : (result & 0xfff);
+		}
+		else if (volinfo->filesystem == FAT16)
+			return (uint32_t) p[0] | ((uint32_t) p[1]) << 8;
+		else
+			return ((uint32_t) p[0] |
+			  ((uint32_t) p[1]) << 8 |
+			  ((uint32_t) p[2]) << 16 |
+			  ((uint32_t) p[3]) << 24) & 0x0fffffff;
+	}
+
 	// at this point, offset is the BYTE offset of the desired sector from the start
 	// of the FAT. Calculate the physical sector containing this FAT entry.
 	sector = ldiv(offset, SECTOR_SIZE).quot + volinfo->fat1;
@@ -313,6 +396,43 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	else
 		return DFS_ERRMISC;
 
+	DFS_MarkFree(volinfo, cluster, new_contents == 0);
+
+	// The whole FAT is in RAM: update it and mark the sector(s) touched as dirty.
+	// They reach the disk on the next DFS_FlushFAT.
+	if (volinfo->fat) {
+		uint8_t *p = volinfo->fat + offset;
+		uint32_t len = (volinfo->filesystem == FAT32) ? 4 : 2;
+
+		if (offset + len > volinfo->secperfat * SECTOR_SIZE)
+			return DFS_ERRMISC;
+
+		if (volinfo->filesystem == FAT12) {
+			if (cluster & 1) {
+				p[0] = (p[0] & 0x0f) | ((new_contents << 4) & 0xf0);
+				p[1] = (new_contents >> 4) & 0xff;
+			}
+			else {
+				p[0] = new_contents & 0xff;
+				p[1] = (p[1] & 0xf0) | ((new_contents >> 8) & 0x0f);
+			}
+		}
+		else if (volinfo->filesystem == FAT16) {
+			p[0] = new_contents & 0xff;
+			p[1] = (new_contents & 0xff00) >> 8;
+		}
+		else {
+			p[0] = new_contents & 0xff;
+			p[1] = (new_contents & 0xff00) >> 8;
+			p[2] = (new_contents & 0xff0000) >> 16;
+			p[3] = (p[3] & 0xf0) | ((new_contents & 0x0f000000) >> 24);
+		}
+
+		bitmap_mark(volinfo->fatdirty, offset / SECTOR_SIZE);
+		bitmap_mark(volinfo->fatdirty, (offset + len - 1) / SECTOR_SIZE);
+		return DFS_OK;
+	}
+
 	// at this point, offset is the BYTE offset of the desired sector from the start
 	// of the FAT. Calculate the physical sector containing this FAT entry.
 	sector = ldiv(offset, SECTOR_SIZE).quot + volinfo->fat1;
@@ -431,6 +551,73 @@ uint32_t DFS_SetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache,
 	return result;
 }
 
+/*
+	Load FAT #1 of the volume into fat, a buffer of secperfat sectors, and use it
+	for all later FAT accesses. dirty must have one bit per FAT sector.
+	Returns 0 OK, nonzero for any error (the volume is then left uncached).
+*/
+uint32_t DFS_CacheFAT(PVOLINFO volinfo, uint8_t *fat, struct bitmap *dirty)
+{
+	if (DFS_ReadSector(volinfo->unit, fat, volinfo->fat1, volinfo->secperfat))
+		return DFS_ERRMISC;
+
+	bitmap_set_all(dirty, false);
+	volinfo->fatdirty = dirty;
+	volinfo->fat = fat;
+	return DFS_OK;
+}
+
+/*
+	Write the FAT sectors changed since the last flush to both FAT copies, merging
+	adjacent dirty sectors into one request, then update the FAT32 FSInfo hints if
+	they changed. scratch must point to a sector-sized buffer.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_FlushFAT(PVOLINFO volinfo, uint8_t *scratch)
+{
+	size_t first, last;
+
+	if (volinfo->fsinfo && volinfo->fsinfodirty) {
+		PFSINFO fsi = (PFSINFO) scratch;
+
+		if (DFS_ReadSector(volinfo->unit, scratch, volinfo->fsinfo, 1))
+			return DFS_ERRMISC;
+		fsi->free_0 = volinfo->freecount & 0xff;
+		fsi->free_1 = (volinfo->freecount & 0xff00) >> 8;
+		fsi->free_2 = (volinfo->freecount & 0xff0000) >> 16;
+		fsi->free_3 = (volinfo->freecount & 0xff000000) >> 24;
+		fsi->next_0 = volinfo->nextfree & 0xff;
+		fsi->next_1 = (volinfo->nextfree & 0xff00) >> 8;
+		fsi->next_2 = (volinfo->nextfree & 0xff0000) >> 16;
+		fsi->next_3 = (volinfo->nextfree & 0xff000000) >> 24;
+		if (DFS_WriteSector(volinfo->unit, scratch, volinfo->fsinfo, 1))
+			return DFS_ERRMISC;
+		volinfo->fsinfodirty = 0;
+	}
+
+	if (!volinfo->fat)
+		return DFS_OK;
+
+	first = 0;
+	while ((first = bitmap_scan(volinfo->fatdirty, first, 1, true)) != BITMAP_ERROR) {
+		last = bitmap_scan(volinfo->fatdirty, first, 1, false);
+		if (last == BITMAP_ERROR)
+			last = volinfo->secperfat;
+
+		if (DFS_WriteSector(volinfo->unit, volinfo->fat + first * SECTOR_SIZE,
+		  volinfo->fat1 + first, last - first))
+			return DFS_ERRMISC;
+		// mirror the FAT into copy 2
+		if (DFS_WriteSector(volinfo->unit, volinfo->fat + first * SECTOR_SIZE,
+		  volinfo->fat1 + volinfo->secperfat + first, last - first))
+			return DFS_ERRMISC;
+
+		bitmap_set_multiple(volinfo->fatdirty, first, last - first, false);
+		first = last;
+	}
+	return DFS_OK;
+}
+
 /*
 	Convert a filename element from canonical (8.3) to directory entry (11) form
 	src must point to the first non-separator character.
@@ -460,29 +647,236 @@ char *DFS_CanonicalToDir(char *dest, char *src)
 	return dest;
 }
 
+/*
+	Scan the FAT once and keep the free clusters in freemap, a bitmap of numclusters
+	bits, so that DFS_GetFreeFAT no longer reads the FAT. freecount becomes exact.
+	Returns 0 OK, nonzero for any error (the map is then not used).
+*/
+uint32_t DFS_CacheFreeMap(PVOLINFO volinfo, uint8_t *scratch, struct bitmap *freemap)
+{
+	uint32_t i, count = 0, scratchcache = 0;
+
+	bitmap_set_all(freemap, false);
+	for (i=2; i < volinfo->numclusters + 2; i++) {
+		if (DFS_GetFAT(volinfo, scratch, &scratchcache, i) == 0) {
+			bitmap_mark(freemap, i - 2);
+			count++;
+		}
+	}
+
+	if (volinfo->freecount != count)
+		volinfo->fsinfodirty = 1;
+	volinfo->freecount = count;
+	volinfo->freemap = freemap;
+	return DFS_OK;
+}
+
+/*
+	INTERNAL
+	Return nonzero if cluster is free
+*/
+static int DFS_IsFree(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache, uint32_t cluster)
+{
+	if (volinfo->freemap)
+		return bitmap_test(volinfo->freemap, cluster - 2);
+	return DFS_GetFAT(volinfo, scratch, scratchcache, cluster) == 0;
+}
+
 /*
 	Find the first unused FAT entry
 	You must provide a scratch buffer for one sector (SECTOR_SIZE) and a populated VOLINFO
-	Returns a FAT32 BAD_CLUSTER value for any error, otherwise the contents of the desired
-	FAT entry.
+	The search starts after the nextfree hint and wraps around.
 	Returns FAT32 bad_sector (0x0ffffff7) if there is no free cluster available
 */
 uint32_t DFS_GetFreeFAT(PVOLINFO volinfo, uint8_t *scratch)
 {
-	uint32_t i, result = 0xffffffff, scratchcache = 0;
-
-	// Search starts at cluster 2, which is the first usable cluster
-	// NOTE: This search can't terminate at a bad cluster, because there might
-	// legitimately be bad clusters on the disk.
-	for (i=2; i < volinfo->numclusters; i++) {
-		result = DFS_GetFAT(volinfo, scratch, &scratchcache, i);
-		if (!result) {
-			return i;
+	uint32_t i, start, end = volinfo->numclusters + 2, scratchcache = 0;
+	size_t bit;
+
+	if (volinfo->freemap && volinfo->freecount == 0)
+		return 0x0ffffff7;
+
+	start = volinfo->nextfree + 1;
+	if (start < 2 || start >= end)
+		start = 2;
+
+	if (volinfo->freemap) {
+		bit = bitmap_scan(volinfo->freemap, start - 2, 1, true);
+		if (bit == BITMAP_ERROR)
+			bit = bitmap_scan(volinfo->freemap, 0, 1, true);
+		if (bit == BITMAP_ERROR)
+			return 0x0ffffff7;
+		i = bit + 2;
+	}
+	else {
+		// NOTE: This search can't terminate at a bad cluster, because there might
+		// legitimately be bad clusters on the disk.
+		for (i=start; i < end; i++)
+			if (DFS_IsFree(volinfo, scratch, &scratchcache, i))
+				break;
+		if (i == end) {
+			for (i=2; i < start; i++)
+				if (DFS_IsFree(volinfo, scratch, &scratchcache, i))
+					break;
+			if (i == start)
+				return 0x0ffffff7;		// Can't find a free cluster
 		}
 	}
-	return 0x0ffffff7;		// Can't find a free cluster
+
+	volinfo->nextfree = i;
+	volinfo->fsinfodirty = 1;
+	return i;
+}
+
+/*
+	INTERNAL
+	Find a free cluster to follow cluster prev in a file that still needs count more
+	clusters. The cluster right after prev is taken if it is free; otherwise, if the
+	free map is available, the first free run of count clusters (or half as many,
+	and so on) is chosen, so that large writes stay contiguous on disk.
+	Returns FAT32 bad_sector (0x0ffffff7) if there is no free cluster available
+*/
+static uint32_t DFS_GetFreeRun(PVOLINFO volinfo, uint8_t *scratch, uint32_t prev, uint32_t count)
+{
+	uint32_t scratchcache = 0, start;
+	size_t bit;
+
+	if (prev >= 2 && prev + 1 < volinfo->numclusters + 2 &&
+	  DFS_IsFree(volinfo, scratch, &scratchcache, prev + 1)) {
+		volinfo->nextfree = prev + 1;
+		volinfo->fsinfodirty = 1;
+		return prev + 1;
+	}
+
+	if (volinfo->freemap) {
+		start = volinfo->nextfree + 1;
+		if (start < 2 || start >= volinfo->numclusters + 2)
+			start = 2;
+		if (count > volinfo->freecount)
+			count = volinfo->freecount;
+		for (; count > 1; count /= 2) {
+			bit = bitmap_scan(volinfo->freemap, start - 2, count, true);
+			if (bit == BITMAP_ERROR)
+				bit = bitmap_scan(volinfo->freemap, 0, count, true);
+			if (bit != BITMAP_ERROR) {
+				volinfo->nextfree = bit + 2;
+				volinfo->fsinfodirty = 1;
+				return bit + 2;
+			}
+		}
+	}
+
+	return DFS_GetFreeFAT(volinfo, scratch);
+}
+
+
+/*
+	Use dcache, an array of count DENTRYs (count a power of two), to remember the
+	results of directory scans, so that opening a recently used path reads no
+	directory sectors. Entries are kept up to date by DFS_OpenFile, DFS_WriteFile
+	and DFS_UnlinkFile.
+*/
+void DFS_CacheDirEnts(PVOLINFO volinfo, PDENTRY dcache, uint32_t count)
+{
+	memset(dcache, 0, count * sizeof(DENTRY));
+	volinfo->dcachesize = count;
+	volinfo->dcache = dcache;
+}
+
+/*
+	INTERNAL
+	Return the physical sector# of the current sector of an open directory
+*/
+static uint32_t DFS_DirSector(PVOLINFO volinfo, PDIRINFO dirinfo)
+{
+	if (dirinfo->currentcluster == 0)
+		return volinfo->rootdir + dirinfo->currentsector;
+	return volinfo->dataarea + ((dirinfo->currentcluster - 2) * volinfo->secperclus) + dirinfo->currentsector;
+}
+
+/*
+	INTERNAL
+	Return the slot of the lookup cache that holds name in directory parent, if any
+*/
+static PDENTRY DFS_DCacheSlot(PVOLINFO volinfo, uint32_t parent, char *name)
+{
+	uint32_t hash = parent, i;
+
+	for (i=0;i<11;i++)
+		hash = hash * 31 + (uint8_t) name[i];
+	return &volinfo->dcache[hash & (volinfo->dcachesize - 1)];
+}
+
+/*
+	INTERNAL
+	Look up name in directory parent in the lookup cache.
+	Returns the cache entry (which may be negative), or NULL on a miss.
+*/
+static PDENTRY DFS_DCacheLookup(PVOLINFO volinfo, uint32_t parent, char *name)
+{
+	PDENTRY pde;
+
+	if (!volinfo->dcache)
+		return NULL;
+
+	pde = DFS_DCacheSlot(volinfo, parent, name);
+	if ((pde->flags & DFS_DE_VALID) && pde->parent == parent && !memcmp(pde->name, name, 11))
+		return pde;
+	return NULL;
+}
+
+/*
+	INTERNAL
+	Remember the result of scanning directory parent for name, replacing whatever
+	the slot held. de is the entry found at dirsector/diroffset, or NULL if the
+	name does not exist. Returns the cache entry, or NULL if there is no cache.
+*/
+static PDENTRY DFS_DCacheInsert(PVOLINFO volinfo, uint32_t parent, char *name, PDIRENT de, uint32_t dirsector, uint8_t diroffset)
+{
+	PDENTRY pde;
+
+	if (!volinfo->dcache)
+		return NULL;
+
+	pde = DFS_DCacheSlot(volinfo, parent, name);
+	pde->parent = parent;
+	memcpy(pde->name, name, 11);
+	if (!de) {
+		pde->flags = DFS_DE_VALID | DFS_DE_NEGATIVE;
+		return pde;
+	}
+
+	pde->flags = DFS_DE_VALID;
+	pde->dirsector = dirsector;
+	pde->diroffset = diroffset;
+	pde->attr = de->attr;
+	pde->startclus = (uint32_t) de->startclus_l_l |
+	  ((uint32_t) de->startclus_l_h) << 8;
+	if (volinfo->filesystem == FAT32) {
+		pde->startclus |= ((uint32_t) de->startclus_h_l) << 16 |
+		  ((uint32_t) de->startclus_h_h) << 24;
+	}
+	pde->filelen = (uint32_t) de->filesize_0 |
+	  ((uint32_t) de->filesize_1) << 8 |
+	  ((uint32_t) de->filesize_2) << 16 |
+	  ((uint32_t) de->filesize_3) << 24;
+	return pde;
 }
 
+/*
+	INTERNAL
+	Return the lookup cache entry of an open file if it still describes the file's
+	directory entry, NULL otherwise
+*/
+static PDENTRY DFS_FileDentry(PFILEINFO fileinfo)
+{
+	PDENTRY pde = fileinfo->dentry;
+
+	if (pde && pde->flags == DFS_DE_VALID && pde->dirsector == fileinfo->dirsector &&
+	  pde->diroffset == fileinfo->diroffset)
+		return pde;
+	return NULL;
+}
 
 /*
 	Open a directory for enumeration by DFS_GetNextDirEnt
@@ -494,54 +888,29 @@ uint32_t DFS_GetFreeFAT(PVOLINFO volinfo, uint8_t *scratch)
 */
 uint32_t DFS_OpenDir(PVOLINFO volinfo, char *dirname, PDIRINFO dirinfo)
 {
-	// Default behavior is a regular search for existing entries
-	dirinfo->flags = 0;
-
-	if (!strlen((char *) dirname) || (strlen((char *) dirname) == 1 && dirname[0] == DIR_SEPARATOR)) {
-		if (volinfo->filesystem == FAT32) {
-			dirinfo->currentcluster = volinfo->rootdir;
-			dirinfo->currentsector = 0;
-			dirinfo->currententry = 0;
+	// Default behavior is a regular search for existing entries. The first sector
+	// is read by DFS_GetNext, so a lookup answered from the cache costs no I/O.
+	dirinfo->flags = DFS_DI_UNREAD;
 
-			// read first sector of directory
-			return DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((volinfo->rootdir - 2) * volinfo->secperclus), 1);
-		}
-		else {
-			dirinfo->currentcluster = 0;
-			dirinfo->currentsector = 0;
-			dirinfo->currententry = 0;
+	if (volinfo->filesystem == FAT32)
+		dirinfo->currentcluster = volinfo->rootdir;
+	else
+		dirinfo->currentcluster = 0;
+	dirinfo->currentsector = 0;
+	dirinfo->currententry = 0;
 
-			// read first sector of directory
-			return DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->rootdir, 1);
-		}
-	}
+	if (!strlen((char *) dirname) || (strlen((char *) dirname) == 1 && dirname[0] == DIR_SEPARATOR))
+		return DFS_OK;
 
 	// This is not the root directory. We need to find the start of this subdirectory.
 	// We do this by devious means, using our own companion function DFS_GetNext.
 	else {
 		char tmpfn[12];
 		char *ptr = dirname;
-		uint32_t result;
+		uint32_t result, parent, cluster;
+		uint8_t attr;
 		DIRENT de;
-
-		if (volinfo->filesystem == FAT32) {
-			dirinfo->currentcluster = volinfo->rootdir;
-			dirinfo->currentsector = 0;
-			dirinfo->currententry = 0;
-
-			// read first sector of directory
-			if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((volinfo->rootdir - 2) * volinfo->secperclus), 1))
-				return DFS_ERRMISC;
-		}
-		else {
-			dirinfo->currentcluster = 0;
-			dirinfo->currentsector = 0;
-			dirinfo->currententry = 0;
-
-			// read first sector of directory
-			if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->rootdir, 1))
-				return DFS_ERRMISC;
-		}
+		PDENTRY pde;
 
 		// skip leading path separators
 		while (*ptr == DIR_SEPARATOR && *ptr)
@@ -551,33 +920,45 @@ uint32_t DFS_OpenDir(PVOLINFO volinfo, char *dirname, PDIRINFO dirinfo)
 		// Observe that this code is inelegant, but obviates the need for recursion.
 		while (*ptr) {
 			DFS_CanonicalToDir(tmpfn, ptr);
+			parent = dirinfo->currentcluster;
+
+			pde = DFS_DCacheLookup(volinfo, parent, tmpfn);
+			if (pde && (pde->flags & DFS_DE_NEGATIVE))
+				return DFS_NOTFOUND;
+			else if (pde) {
+				attr = pde->attr;
+				cluster = pde->startclus;
+			}
+			else {
+				de.name[0] = 0;
 
-			de.name[0] = 0;
+				do {
+					result = DFS_GetNext(volinfo, dirinfo, &de);
+				} while (!result && memcmp(de.name, tmpfn, 11));
 
-			do {
-				result = DFS_GetNext(volinfo, dirinfo, &de);
-			} while (!result && memcmp(de.name, tmpfn, 11));
+				if (result == DFS_EOF)
+					DFS_DCacheInsert(volinfo, parent, tmpfn, NULL, 0, 0);
+				if (result)
+					return DFS_NOTFOUND;
 
-			if (!memcmp(de.name, tmpfn, 11) && ((de.attr & ATTR_DIRECTORY) == ATTR_DIRECTORY)) {
+				DFS_DCacheInsert(volinfo, parent, tmpfn, &de, DFS_DirSector(volinfo, dirinfo), dirinfo->currententry - 1);
+				attr = de.attr;
+				cluster = (uint32_t) de.startclus_l_l |
+				  ((uint32_t) de.startclus_l_h) << 8;
 				if (volinfo->filesystem == FAT32) {
-					dirinfo->currentcluster = (uint32_t) de.startclus_l_l |
-					  ((uint32_t) de.startclus_l_h) << 8 |
-					  ((uint32_t) de.startclus_h_l) << 16 |
+					cluster |= ((uint32_t) de.startclus_h_l) << 16 |
 					  ((uint32_t) de.startclus_h_h) << 24;
 				}
-				else {
-					dirinfo->currentcluster = (uint32_t) de.startclus_l_l |
-					  ((uint32_t) de.startclus_l_h) << 8;
-				}
-				dirinfo->currentsector = 0;
-				dirinfo->currententry = 0;
-
-				if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, volinfo->dataarea + ((dirinfo->currentcluster - 2) * volinfo->secperclus), 1))
-					return DFS_ERRMISC;
 			}
-			else if (!memcmp(de.name, tmpfn, 11) && !(de.attr & ATTR_DIRECTORY))
+
+			if (!(attr & ATTR_DIRECTORY))
 				return DFS_NOTFOUND;
 
+			dirinfo->currentcluster = cluster;
+			dirinfo->currentsector = 0;
+			dirinfo->currententry = 0;
+			dirinfo->flags = DFS_DI_UNREAD;
+
 			// seek to next item in list
 			while (*ptr != DIR_SEPARATOR && *ptr)
 				ptr++;
@@ -605,6 +986,13 @@ uint32_t DFS_GetNext(PVOLINFO volinfo, PDIRINFO dirinfo, PDIRENT dirent)
 {
 	uint32_t tempint;	// required by DFS_GetFAT
 
+	// DFS_OpenDir leaves the first sector for us to read
+	if (dirinfo->flags & DFS_DI_UNREAD) {
+		dirinfo->flags &= ~DFS_DI_UNREAD;
+		if (DFS_ReadSector(volinfo->unit, dirinfo->scratch, DFS_DirSector(volinfo, dirinfo), 1))
+			return DFS_ERRMISC;
+	}
+
 	// Do we need to read the next sector of the directory?
 	if (dirinfo->currententry >= SECTOR_SIZE / sizeof(DIRENT)) {
 		dirinfo->currententry = 0;
@@ -758,6 +1146,40 @@ uint32_t DFS_GetFreeDirEnt(PVOLINFO volinfo, char *path, PDIRINFO di, PDIRENT de
 	return DFS_ERRMISC;
 }
 
+/*
+	INTERNAL
+	Record in the extent map of fileinfo that clusters #index..#index+count-1 of the
+	file are the contiguous disk clusters starting at cluster. Only the part that
+	extends the mapped prefix of the file is kept; if the map is full, nothing is.
+*/
+static void DFS_MapRun(PFILEINFO fileinfo, uint32_t index, uint32_t cluster, uint32_t count)
+{
+	PEXTENT last = NULL;
+	uint32_t mapped = 0;
+
+	// end-of-chain and bad cluster markers are not clusters
+	if (cluster < 2 || cluster + count > fileinfo->volinfo->numclusters + 2)
+		return;
+
+	if (fileinfo->nextents) {
+		last = &fileinfo->extents[fileinfo->nextents - 1];
+		mapped = last->fileclus + last->count;
+	}
+	if (index > mapped || index + count <= mapped)
+		return;
+
+	cluster += mapped - index;
+	count -= mapped - index;
+	if (last && last->diskclus + last->count == cluster)
+		last->count += count;
+	else if (fileinfo->nextents < DFS_MAXEXTENTS) {
+		last = &fileinfo->extents[fileinfo->nextents++];
+		last->fileclus = mapped;
+		last->diskclus = cluster;
+		last->count = count;
+	}
+}
+
 /*
 	Open a file for reading or writing. You supply populated VOLINFO, a path to the file,
 	mode (DFS_READ or DFS_WRITE) and an empty fileinfo structure. You also need to
@@ -772,11 +1194,17 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 	char *p;
 	DIRINFO di;
 	DIRENT de;
-	uint32_t temp;
+	uint32_t temp, parent, result = DFS_OK;
+	PDENTRY pde;
 
 	// larwe 2006-09-16 +1 zero out file structure
 	memset(fileinfo, 0, sizeof(FILEINFO));
 
+	// Callers pass uninitialized handles (on the stack or from kmalloc). The extent
+	// map and the lookup cache link must be empty on every return path below
+	fileinfo->nextents = 0;
+	fileinfo->dentry = NULL;
+
 	// save access mode
 	fileinfo->mode = mode;
 
@@ -813,8 +1241,27 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 	di.scratch = scratch;
 	if (DFS_OpenDir(volinfo, tmppath, &di))
 		return DFS_NOTFOUND;
+	parent = di.currentcluster;
 
-	while (!DFS_GetNext(volinfo, &di, &de)) {
+	// A cached lookup opens the file without reading the directory at all
+	pde = DFS_DCacheLookup(volinfo, parent, filename);
+	if (pde && !(pde->flags & DFS_DE_NEGATIVE)) {
+		if (pde->attr & ATTR_DIRECTORY)
+			return DFS_NOTFOUND;
+
+		fileinfo->volinfo = volinfo;
+		fileinfo->pointer = 0;
+		fileinfo->dirsector = pde->dirsector;
+		fileinfo->diroffset = pde->diroffset;
+		fileinfo->cluster = pde->startclus;
+		fileinfo->firstcluster = pde->startclus;
+		fileinfo->filelen = pde->filelen;
+		fileinfo->dentry = pde;
+		DFS_MapRun(fileinfo, 0, fileinfo->firstcluster, 1);
+		return DFS_OK;
+	}
+
+	while (!pde && !(result = DFS_GetNext(volinfo, &di, &de))) {
 		if (!memcmp(de.name, filename, 11)) {
 			// You can't use this function call to open a directory.
 			if (de.attr & ATTR_DIRECTORY)
@@ -845,11 +1292,18 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 			  ((uint32_t) de.filesize_1) << 8 |
 			  ((uint32_t) de.filesize_2) << 16 |
 			  ((uint32_t) de.filesize_3) << 24;
+			fileinfo->dentry = DFS_DCacheInsert(volinfo, parent, filename, &de, fileinfo->dirsector, fileinfo->diroffset);
+			// seed the extent map so that the first seek can extend it from cluster 0
+			DFS_MapRun(fileinfo, 0, fileinfo->firstcluster, 1);
 
 			return DFS_OK;
 		}
 	}
 
+	// Remember that the name is not there, unless the scan was cut short by an error
+	if (!pde && result == DFS_EOF)
+		DFS_DCacheInsert(volinfo, parent, filename, NULL, 0, 0);
+
 	// At this point, we KNOW the file does not exist. If the file was opened
 	// with write access, we can create it.
 	if (mode & DFS_WRITE) {
@@ -895,6 +1349,7 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 		fileinfo->cluster = cluster;
 		fileinfo->firstcluster = cluster;
 		fileinfo->filelen = 0;
+		DFS_MapRun(fileinfo, 0, fileinfo->firstcluster, 1);
 
 		// write the directory entry
 		// note that we no longer have the sector containing the directory entry,
@@ -905,6 +1360,9 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 		if (DFS_WriteSector(volinfo->unit, scratch, fileinfo->dirsector, 1))
 			return DFS_ERRMISC;
 
+		// the new entry replaces the negative one left by the lookup above
+		fileinfo->dentry = DFS_DCacheInsert(volinfo, parent, filename, &de, fileinfo->dirsector, fileinfo->diroffset);
+
 		// Mark newly allocated cluster as end of chain
 		switch(volinfo->filesystem) {
 			case FAT12:		cluster = 0xff8;	break;
@@ -915,12 +1373,37 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 		temp = 0;
 		DFS_SetFAT(volinfo, scratch, &temp, fileinfo->cluster, cluster);
 
-		return DFS_OK;
+		return DFS_FlushFAT(volinfo, scratch);
 	}
 
 	return DFS_NOTFOUND;
 }
 
+/*
+	INTERNAL
+	Binary-search the extent map of fileinfo for cluster #index of the file.
+	Returns nonzero and sets *cluster if it is mapped, 0 otherwise.
+*/
+static int DFS_LookupCluster(PFILEINFO fileinfo, uint32_t index, uint32_t *cluster)
+{
+	int lo = 0, hi = (int) fileinfo->nextents - 1, mid;
+	PEXTENT e;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		e = &fileinfo->extents[mid];
+		if (index < e->fileclus)
+			hi = mid - 1;
+		else if (index >= e->fileclus + e->count)
+			lo = mid + 1;
+		else {
+			*cluster = e->diskclus + (index - e->fileclus);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
 	Read an open file
 	You must supply a prepopulated FILEINFO as provided by DFS_OpenFile, and a
@@ -930,10 +1413,12 @@ uint32_t DFS_OpenFile(PVOLINFO volinfo, char *path, uint8_t mode, uint8_t *scrat
 */
 uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uint32_t *successcount, uint32_t len)
 {
+	PVOLINFO volinfo = fileinfo->volinfo;
+	uint32_t clustersize = volinfo->secperclus * SECTOR_SIZE;
 	uint32_t remain=0;
 	uint32_t result = DFS_OK;
-	uint32_t sector=0;
-	uint32_t bytesread=0;
+	uint32_t sector=0, offset=0, count=0;
+	uint32_t run=0, next=0, crossed=0, tempint=0;
 
 	// Don't try to read past EOF
 	if (len > fileinfo->filelen - fileinfo->pointer)
@@ -943,85 +1428,65 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 	*successcount = 0;
 
 	while (remain && result == DFS_OK) {
-		// This is a bit complicated. The sector we want to read is addressed at a cluster
-		// granularity by the fileinfo->cluster member. The file pointer tells us how many
-		// extra sectors to add to that number.
-		sector = fileinfo->volinfo->dataarea +
-		  ((fileinfo->cluster - 2) * fileinfo->volinfo->secperclus) +
-		  div(div(fileinfo->pointer,fileinfo->volinfo->secperclus * SECTOR_SIZE).rem, SECTOR_SIZE).quot;
-
-		// Case 1 - File pointer is not on a sector boundary
-		if (div(fileinfo->pointer, SECTOR_SIZE).rem) {
-			uint16_t tempreadsize;
-
-			// We always have to go through scratch in this case
-			result = DFS_ReadSector(fileinfo->volinfo->unit, scratch, sector, 1);
-
-			// This is the number of bytes that we actually care about in the sector
-			// just read.
-			tempreadsize = SECTOR_SIZE - (div(fileinfo->pointer, SECTOR_SIZE).rem);
-
-			// Case 1A - We want the entire remainder of the sector. After this
-			// point, all passes through the read loop will be aligned on a sector
-			// boundary, which allows us to go through the optimal path 2A below.
-		   	if (remain >= tempreadsize) {
-				memcpy(buffer, scratch + (SECTOR_SIZE - tempreadsize), tempreadsize);
-				bytesread = tempreadsize;
-				buffer += tempreadsize;
-				fileinfo->pointer += tempreadsize;
-				remain -= tempreadsize;
-			}
-			// Case 1B - This read concludes the file read operation
-			else {
-				memcpy(buffer, scratch + (SECTOR_SIZE - tempreadsize), remain);
-
-				buffer += remain;
-				fileinfo->pointer += remain;
-				bytesread = remain;
-				remain = 0;
-			}
+		// The sector we want is addressed at a cluster granularity by the
+		// fileinfo->cluster member; offset is the file pointer within that cluster.
+		offset = fileinfo->pointer % clustersize;
+		sector = volinfo->dataarea + ((fileinfo->cluster - 2) * volinfo->secperclus) + offset / SECTOR_SIZE;
+		run = 0;
+		DFS_MapRun(fileinfo, fileinfo->pointer / clustersize, fileinfo->cluster, 1);
+
+		// Case 1 - File pointer is not on a sector boundary, or less than a sector
+		// is left. Only the unaligned head and tail of a read go through scratch.
+		if ((offset % SECTOR_SIZE) || remain < SECTOR_SIZE) {
+			result = DFS_ReadSector(volinfo->unit, scratch, sector, 1);
+			if (result)
+				break;
+
+			count = SECTOR_SIZE - (offset % SECTOR_SIZE);
+			if (count > remain)
+				count = remain;
+			memcpy(buffer, scratch + (offset % SECTOR_SIZE), count);
 		}
-		// Case 2 - File pointer is on sector boundary
+		// Case 2 - Whole sectors. Read to the end of this cluster and on through the
+		// following clusters for as long as the chain stays physically contiguous,
+		// all in one request straight into the caller's buffer.
 		else {
-			// Case 2A - We have at least one more full sector to read and don't have
-			// to go through the scratch buffer. You could insert optimizations here to
-			// read multiple sectors at a time, if you were thus inclined (note that
-			// the maximum multi-read you could perform is a single cluster, so it would
-			// be advantageous to have code similar to case 1A above that would round the
-			// pointer to a cluster boundary the first pass through, so all subsequent
-			// [large] read requests would be able to go a cluster at a time).
-			if (remain >= SECTOR_SIZE) {
-				result = DFS_ReadSector(fileinfo->volinfo->unit, buffer, sector, 1);
-				remain -= SECTOR_SIZE;
-				buffer += SECTOR_SIZE;
-				fileinfo->pointer += SECTOR_SIZE;
-				bytesread = SECTOR_SIZE;
-			}
-			// Case 2B - We are only reading a partial sector
-			else {
-				result = DFS_ReadSector(fileinfo->volinfo->unit, scratch, sector, 1);
-				memcpy(buffer, scratch, remain);
-				buffer += remain;
-				fileinfo->pointer += remain;
-				bytesread = remain;
-				remain = 0;
+			count = clustersize - offset;
+			while (count < remain) {
+				next = DFS_GetFAT(volinfo, scratch, &tempint, fileinfo->cluster + run);
+				if (next != fileinfo->cluster + run + 1 || next >= volinfo->numclusters + 2)
+					break;
+				run++;
+				count += clustersize;
 			}
+			DFS_MapRun(fileinfo, fileinfo->pointer / clustersize, fileinfo->cluster, run + 1);
+			if (count > remain)
+				count = remain - (remain % SECTOR_SIZE);
+
+			result = DFS_ReadSector(volinfo->unit, buffer, sector, count / SECTOR_SIZE);
+			if (result)
+				break;
 		}
 
-		*successcount += bytesread;
+		buffer += count;
+		remain -= count;
+		*successcount += count;
 
-		// check to see if we stepped over a cluster boundary
-		if (div(fileinfo->pointer - bytesread, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot !=
-		  div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot) {
-			// An act of minor evil - we use bytesread as a scratch integer, knowing that
-			// its value is not used after updating *successcount above
-			bytesread = 0;
-			if (((fileinfo->volinfo->filesystem == FAT12) && (fileinfo->cluster >= 0xff8)) ||
-			  ((fileinfo->volinfo->filesystem == FAT16) && (fileinfo->cluster >= 0xfff8)) ||
-			  ((fileinfo->volinfo->filesystem == FAT32) && (fileinfo->cluster >= 0x0ffffff8)))
+		// Move to the cluster holding the new file pointer. Crossings inside the
+		// contiguous run need no FAT lookup; only stepping off its last cluster does.
+		crossed = (fileinfo->pointer + count) / clustersize - fileinfo->pointer / clustersize;
+		fileinfo->pointer += count;
+		if (crossed <= run)
+			fileinfo->cluster += crossed;
+		else {
+			fileinfo->cluster += run;
+			tempint = 0;
+			if (((volinfo->filesystem == FAT12) && (fileinfo->cluster >= 0xff8)) ||
+			  ((volinfo->filesystem == FAT16) && (fileinfo->cluster >= 0xfff8)) ||
+			  ((volinfo->filesystem == FAT32) && (fileinfo->cluster >= 0x0ffffff8)))
 				result = DFS_EOF;
 			else
-				fileinfo->cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &bytesread, fileinfo->cluster);
+				fileinfo->cluster = DFS_GetFAT(volinfo, scratch, &tempint, fileinfo->cluster);
 		}
 	}
 
@@ -1036,8 +1501,8 @@ uint32_t DFS_ReadFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, uin
 */
 void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch)
 {
-	uint32_t tempint;
-	uint16_t endcluster=0;  //canny/reza 5/7 fixed
+	uint32_t clustersize = fileinfo->volinfo->secperclus * SECTOR_SIZE;
+	uint32_t index, target, cluster, tempint = 0;
 
 	// larwe 9/16/06 bugfix split case 0a/0b and changed fallthrough handling
 	// Case 0a - Return immediately for degenerate case
@@ -1058,49 +1523,45 @@ void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch)
 		fileinfo->pointer = 0;
 		return;		// larwe 9/16/06 +1 bugfix
 	}
-	// Case 2 - Seeking backwards. Need to reset and seek forwards
-	else if (offset < fileinfo->pointer) {
-		fileinfo->cluster = fileinfo->firstcluster;
-		fileinfo->pointer = 0;
-		// NOTE NO RETURN HERE!
-	}
-
-	// Case 3 - Seeking forwards
-	// Note _intentional_ fallthrough from Case 2 above
 
-	// Case 3a - Seek size does not cross cluster boundary -
-	// very simple case
-	// larwe 9/16/06 changed .rem to .quot in both div calls, bugfix
-	if (div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot ==
-	  div(fileinfo->pointer + offset, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot) {
+	// Case 2 - The extent map knows the target cluster; no FAT access at all
+	target = offset / clustersize;
+	if (DFS_LookupCluster(fileinfo, target, &cluster)) {
+		fileinfo->cluster = cluster;
 		fileinfo->pointer = offset;
+		return;
 	}
-	// Case 3b - Seeking across cluster boundary(ies)
-	else {
-		// round file pointer down to cluster boundary
-		fileinfo->pointer = div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot *
-		  fileinfo->volinfo->secperclus * SECTOR_SIZE;
-
-		// seek by clusters
-		// larwe 9/30/06 bugfix changed .rem to .quot in both div calls
-		// canny/reza 5/7  added endcluster related code
-		// TK 2008-12-18: fixed endcluster calculation
-		// old: endcluster = div(fileinfo->pointer + offset, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot;
-		endcluster = div(offset, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot;
-		while (div(fileinfo->pointer, fileinfo->volinfo->secperclus * SECTOR_SIZE).quot !=endcluster) {
-			fileinfo->cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &tempint, fileinfo->cluster);
-			// Abort if there was an error
-			if (fileinfo->cluster == 0x0ffffff7) {
-				fileinfo->pointer = 0;
-				fileinfo->cluster = fileinfo->firstcluster;
-				return;
-			}
-			fileinfo->pointer += SECTOR_SIZE * fileinfo->volinfo->secperclus;
-		}
 
-		// since we know the cluster is right, we have no more work to do
-		fileinfo->pointer = offset;
+	// Case 3 - Walk the chain forwards, starting from the last mapped cluster or
+	// from the current cluster, whichever is closer to the target. The map must
+	// start at cluster 0, or nothing the walk finds can be added to it
+	DFS_MapRun(fileinfo, 0, fileinfo->firstcluster, 1);
+	index = 0;
+	cluster = fileinfo->firstcluster;
+	if (fileinfo->nextents) {
+		PEXTENT last = &fileinfo->extents[fileinfo->nextents - 1];
+		index = last->fileclus + last->count - 1;
+		cluster = last->diskclus + last->count - 1;
+	}
+	if (fileinfo->pointer / clustersize > index && fileinfo->pointer / clustersize <= target) {
+		index = fileinfo->pointer / clustersize;
+		cluster = fileinfo->cluster;
 	}
+
+	while (index != target) {
+		cluster = DFS_GetFAT(fileinfo->volinfo, scratch, &tempint, cluster);
+		// Abort if there was an error
+		if (cluster == 0x0ffffff7) {
+			fileinfo->pointer = 0;
+			fileinfo->cluster = fileinfo->firstcluster;
+			return;
+		}
+		index++;
+		DFS_MapRun(fileinfo, index, cluster, 1);
+	}
+
+	fileinfo->cluster = cluster;
+	fileinfo->pointer = offset;
 }
 
 /*
@@ -1110,6 +1571,7 @@ void DFS_Seek(PFILEINFO fileinfo, uint32_t offset, uint8_t *scratch)
 uint32_t DFS_UnlinkFile(PVOLINFO volinfo, char *path, uint8_t *scratch)
 {
 	FILEINFO fi;
+	PDENTRY pde;
 	uint32_t cache = 0;
 	uint32_t tempclus = 0;
 
@@ -1124,6 +1586,10 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, char *path, uint8_t *scratch)
 	if (DFS_WriteSector(volinfo->unit, scratch, fi.dirsector, 1))
 		return DFS_ERRMISC;
 
+	// the cached lookup now has to say the file is gone
+	if ((pde = DFS_FileDentry(&fi)))
+		pde->flags |= DFS_DE_NEGATIVE;
+
 	// Now follow the cluster chain to free the file space
 	while (!((volinfo->filesystem == FAT12 && fi.firstcluster >= 0x0ff7) ||
 	  (volinfo->filesystem == FAT16 && fi.firstcluster >= 0xfff7) ||
@@ -1134,7 +1600,7 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, char *path, uint8_t *scratch)
 		DFS_SetFAT(volinfo, scratch, &cache, tempclus, 0);
 
 	}
-	return DFS_OK;
+	return DFS_FlushFAT(volinfo, scratch);
 }
 
 
@@ -1166,6 +1632,9 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		  ((fileinfo->cluster - 2) * fileinfo->volinfo->secperclus) +
 		  div(div(fileinfo->pointer,fileinfo->volinfo->secperclus * SECTOR_SIZE).rem, SECTOR_SIZE).quot;
 
+		// remember where this cluster is, including clusters allocated below
+		DFS_MapRun(fileinfo, fileinfo->pointer / (fileinfo->volinfo->secperclus * SECTOR_SIZE), fileinfo->cluster, 1);
+
 		// Case 1 - File pointer is not on a sector boundary
 		if (div(fileinfo->pointer, SECTOR_SIZE).rem) {
 			uint16_t tempsize;
@@ -1274,7 +1743,9 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 			  ((fileinfo->volinfo->filesystem == FAT32) && (fileinfo->cluster >= 0x0ffffff8))) {
 			  	uint32_t tempclus;
 
-				tempclus = DFS_GetFreeFAT(fileinfo->volinfo, scratch);
+				// ask for enough clusters to hold the rest of this write in one run
+				tempclus = DFS_GetFreeRun(fileinfo->volinfo, scratch, lastcluster,
+				  remain / (fileinfo->volinfo->secperclus * SECTOR_SIZE) + 1);
 				byteswritten = 0; // invalidate cache
 				if (tempclus == 0x0ffffff7)
 					return DFS_ERRMISC;
@@ -1307,6 +1778,12 @@ uint32_t DFS_WriteFile(PFILEINFO fileinfo, uint8_t *scratch, uint8_t *buffer, ui
 		((PDIRENT) scratch)[fileinfo->diroffset].filesize_3 = (fileinfo->filelen & 0xff000000) >> 24;
 		if (DFS_WriteSector(fileinfo->volinfo->unit, scratch, fileinfo->dirsector, 1))
 			return DFS_ERRMISC;
+		if (DFS_FileDentry(fileinfo))
+			fileinfo->dentry->filelen = fileinfo->filelen;
+
+	// write out the FAT entries of any clusters allocated above in one batch
+	if (DFS_FlushFAT(fileinfo->volinfo, scratch))
+		return DFS_ERRMISC;
 	return result;
 }
 
@@ -8,6 +8,8 @@
 
 #include <stdint.h>
 
+struct bitmap;
+
 //===================================================================
 // User-supplied functions
 uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_t count);
@@ -20,6 +22,9 @@ uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer, uint32_t sector, uint32_
 								// GREATLY increase stack requirements!)
 #define DIR_SEPARATOR	'/'		// character separating directory components
 
+#define DFS_MAXEXTENTS	16		// extents remembered per open file; seeks past the
+								// mapped part of a more fragmented file walk the FAT
+
 // End of configurable items
 //===================================================================
 
@@ -208,6 +213,26 @@ typedef struct _tagEBPB32 {
 	uint8_t system[8];			// filesystem ID
 } EBPB32, *PEBPB32;
 
+/*
+	FAT32 FSInfo sector structure
+	The two hints are advisory; 0xffffffff means unknown.
+*/
+typedef struct _tagFSINFO {
+	uint8_t leadsig[4];			// "RRaA" (0x41615252)
+	uint8_t reserved1[480];		// reserved, should be 0
+	uint8_t strucsig[4];		// "rrAa" (0x61417272)
+	uint8_t free_0;				// last known free cluster count, low byte
+	uint8_t free_1;				//
+	uint8_t free_2;				//
+	uint8_t free_3;				// last known free cluster count, high byte
+	uint8_t next_0;				// cluster to start looking for free clusters after, low byte
+	uint8_t next_1;				//
+	uint8_t next_2;				//
+	uint8_t next_3;				// cluster to start looking for free clusters after, high byte
+	uint8_t reserved2[12];		// reserved, should be 0
+	uint8_t trailsig[4];		// 0x00 0x00 0x55 0xaa
+} FSINFO, *PFSINFO;
+
 /*
 	Logical Boot Record structure (volume boot sector)
 */
@@ -224,6 +249,28 @@ typedef struct _tagLBR {
 	uint8_t sig_aa;				// 0xaa signature byte
 } LBR, *PLBR;
 
+/*
+	Flags in DENTRY.flags
+*/
+#define DFS_DE_VALID		0x01	// slot holds a cached lookup
+#define DFS_DE_NEGATIVE		0x02	// name is known not to exist in parent
+
+/*
+	Directory lookup cache entry (Internal to DOSFS)
+	Maps (start cluster of the parent directory, 8.3 name) to what a directory scan
+	would find there. The root directory of FAT12/16 volumes has parent 0.
+*/
+typedef struct _tagDENTRY {
+	uint32_t parent;			// first cluster of the directory searched
+	uint8_t name[11];			// name as stored in the directory entry
+	uint8_t flags;				// DFS_DE_* flags
+	uint32_t dirsector;			// physical sector containing the entry
+	uint8_t diroffset;			// # of the entry within that sector
+	uint8_t attr;				// attributes of the entry
+	uint32_t startclus;			// first cluster of the file or directory
+	uint32_t filelen;			// byte length of the file
+} DENTRY, *PDENTRY;
+
 /*
 	Volume information structure (Internal to DOSFS)
 */
@@ -252,12 +299,32 @@ typedef struct _tagVOLINFO {
 	uint32_t fat1;				// starting sector# of FAT copy 1
 	uint32_t rootdir;			// starting sector# of root directory (FAT12/FAT16) or cluster (FAT32)
 	uint32_t dataarea;			// starting sector# of data area (cluster #2)
+
+	// In-memory FAT, see DFS_CacheFAT. When fat is non-NULL, DFS_GetFAT and DFS_SetFAT
+	// work on RAM only and DFS_FlushFAT writes the dirty sectors to both FAT copies.
+	uint8_t *fat;				// copy of FAT #1, secperfat sectors
+	struct bitmap *fatdirty;	// one bit per FAT sector changed since the last flush
+
+	// Free cluster accounting. freecount and nextfree are loaded from the FAT32 FSInfo
+	// sector and written back by DFS_FlushFAT; with freemap (see DFS_CacheFreeMap)
+	// free clusters are found without reading the FAT and freecount is exact.
+	struct bitmap *freemap;		// one bit per cluster, bit n set if cluster n+2 is free
+	uint32_t freecount;			// number of free clusters, 0xffffffff if unknown
+	uint32_t nextfree;			// searches for a free cluster start after this one
+	uint32_t fsinfo;			// physical sector# of the FSInfo sector, 0 if none
+	uint8_t fsinfodirty;		// freecount or nextfree changed since the last flush
+
+	// Directory lookup cache, see DFS_CacheDirEnts. A hashed, direct-mapped table of
+	// dcachesize (a power of two) entries, or NULL if path lookups always scan.
+	PDENTRY dcache;
+	uint32_t dcachesize;
 } VOLINFO, *PVOLINFO;
 
 /*
 	Flags in DIRINFO.flags
 */
 #define DFS_DI_BLANKENT		0x01	// Searching for blank entry
+#define DFS_DI_UNREAD		0x02	// Current sector not read into scratch yet
 
 /*
 	Directory search structure (Internal to DOSFS)
@@ -270,6 +337,15 @@ typedef struct _tagDIRINFO {
 	uint8_t flags;				// internal DOSFS flags
 } DIRINFO, *PDIRINFO;
 
+/*
+	One run of physically contiguous clusters of a file (Internal to DOSFS)
+*/
+typedef struct _tagEXTENT {
+	uint32_t fileclus;			// index of the first cluster of the run within the file
+	uint32_t diskclus;			// cluster number of that cluster on disk
+	uint32_t count;				// number of clusters in the run
+} EXTENT, *PEXTENT;
+
 /*
 	File handle structure (Internal to DOSFS)
 */
@@ -283,6 +359,13 @@ typedef struct _tagFILEINFO {
 
 	uint32_t cluster;			// current cluster
 	uint32_t pointer;			// current (BYTE) pointer
+
+	// Extent map of the cluster chain, filled in as the chain is walked. It covers
+	// a prefix of the file, so DFS_Seek within that prefix is a binary search.
+	uint32_t nextents;			// extents in use
+	EXTENT extents[DFS_MAXEXTENTS];
+
+	PDENTRY dentry;				// lookup cache entry of this file, NULL if none
 } FILEINFO, *PFILEINFO;
 
 /*
@@ -376,6 +459,36 @@ uint32_t DFS_UnlinkFile(PVOLINFO volinfo, char *path, uint8_t *scratch);
 */
 uint32_t DFS_GetFAT(PVOLINFO volinfo, uint8_t *scratch, uint32_t *scratchcache, uint32_t cluster);
 
+/*
+	Load FAT #1 of the volume into fat, a buffer of secperfat sectors, and use it
+	for all later FAT accesses. dirty must have one bit per FAT sector.
+	Returns 0 OK, nonzero for any error (the volume is then left uncached).
+*/
+uint32_t DFS_CacheFAT(PVOLINFO volinfo, uint8_t *fat, struct bitmap *dirty);
+
+/*
+	Write the FAT sectors changed since the last flush to both FAT copies, merging
+	adjacent dirty sectors into one request, then update the FAT32 FSInfo hints if
+	they changed. scratch must point to a sector-sized buffer.
+	Returns 0 OK, nonzero for any error.
+*/
+uint32_t DFS_FlushFAT(PVOLINFO volinfo, uint8_t *scratch);
+
+/*
+	Scan the FAT once and keep the free clusters in freemap, a bitmap of numclusters
+	bits, so that DFS_GetFreeFAT no longer reads the FAT. freecount becomes exact.
+	Returns 0 OK, nonzero for any error (the map is then not used).
+*/
+uint32_t DFS_CacheFreeMap(PVOLINFO volinfo, uint8_t *scratch, struct bitmap *freemap);
+
+/*
+	Use dcache, an array of count DENTRYs (count a power of two), to remember the
+	results of directory scans, so that opening a recently used path reads no
+	directory sectors. Entries are kept up to date by DFS_OpenFile, DFS_WriteFile
+	and DFS_UnlinkFile.
+*/
+void DFS_CacheDirEnts(PVOLINFO volinfo, PDENTRY dcache, uint32_t count);
+
 /*
 // TK: added 2009-02-12
         Close a file
@@ -85,6 +85,15 @@ typedef struct {
 	Elf32_Word	p_align;	/* memory/file alignment */
 } Elf32_Phdr;
 
+/*程序头表最多的表项数，程序头表由对象缓存分配*/
+#define ELF_MAX_PHDR 16
+static struct kmem_cache *g_phdr_cache;
+
+void init_aout()
+{
+    g_phdr_cache = kmem_cache_create("phdr", sizeof(Elf32_Phdr)*ELF_MAX_PHDR, 0, NULL);
+}
+
 uint32_t load_aout(VOLINFO *pvi, char *filename)
 {
     FILEINFO fi;
@@ -116,13 +125,22 @@ uint32_t load_aout(VOLINFO *pvi, char *filename)
         return 0;
     }
 
-    Elf32_Phdr *phdr = (Elf32_Phdr *)kmalloc(ehdr.e_phentsize*ehdr.e_phnum);
+    if(ehdr.e_phentsize != sizeof(Elf32_Phdr) || ehdr.e_phnum > ELF_MAX_PHDR) {
+        printk("task #%d: unsupported program headers in %s\r\n",
+            sys_task_getid(), filename);
+        return 0;
+    }
+
+    /*程序头表来自对象缓存*/
+    Elf32_Phdr *phdr = (Elf32_Phdr *)kmem_cache_alloc(g_phdr_cache);
+    if(phdr == NULL)
+        return 0;
     DFS_Seek(&fi, ehdr.e_phoff, scratch);
     DFS_ReadFile(&fi, scratch, (uint8_t *)phdr, &read, ehdr.e_phentsize*ehdr.e_phnum);
     if(read != ehdr.e_phentsize*ehdr.e_phnum) {
         printk("task #%d: bad executable file %s\r\n",
             sys_task_getid(), filename);
-        kfree(phdr);
+        kmem_cache_free(g_phdr_cache, phdr);
         return 0;
     }
 
@@ -144,7 +162,7 @@ uint32_t load_aout(VOLINFO *pvi, char *filename)
                     sys_task_getid(),
                     PAGE_TRUNCATE(phdr[i].p_vaddr),
                     npages);
-                kfree(phdr);
+                kmem_cache_free(g_phdr_cache, phdr);
                 return 0;
             }
 
@@ -153,7 +171,7 @@ uint32_t load_aout(VOLINFO *pvi, char *filename)
             if(read != phdr[i].p_filesz) {
                 printk("task #%d: bad executable file %s\r\n",
                     sys_task_getid(), filename);
-                kfree(phdr);
+                kmem_cache_free(g_phdr_cache, phdr);
                 return 0;
             }
             if(phdr[i].p_memsz > phdr[i].p_filesz)
@@ -165,7 +183,7 @@ uint32_t load_aout(VOLINFO *pvi, char *filename)
         }
     }
 
-    kfree(phdr);
+    kmem_cache_free(g_phdr_cache, phdr);
     return ehdr.e_entry;
 }
 #endif /*__ELF__*/
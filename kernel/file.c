@@ -0,0 +1,523 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include "kernel.h"
+#include "dosfs.h"
+#include "bitmap.h"
+
+extern VOLINFO g_volinfo;
+
+/**
+ * 打开的文件
+ *
+ * 进程的文件描述符表和文件映射（vsmap）都引用它，
+ * 引用计数降为0时才真正关闭
+ */
+struct file {
+    FILEINFO fi;
+    int      flags;      //open时的O_*标志
+    uint32_t pos;        //read/write的当前位置
+    int      refcnt;
+
+    /*预读状态*/
+    uint32_t ra_next;    //下一次顺序读的位置
+    uint32_t ra_end;     //已经请求预读到这个位置
+    int      ra_window;  //预读窗口的页面数
+    int      ra_max;     //窗口的上限，0表示不预读
+};
+
+#define RA_MIN 4         /*预读窗口的初始页面数*/
+#define RA_MAX 32        /*预读窗口的最大页面数，即128KiB*/
+
+/*DOSFS不可重入，用信号量保护对FAT文件系统的访问*/
+static int g_fs_sem;
+static uint8_t g_fs_scratch[SECTOR_SIZE];
+
+#define fs_lock()   sys_sem_wait(g_fs_sem)
+#define fs_unlock() sys_sem_signal(g_fs_sem)
+
+#define FAT_CACHE_MAX (4*1024*1024)    /*FAT不超过这个大小才整个读进内存*/
+#define NR_DENTRY     256               /*目录项查找缓存的项数，必须是2的幂*/
+
+/**
+ * 把FAT整个读进内存，之后查找和修改FAT表项都不用访问磁盘
+ */
+static void cache_fat()
+{
+    uint32_t size = g_volinfo.secperfat * SECTOR_SIZE, mapsize;
+    uint8_t *fat, *map;
+
+    if(size > FAT_CACHE_MAX)
+        return;
+
+    mapsize = bitmap_buf_size(g_volinfo.secperfat);
+    fat = (uint8_t *)kmalloc(size);
+    map = (uint8_t *)kmalloc(mapsize);
+    if(fat != NULL && map != NULL &&
+       DFS_CacheFAT(&g_volinfo, fat,
+                    bitmap_create_in_buf(g_volinfo.secperfat, map, mapsize)) == DFS_OK) {
+        printk("task #%d: FAT cached in memory, %dKiB\r\n",
+               sys_task_getid(), size/1024);
+        return;
+    }
+
+    kfree(fat);
+    kfree(map);
+}
+
+/**
+ * 用位图记录空闲的簇，分配簇时不必再扫描FAT
+ */
+static void cache_freemap()
+{
+    uint32_t mapsize = bitmap_buf_size(g_volinfo.numclusters);
+    uint8_t *map = (uint8_t *)kmalloc(mapsize);
+
+    if(map != NULL &&
+       DFS_CacheFreeMap(&g_volinfo, g_fs_scratch,
+                        bitmap_create_in_buf(g_volinfo.numclusters, map, mapsize)) == DFS_OK) {
+        printk("task #%d: %dKiB free on the FAT volume\r\n", sys_task_getid(),
+               g_volinfo.freecount * g_volinfo.secperclus / (1024 / SECTOR_SIZE));
+        return;
+    }
+
+    kfree(map);
+}
+
+/**
+ * 缓存路径查找的结果，反复打开同一路径不必再扫描目录
+ */
+static void cache_dentries()
+{
+    PDENTRY dcache = (PDENTRY)kmalloc(NR_DENTRY * sizeof(DENTRY));
+
+    if(dcache != NULL)
+        DFS_CacheDirEnts(&g_volinfo, dcache, NR_DENTRY);
+}
+
+/**
+ * 初始化文件子系统，必须在FAT文件系统初始化之后调用
+ */
+void init_file()
+{
+    g_fs_sem = sys_sem_create(1);
+    cache_fat();
+    cache_freemap();
+    cache_dentries();
+}
+
+/**
+ * 取得当前进程中文件描述符fd对应的文件，并增加其引用计数
+ * fd无效返回NULL
+ */
+struct file *file_get(int fd)
+{
+    struct file *fp;
+    uint32_t flags;
+
+    if(fd < 0 || fd >= NR_OPEN)
+        return NULL;
+
+    save_flags_cli(flags);
+    fp = g_task_running->proc->files[fd];
+    if(fp != NULL)
+        fp->refcnt++;
+    restore_flags(flags);
+
+    return fp;
+}
+
+/**
+ * 增加文件fp的引用计数
+ */
+void file_dup(struct file *fp)
+{
+    uint32_t flags;
+    save_flags_cli(flags);
+    fp->refcnt++;
+    restore_flags(flags);
+}
+
+/**
+ * 减少文件fp的引用计数，降为0时关闭文件
+ */
+void file_put(struct file *fp)
+{
+    uint32_t flags;
+    int refcnt;
+
+    save_flags_cli(flags);
+    refcnt = --fp->refcnt;
+    restore_flags(flags);
+
+    if(refcnt == 0) {
+        DFS_Close(&fp->fi);
+        kfree(fp);
+    }
+}
+
+int file_writable(struct file *fp)
+{
+    return (fp->fi.mode & DFS_WRITE) != 0;
+}
+
+uint32_t file_size(struct file *fp)
+{
+    return fp->fi.filelen;
+}
+
+/**
+ * 文件的标识，即其目录项的位置。同一文件被多次打开时标识相同，页缓存以此为键
+ */
+uint32_t file_ino(struct file *fp)
+{
+    return fp->fi.dirsector * (SECTOR_SIZE / sizeof(DIRENT)) + fp->fi.diroffset;
+}
+
+/**
+ * 从文件fp的offset处读取最多len字节到buf
+ * 返回实际读取的字节数，出错返回-1
+ */
+int file_pread(struct file *fp, uint32_t offset, void *buf, uint32_t len)
+{
+    uint32_t res, read = 0;
+
+    fs_lock();
+    DFS_Seek(&fp->fi, offset, g_fs_scratch);
+    res = DFS_ReadFile(&fp->fi, g_fs_scratch, buf, &read, len);
+    fs_unlock();
+
+    if(res != DFS_OK && res != DFS_EOF)
+        return -1;
+    return read;
+}
+
+/**
+ * 把buf中的len字节写到文件fp的offset处，offset不能超过文件的长度
+ * 返回实际写入的字节数，出错返回-1
+ */
+int file_pwrite(struct file *fp, uint32_t offset, void *buf, uint32_t len)
+{
+    uint32_t res, written = 0;
+
+    fs_lock();
+    DFS_Seek(&fp->fi, offset, g_fs_scratch);
+    res = DFS_WriteFile(&fp->fi, g_fs_scratch, buf, &written, len);
+    fs_unlock();
+
+    if(res != DFS_OK)
+        return -1;
+    return written;
+}
+
+/**
+ * 关闭进程p打开的所有文件
+ */
+void file_close_all(struct proc *p)
+{
+    int fd;
+    for(fd = 0; fd < NR_OPEN; fd++) {
+        if(p->files[fd] != NULL) {
+            file_put(p->files[fd]);
+            p->files[fd] = NULL;
+        }
+    }
+}
+
+/**
+ * 系统调用open的执行函数
+ *
+ * 打开FAT文件系统中的文件path，成功返回文件描述符，失败返回-1
+ */
+int sys_open(char *path, int flags)
+{
+    char tmppath[MAX_PATH];
+    struct file *fp;
+    uint8_t mode;
+    uint32_t res, eflags;
+    int i, fd;
+
+    /*把路径复制到内核，它不能超出用户空间*/
+    for(i = 0; i < MAX_PATH; i++) {
+        if(!IN_USER_VM(path+i, 1))
+            return -1;
+        tmppath[i] = path[i];
+        if(tmppath[i] == 0)
+            break;
+    }
+    if(i == MAX_PATH)
+        return -1;
+
+    switch(flags & O_ACCMODE) {
+    case O_RDONLY: mode = DFS_READ;           break;
+    case O_WRONLY: mode = DFS_WRITE;          break;
+    case O_RDWR:   mode = DFS_READ|DFS_WRITE; break;
+    default:
+        return -1;
+    }
+
+    fp = (struct file *)kmalloc(sizeof(struct file));
+    if(fp == NULL)
+        return -1;
+
+    /*以写方式打开不存在的文件时，DOSFS会创建它，所以没有O_CREAT时先只读打开*/
+    fs_lock();
+    res = DFS_OpenFile(&g_volinfo, tmppath,
+                       (flags & O_CREAT)?mode:(mode & ~DFS_WRITE),
+                       g_fs_scratch, &fp->fi);
+    fs_unlock();
+    if(res != DFS_OK) {
+        kfree(fp);
+        return -1;
+    }
+
+    fp->fi.mode = mode;
+    fp->flags = flags;
+    fp->pos = 0;
+    fp->refcnt = 1;
+    fp->ra_next = 0;
+    fp->ra_end = 0;
+    fp->ra_window = RA_MIN;
+    fp->ra_max = RA_MAX;
+
+    save_flags_cli(eflags);
+    for(fd = 0; fd < NR_OPEN; fd++) {
+        if(g_task_running->proc->files[fd] == NULL) {
+            g_task_running->proc->files[fd] = fp;
+            break;
+        }
+    }
+    restore_flags(eflags);
+
+    if(fd == NR_OPEN) {
+        file_put(fp);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * 系统调用close的执行函数
+ */
+int sys_close(int fd)
+{
+    struct file *fp;
+    uint32_t flags;
+
+    if(fd < 0 || fd >= NR_OPEN)
+        return -1;
+
+    save_flags_cli(flags);
+    fp = g_task_running->proc->files[fd];
+    g_task_running->proc->files[fd] = NULL;
+    restore_flags(flags);
+
+    if(fp == NULL)
+        return -1;
+
+    file_put(fp);
+    return 0;
+}
+
+/**
+ * 即将从文件fp的offset处读取len字节，顺序读时请求预读后面的页面
+ *
+ * 读到的页面是先前预读的且还在缓存中，窗口加倍；已经被淘汰，窗口减半。
+ * 已经预读但还没读到的部分少于半个窗口时，再预读一个窗口
+ */
+static void file_readahead(struct file *fp, uint32_t offset, uint32_t len)
+{
+    uint32_t size = file_size(fp), end;
+    int npages;
+
+    if(fp->ra_max == 0 || offset >= size)
+        return;
+
+    if(offset != fp->ra_next) {
+        /*随机访问，不预读*/
+        fp->ra_next = offset + len;
+        fp->ra_end = 0;
+        if(fp->ra_window > RA_MIN)
+            fp->ra_window /= 2;
+        return;
+    }
+    fp->ra_next = offset + len;
+
+    end = offset + len;
+    if(end > size)
+        end = size;
+
+    if(offset < fp->ra_end) {
+        if(pcache_cached(fp, end - 1)) {
+            if(fp->ra_window < fp->ra_max)
+                fp->ra_window *= 2;
+        } else if(fp->ra_window > RA_MIN)
+            fp->ra_window /= 2;
+    }
+
+    end = PAGE_ROUNDUP(end);
+    if(fp->ra_end < end)
+        fp->ra_end = end;
+    if(fp->ra_end >= size ||
+       fp->ra_end - end >= (uint32_t)(fp->ra_window / 2) * PAGE_SIZE)
+        return;
+
+    npages = (PAGE_ROUNDUP(size) - fp->ra_end) / PAGE_SIZE;
+    if(npages > fp->ra_window)
+        npages = fp->ra_window;
+    pcache_readahead(fp, fp->ra_end, npages);
+    fp->ra_end += npages * PAGE_SIZE;
+}
+
+/**
+ * 系统调用fadvise的执行函数
+ *
+ * 告诉内核将怎样访问文件，以此调整预读。成功返回0，失败返回-1
+ */
+int sys_fadvise(int fd, int advice)
+{
+    struct file *fp;
+    int ret = 0;
+
+    if((fp = file_get(fd)) == NULL)
+        return -1;
+
+    switch(advice) {
+    case POSIX_FADV_NORMAL:
+        fp->ra_max = RA_MAX;
+        fp->ra_window = RA_MIN;
+        break;
+    case POSIX_FADV_RANDOM:
+        fp->ra_max = 0;
+        break;
+    case POSIX_FADV_SEQUENTIAL:
+        fp->ra_max = RA_MAX;
+        fp->ra_window = RA_MAX;
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+
+    file_put(fp);
+    return ret;
+}
+
+/**
+ * 系统调用read的执行函数
+ *
+ * 从文件的当前位置读取最多nbytes字节到buf，返回实际读取的字节数
+ */
+ssize_t sys_read(int fd, void *buf, size_t nbytes)
+{
+    struct file *fp;
+    int n;
+
+    if(!IN_USER_VM(buf, nbytes))
+        return -1;
+
+    if((fp = file_get(fd)) == NULL)
+        return -1;
+
+    /*数据来自页缓存，反复读取同一文件不必再访问磁盘*/
+    file_readahead(fp, fp->pos, nbytes);
+    n = pcache_read(fp, fp->pos, buf, nbytes);
+    if(n > 0)
+        fp->pos += n;
+
+    file_put(fp);
+    return n;
+}
+
+/**
+ * 系统调用write的执行函数
+ *
+ * 把buf中的nbytes字节写到文件的当前位置，返回实际写入的字节数
+ */
+ssize_t sys_write(int fd, void *buf, size_t nbytes)
+{
+    struct file *fp;
+    uint8_t *kbuf;
+    ssize_t total = 0;
+    int n, len;
+
+    if(!IN_USER_VM(buf, nbytes))
+        return -1;
+
+    if((fp = file_get(fd)) == NULL)
+        return -1;
+
+    if(!file_writable(fp) ||
+       (kbuf = (uint8_t *)kmalloc(PAGE_SIZE)) == NULL) {
+        file_put(fp);
+        return -1;
+    }
+
+    while(nbytes > 0) {
+        len = (nbytes > PAGE_SIZE)?PAGE_SIZE:nbytes;
+        memcpy(kbuf, (uint8_t *)buf+total, len);
+        n = file_pwrite(fp, fp->pos, kbuf, len);
+        if(n <= 0) {
+            if(total == 0)
+                total = n;
+            break;
+        }
+        pcache_update(fp, fp->pos, kbuf, n);
+        fp->pos += n;
+        total += n;
+        nbytes -= n;
+    }
+
+    kfree(kbuf);
+    file_put(fp);
+    return total;
+}
+
+/**
+ * 系统调用lseek的执行函数
+ *
+ * 移动文件的当前位置，不能超出文件末尾。返回新的位置，失败返回-1
+ */
+off_t sys_lseek(int fd, off_t offset, int whence)
+{
+    struct file *fp;
+    off_t pos;
+
+    if((fp = file_get(fd)) == NULL)
+        return -1;
+
+    switch(whence) {
+    case SEEK_SET: pos = offset;                       break;
+    case SEEK_CUR: pos = fp->pos + offset;             break;
+    case SEEK_END: pos = file_size(fp) + offset;       break;
+    default:       pos = -1;                           break;
+    }
+
+    if(pos < 0) {
+        file_put(fp);
+        return -1;
+    }
+    if(pos > file_size(fp))
+        pos = file_size(fp);
+
+    fp->pos = pos;
+    file_put(fp);
+    return pos;
+}
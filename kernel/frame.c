@@ -19,6 +19,7 @@
  */
 #include "kernel.h"
 #include "bitmap.h"
+#include <sys/meminfo.h>
 
 static struct pmzone {
  uint32_t base;
@@ -26,6 +27,14 @@ static struct pmzone {
  struct bitmap *bitmap;
 } pmzone[RAM_ZONE_LEN/2];
 
+/*空闲时做内存紧缩，希望至少有一个区域有这么多连续的空闲帧*/
+#define COMPACT_IDLE_RUN    256
+#define COMPACT_IDLE_PERIOD HZ
+
+static uint32_t g_frame_frees;      /*frame_free的次数*/
+static uint32_t g_compact_frees;    /*上次空闲紧缩时的g_frame_frees*/
+static unsigned g_compact_tick;
+
 uint32_t init_frame(uint32_t brk)
 {
     int i, z = 0;
@@ -86,12 +95,16 @@ uint32_t frame_alloc_in_addr(uint32_t pa, uint32_t nframes)
 /**
  * 分配nframes个连续的帧
  * 失败返回BITMAP_ERROR(=SIZE_MAX)，成功返回帧的起始地址
+ *
+ * 注意：目前的调用者都只分配一帧，多帧时紧缩后重试的路径还没有调用者，
+ * 平时的紧缩由frame_compact_idle完成
  */
 uint32_t frame_alloc(uint32_t nframes)
 {
-    int z;
+    int z, compacted = 0;
     uint32_t flags;
 
+again:
     save_flags_cli(flags);
     for(z = 0; z < RAM_ZONE_LEN/2; z++) {
         if(pmzone[z].limit == 0)
@@ -105,6 +118,13 @@ uint32_t frame_alloc(uint32_t nframes)
     }
     restore_flags(flags);
 
+    /*找不到足够的连续帧，紧缩后再试一次*/
+    if(nframes > 1 && !compacted) {
+        compacted = 1;
+        if(frame_compact(nframes) > 0)
+            goto again;
+    }
+
     return BITMAP_ERROR;
 }
 
@@ -129,6 +149,7 @@ void frame_free(uint32_t paddr, uint32_t nframes)
                 return;
             }*/
             bitmap_set_multiple(pmzone[z].bitmap, idx, nframes, 0);
+            g_frame_frees++;
             restore_flags(flags);
             return;
         }
@@ -137,3 +158,161 @@ void frame_free(uint32_t paddr, uint32_t nframes)
 }
 
 
+
+/**
+ * 区域z中最长的连续空闲帧数
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static uint32_t zone_maxrun(int z)
+{
+    uint32_t idx, end, nframes, maxrun = 0;
+
+    nframes = pmzone[z].limit/PAGE_SIZE;
+    idx = 0;
+    while(idx < nframes) {
+        idx = bitmap_scan(pmzone[z].bitmap, idx, 1, 0);
+        if(idx == BITMAP_ERROR || idx >= nframes)
+            break;
+        end = bitmap_scan(pmzone[z].bitmap, idx, 1, 1);
+        if(end == BITMAP_ERROR || end > nframes)
+            end = nframes;
+        if(end - idx > maxrun)
+            maxrun = end - idx;
+        idx = end;
+    }
+
+    return maxrun;
+}
+
+/**
+ * 取得各个物理内存区域的帧数、空闲帧数和最长的连续空闲帧数
+ * 返回区域的个数，最多max个
+ */
+int frame_stat(struct meminfo_zone *mz, int max)
+{
+    int z;
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    for(z = 0; z < RAM_ZONE_LEN/2 && z < max; z++) {
+        if(pmzone[z].limit == 0)
+            break;
+        mz[z].base = pmzone[z].base;
+        mz[z].frames = pmzone[z].limit/PAGE_SIZE;
+        mz[z].free = bitmap_count(pmzone[z].bitmap, 0, mz[z].frames, 0);
+        mz[z].maxrun = zone_maxrun(z);
+    }
+    restore_flags(flags);
+
+    return z;
+}
+
+/**
+ * 紧缩区域z：低端的指针向上寻找已用的帧，高端的指针向下寻找空闲帧，
+ * 把可移动的用户页面从低端迁移到高端，直到两个指针相遇。
+ * nframes不为0时，有了nframes个连续空闲帧就停止。返回迁移的页面数
+ *
+ * 每迁移一个页面开关一次中断，紧缩可以被抢占
+ */
+static int zone_compact(int z, uint32_t nframes)
+{
+    struct bitmap *bm = pmzone[z].bitmap;
+    uint32_t flags, lo, hi, idx, base = pmzone[z].base;
+    int moved = 0, steps = 0;
+
+    lo = 0;
+    hi = pmzone[z].limit/PAGE_SIZE;
+
+    while(1) {
+        save_flags_cli(flags);
+
+        /*每考察16个页面检查一次是否已经够用*/
+        if(nframes != 0 && (steps++ & 15) == 0) {
+            idx = bitmap_scan(bm, 0, nframes, 0);
+            if(idx != BITMAP_ERROR && idx + nframes <= pmzone[z].limit/PAGE_SIZE) {
+                restore_flags(flags);
+                break;
+            }
+        }
+
+        lo = bitmap_scan(bm, lo, 1, 1);
+        idx = bitmap_scan_last(bm, hi, 0);
+        hi = (idx == BITMAP_ERROR)?0:idx + 1;
+        if(lo == BITMAP_ERROR || hi <= lo + 1) {
+            restore_flags(flags);
+            break;
+        }
+
+        hi--;
+        bitmap_mark(bm, hi);
+        if(page_migrate(base + lo * PAGE_SIZE, base + hi * PAGE_SIZE) == 0) {
+            bitmap_reset(bm, lo);
+            g_vmstat.compact_moved++;
+            moved++;
+        } else {
+            /*不可移动的页面，目标帧留给下一个页面*/
+            bitmap_reset(bm, hi);
+            hi++;
+            g_vmstat.compact_failed++;
+        }
+        lo++;
+
+        restore_flags(flags);
+    }
+
+    return moved;
+}
+
+/**
+ * 内存紧缩，把零散的空闲帧聚集成连续的一段
+ * nframes不为0时，某个区域有了nframes个连续空闲帧就停止；为0时紧缩所有区域
+ * 返回迁移的页面数
+ */
+int frame_compact(uint32_t nframes)
+{
+    int z, moved = 0;
+    uint32_t flags, before, after;
+
+    for(z = 0; z < RAM_ZONE_LEN/2; z++) {
+        if(pmzone[z].limit == 0)
+            break;
+
+        save_flags_cli(flags);
+        before = zone_maxrun(z);
+        restore_flags(flags);
+        if(nframes != 0 && before >= nframes)
+            break;
+
+        moved += zone_compact(z, nframes);
+
+        save_flags_cli(flags);
+        after = zone_maxrun(z);
+        g_vmstat.compact_runs++;
+        if(after > before)
+            g_vmstat.compact_gained += after - before;
+        restore_flags(flags);
+
+        if(nframes != 0 && after >= nframes)
+            break;
+    }
+
+    return moved;
+}
+
+/**
+ * 由空闲线程task0周期性地调用。上次紧缩之后有帧被释放，
+ * 并且没有一个区域有COMPACT_IDLE_RUN个连续空闲帧时才紧缩
+ */
+void frame_compact_idle()
+{
+    if(g_timer_ticks - g_compact_tick < COMPACT_IDLE_PERIOD)
+        return;
+    g_compact_tick = g_timer_ticks;
+
+    if(g_frame_frees == g_compact_frees)
+        return;
+    g_compact_frees = g_frame_frees;
+
+    frame_compact(COMPACT_IDLE_RUN);
+}
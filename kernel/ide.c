@@ -1,4 +1,7 @@
 #include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/diskio.h>
 #include "kernel.h"
 
 #define ATA_SR_BSY     0x80
@@ -27,6 +30,9 @@
 #define ATA_CMD_WRITE_PIO_EXT     0x34
 #define ATA_CMD_WRITE_DMA         0xCA
 #define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_SET_MULTIPLE      0xC6
 #define ATA_CMD_CACHE_FLUSH       0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT   0xEA
 #define ATA_CMD_PACKET            0xA0
@@ -48,6 +54,17 @@
 #define ATA_IDENT_COMMANDSETS  164
 #define ATA_IDENT_MAX_LBA_EXT  200
 
+/*PIIX的总线主控寄存器，相对于BAR4，第二个通道再加8*/
+#define BM_REG_COMMAND 0x00
+#define BM_REG_STATUS  0x02
+#define BM_REG_PRDT    0x04
+
+#define BM_CMD_START   0x01
+#define BM_CMD_READ    0x08     /*从设备到内存*/
+#define BM_SR_ACTIVE   0x01
+#define BM_SR_ERR      0x02
+#define BM_SR_IRQ      0x04
+
 #define IDE_ATA        0x00
 #define IDE_ATAPI      0x01
 
@@ -105,6 +122,49 @@ typedef struct {
 	uint16_t unused7[152];
 } __attribute__((packed)) ata_identify_t;
 
+/*
+ * PRD（Physical Region Descriptor），描述DMA的一段物理内存，
+ * 不能跨越64KiB的边界，count为0表示64KiB
+ */
+struct prd {
+	uint32_t addr;
+	uint16_t count;
+	uint16_t flags;
+#define PRD_EOT 0x8000
+} __attribute__((packed));
+
+#define PRD_MAX  (PAGE_SIZE / sizeof(struct prd))
+
+/*
+ * 每个IDE通道的状态。multiple是READ/WRITE MULTIPLE每次DRQ传输的扇区数，
+ * 0表示不支持，只能一个扇区一次中断
+ */
+struct ide_channel {
+	uint16_t bus;
+	uint16_t bmiba;                 /*总线主控寄存器的端口，0表示不能DMA*/
+	uint8_t  multiple;
+	uint8_t  dma;                   /*磁盘支持DMA*/
+
+	int      busy;                  /*有线程正在使用这个通道*/
+	struct wait_queue *wq_busy;
+
+	volatile int done;              /*中断已经到达*/
+	uint8_t  status, bmstatus;      /*中断处理程序读到的状态*/
+	struct wait_queue *wq_irq;      /*等待中断的线程*/
+
+	struct prd *prdt;               /*PRD表，占一个页面*/
+	uint32_t prdt_pa;
+
+	uint64_t idle;                  /*等待中断的周期数*/
+};
+
+static struct ide_channel g_ide_channel[2] = {
+	{ .bus = 0x1f0 },
+	{ .bus = 0x170 },
+};
+
+#define IDE_CHANNEL(bus) (&g_ide_channel[(bus) == 0x170])
+
 
 static void repinsw(unsigned short port, unsigned char * data, unsigned long size)
 {
@@ -152,6 +212,22 @@ static void ata_select(uint16_t bus)
 	outportb(bus + ATA_REG_HDDEVSEL, 0xA0);
 }
 
+/*
+ * IRQ14/15的中断处理程序，读状态寄存器同时清除了磁盘的中断请求
+ */
+static void isr_ide(uint32_t irq, struct context *ctx)
+{
+	struct ide_channel *ch = &g_ide_channel[irq == IRQ_IDE2];
+
+	if (ch->bmiba) {
+		ch->bmstatus = inportb(ch->bmiba + BM_REG_STATUS);
+		outportb(ch->bmiba + BM_REG_STATUS, ch->bmstatus | BM_SR_IRQ);
+	}
+	ch->status = inportb(ch->bus + ATA_REG_STATUS);
+	ch->done = 1;
+	wake_up(&ch->wq_irq, -1);
+}
+
 void ide_init(uint16_t bus)
 {
 	int i;
@@ -184,50 +260,438 @@ void ide_init(uint16_t bus)
 		ptr[i] = tmp;
 	}
 
-	outportb(bus + ATA_REG_CONTROL, 0x02);
-}
+	IDE_CHANNEL(bus)->dma = (device.capabilities[0] & 0x100) != 0;
+
+	/*
+	 * 按IDENTIFY中的最大值打开多扇区模式，一次DRQ传输多个扇区
+	 */
+	IDE_CHANNEL(bus)->multiple = 0;
+	i = device.sectors_per_int & 0xff;
+	if (i > 1) {
+		outportb(bus + ATA_REG_HDDEVSEL, 0xe0);
+		outportb(bus + ATA_REG_SECCOUNT0, i);
+		outportb(bus + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+		ata_wait(bus, 0);
+		if (!(inportb(bus + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)))
+			IDE_CHANNEL(bus)->multiple = i;
+	}
 
-void ide_read_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf)
-{
 	outportb(bus + ATA_REG_CONTROL, 0x02);
 
-	ata_wait_ready(bus);
+	i = (bus == 0x170) ? IRQ_IDE2 : IRQ_IDE;
+	g_intr_vector[i] = isr_ide;
+	enable_irq(i);
+}
 
+/*发出读写count个扇区的命令，count为256时寄存器中写0*/
+static void ata_command(uint16_t bus, uint8_t slave, uint32_t lba,
+						uint32_t count, uint8_t cmd)
+{
 	outportb(bus + ATA_REG_HDDEVSEL,  0xe0 | slave << 4 |
 								 (lba & 0x0f000000) >> 24);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
-	outportb(bus + ATA_REG_SECCOUNT0, 1);
+	outportb(bus + ATA_REG_SECCOUNT0, count & 0xff);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
+	outportb(bus + ATA_REG_COMMAND, cmd);
+}
+
+/*
+ * 通道的锁。等待磁盘的中断时别的线程可以运行，它们可能也要访问磁盘
+ */
+static void ide_lock(struct ide_channel *ch)
+{
+	uint32_t flags;
 
-	if (ata_wait(bus, 1)) {
-		printk("Error ATA reading bus=0x%03x, %s, lba=%d", bus, slave?"slave":"master", lba);
+	save_flags_cli(flags);
+	while (ch->busy)
+		sleep_on(&ch->wq_busy);
+	ch->busy = 1;
+	restore_flags(flags);
+}
+
+static void ide_unlock(struct ide_channel *ch)
+{
+	uint32_t flags;
+
+	save_flags_cli(flags);
+	ch->busy = 0;
+	wake_up(&ch->wq_busy, 1);
+	restore_flags(flags);
+}
+
+/*
+ * 等待通道ch的中断，返回中断处理程序读到的状态。
+ * 调用者关了中断，并在让磁盘产生中断的操作之前把ch->done清0。
+ * 等待时当前线程睡眠，让别的线程运行；task0不能睡眠，它停机等待
+ */
+static uint8_t ide_wait_irq(struct ide_channel *ch)
+{
+	uint64_t t = rdtsc();
+
+	while (!ch->done) {
+		if (g_task_running == task0)
+			__asm__ __volatile__("sti; hlt; cli");
+		else
+			sleep_on(&ch->wq_irq);
 	}
+	ch->idle += rdtsc() - t;
 
-	repinsw(bus,buf,256);
-	ata_wait(bus, 0);
+	return ch->status;
 }
 
-void ide_write_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf)
+/*
+ * 以PIO方式读出从lba开始的count（1～IDE_MAX_SECTORS）个扇区。
+ * 打开了多扇区模式时每次DRQ传输multiple个扇区。成功返回0
+ *
+ * 传输期间关中断，CPU一直在搬运数据
+ */
+static int ide_pio_read(struct ide_channel *ch, uint8_t slave, uint32_t lba,
+						uint32_t count, uint8_t *buf, int poll)
 {
+	uint16_t bus = ch->bus;
+	uint32_t flags, n, block = ch->multiple;
+	int r = 0, intr;
+
+	if (block == 0)
+		block = 1;
+
+	ide_lock(ch);
+	save_flags_cli(flags);
+	intr = (flags & 0x200) && !poll;
+
+	outportb(bus + ATA_REG_CONTROL, intr ? 0x00 : 0x02);
+
+	ata_wait_ready(bus);
+
+	ch->done = 0;
+	ata_command(bus, slave, lba, count,
+				(block > 1) ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ_PIO);
+
+	/*每块数据准备好时磁盘产生一次中断*/
+	while (count > 0) {
+		if (intr) {
+			uint8_t status = ide_wait_irq(ch);
+			ch->done = 0;
+			if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ))
+				r = -1;
+		} else if (ata_wait(bus, 1))
+			r = -1;
+		if (r) {
+			printk("Error ATA reading bus=0x%03x, %s, lba=%d", bus, slave?"slave":"master", lba);
+			r = -1;
+			break;
+		}
+		n = (count < block) ? count : block;
+		repinsw(bus, buf, n * 256);
+		buf += n * 512;
+		lba += n;
+		count -= n;
+	}
+	if (!intr)
+		ata_wait(bus, 0);
+
 	outportb(bus + ATA_REG_CONTROL, 0x02);
 
+	restore_flags(flags);
+	ide_unlock(ch);
+	return r;
+}
+
+/*
+ * 以PIO方式写入从lba开始的count个扇区，全部写完后只刷新一次磁盘的缓存
+ */
+static int ide_pio_write(struct ide_channel *ch, uint8_t slave, uint32_t lba,
+						 uint32_t count, uint8_t *buf, int poll)
+{
+	uint16_t bus = ch->bus;
+	uint32_t flags, n, block = ch->multiple;
+	int r = 0, intr, first = 1;
+
+	if (block == 0)
+		block = 1;
+
+	ide_lock(ch);
+	save_flags_cli(flags);
+	intr = (flags & 0x200) && !poll;
+
+	outportb(bus + ATA_REG_CONTROL, intr ? 0x00 : 0x02);
+
 	ata_wait_ready(bus);
 
-	outportb(bus + ATA_REG_HDDEVSEL,  0xe0 | slave << 4 |
-								 (lba & 0x0f000000) >> 24);
-	ata_wait(bus, 0);
-	outportb(bus + ATA_REG_FEATURES, 0x00);
-	outportb(bus + ATA_REG_SECCOUNT0, 0x01);
-	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
-	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
-	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-	ata_wait(bus, 0);
+	ata_command(bus, slave, lba, count,
+				(block > 1) ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE_PIO);
+
+	/*第一块数据不产生中断，以后每写完一块产生一次*/
+	while (count > 0) {
+		if (intr && !first) {
+			uint8_t status = ide_wait_irq(ch);
+			if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ))
+				r = -1;
+		} else if (ata_wait(bus, 1))
+			r = -1;
+		first = 0;
+		if (r) {
+			printk("Error ATA writing bus=0x%03x, %s, lba=%d", bus, slave?"slave":"master", lba);
+			r = -1;
+			break;
+		}
+		n = (count < block) ? count : block;
+		ch->done = 0;
+		repoutsw(bus, buf, n * 256);
+		buf += n * 512;
+		lba += n;
+		count -= n;
+	}
+
+	if (intr) {
+		/*最后一块写完的中断，然后是刷新缓存完成的中断*/
+		if (r == 0) {
+			if (ide_wait_irq(ch) & (ATA_SR_ERR | ATA_SR_DF))
+				r = -1;
+			ch->done = 0;
+			outportb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+			ide_wait_irq(ch);
+		}
+	} else {
+		ata_wait(bus, 0);
+
+		outportb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+		ata_wait(bus, 0);
+	}
+
+	outportb(bus + ATA_REG_CONTROL, 0x02);
+
+	restore_flags(flags);
+	ide_unlock(ch);
+	return r;
+}
+
+/*
+ * 按buf所在的物理页面填写PRD表，物理上相连的页面合并成一项。
+ * DMA要写内存时页面必须可写。有页面没有映射返回-1
+ */
+static int prd_build(struct ide_channel *ch, uint8_t *buf, uint32_t len, int write)
+{
+	struct prd *prd = ch->prdt;
+	uint32_t va, pa, size, n = 0;
+
+	while (len > 0) {
+		va = (uint32_t)buf;
+		if (!(PTD[va >> PGDR_SHIFT] & PTE_V) ||
+			!(*vtopte(va) & PTE_V) ||
+			(!write && !(*vtopte(va) & PTE_W)))
+			return -1;
+		pa = vtop(va);
+
+		size = PAGE_SIZE - (va & PAGE_MASK);
+		if (size > len)
+			size = len;
+
+		if (n > 0 &&
+			prd[n-1].addr + (prd[n-1].count ? prd[n-1].count : 0x10000) == pa &&
+			(prd[n-1].addr >> 16) == ((pa + size - 1) >> 16)) {
+			prd[n-1].count += size;
+		} else {
+			if (n == PRD_MAX)
+				return -1;
+			prd[n].addr = pa;
+			prd[n].count = size;
+			prd[n].flags = 0;
+			n++;
+		}
+
+		buf += size;
+		len -= size;
+	}
+
+	prd[n-1].flags = PRD_EOT;
+	return 0;
+}
+
+/*
+ * 用总线主控DMA读写count个扇区，buf要按字对齐，页面都已映射。
+ * 调用者开着中断时睡眠等待完成中断；否则或poll不为0时查询总线主控的状态。
+ * 不能用DMA返回1，调用者应改用PIO；成功返回0，出错返回-1
+ */
+static int ide_dma(struct ide_channel *ch, uint8_t slave, uint32_t lba,
+				   uint32_t count, uint8_t *buf, int write, int poll)
+{
+	uint16_t bus = ch->bus, bm = ch->bmiba;
+	uint32_t flags;
+	int r = 0, intr;
+
+	if (bm == 0 || ((uint32_t)buf & 1))
+		return 1;
+
+	ide_lock(ch);
+	if (prd_build(ch, buf, count * 512, write) != 0) {
+		ide_unlock(ch);
+		return 1;
+	}
+
+	save_flags_cli(flags);
+	intr = (flags & 0x200) && !poll;
+
+	ata_wait_ready(bus);
+
+	outportb(bm + BM_REG_COMMAND, 0);
+	outportl(bm + BM_REG_PRDT, ch->prdt_pa);
+	outportb(bm + BM_REG_STATUS,
+			 inportb(bm + BM_REG_STATUS) | BM_SR_ERR | BM_SR_IRQ);
+
+	ch->done = 0;
+	outportb(bus + ATA_REG_CONTROL, intr ? 0x00 : 0x02);
+	ata_command(bus, slave, lba, count,
+				write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+	outportb(bm + BM_REG_COMMAND, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+
+	if (intr) {
+		ide_wait_irq(ch);
+	} else {
+		while ((inportb(bm + BM_REG_STATUS) & (BM_SR_ACTIVE | BM_SR_IRQ)) == BM_SR_ACTIVE)
+			;
+		ch->bmstatus = inportb(bm + BM_REG_STATUS);
+		outportb(bm + BM_REG_STATUS, ch->bmstatus | BM_SR_IRQ);
+		ch->status = inportb(bus + ATA_REG_STATUS);
+	}
+
+	outportb(bm + BM_REG_COMMAND, 0);
+	outportb(bus + ATA_REG_CONTROL, 0x02);
+
+	if ((ch->bmstatus & BM_SR_ERR) || (ch->status & (ATA_SR_ERR | ATA_SR_DF))) {
+		printk("Error ATA DMA bus=0x%03x, %s, lba=%d", bus, slave?"slave":"master", lba);
+		r = -1;
+	} else if (write) {
+		outportb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+		ata_wait(bus, 0);
+	}
+
+	restore_flags(flags);
+	ide_unlock(ch);
+	return r;
+}
+
+/*
+ * 在PCI总线上找PIIX3/4的IDE控制器，为两个通道打开总线主控DMA。
+ * 成功返回1，只能用PIO返回0
+ */
+int ide_dma_init()
+{
+	static const uint16_t piix[] = {0x7010/*PIIX3*/, 0x7111/*PIIX4*/};
+	struct ide_channel *ch;
+	uint32_t bar = -1, pa, va;
+	int i;
+
+	for (i = 0; i < sizeof(piix)/sizeof(piix[0]); i++)
+		if ((bar = pci_get_bar_addr(0x8086, piix[i], 4)) != (uint32_t)-1)
+			break;
+	if (bar == (uint32_t)-1 || bar == 0)
+		return 0;
+	pci_enable_busmaster(0x8086, piix[i]);
+
+	for (i = 0; i < 2; i++) {
+		ch = &g_ide_channel[i];
+		if (!ch->dma)
+			continue;
+
+		/*PRD表放在一个物理页面中，不会跨越64KiB的边界*/
+		if ((pa = frame_alloc(1)) == SIZE_MAX)
+			break;
+		if ((va = page_alloc(1, VM_PROT_RW, 0)) == SIZE_MAX) {
+			frame_free(pa, 1);
+			break;
+		}
+		page_map(va, pa, 1, PTE_V|PTE_W);
+		ch->prdt = (struct prd *)va;
+		ch->prdt_pa = pa;
+		ch->bmiba = bar + i * 8;
+	}
 
-	repoutsw(bus,buf,256);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
-	ata_wait(bus, 0);
+	return g_ide_channel[0].bmiba != 0;
+}
+
+/*
+ * 读出从lba开始的count（1～IDE_MAX_SECTORS）个扇区，能用DMA就用DMA。成功返回0
+ */
+int ide_read_sectors(uint16_t bus, uint8_t slave, uint32_t lba,
+					 uint32_t count, uint8_t *buf)
+{
+	struct ide_channel *ch = IDE_CHANNEL(bus);
+	int r;
+
+	if (count == 0 || count > IDE_MAX_SECTORS)
+		return -1;
+	if ((r = ide_dma(ch, slave, lba, count, buf, 0, 0)) == 1)
+		r = ide_pio_read(ch, slave, lba, count, buf, 0);
+	return r;
+}
+
+/*
+ * 写入从lba开始的count个扇区，每次调用只刷新一次磁盘的缓存
+ */
+int ide_write_sectors(uint16_t bus, uint8_t slave, uint32_t lba,
+					  uint32_t count, uint8_t *buf)
+{
+	struct ide_channel *ch = IDE_CHANNEL(bus);
+	int r;
+
+	if (count == 0 || count > IDE_MAX_SECTORS)
+		return -1;
+	if ((r = ide_dma(ch, slave, lba, count, buf, 1, 0)) == 1)
+		r = ide_pio_write(ch, slave, lba, count, buf, 0);
+	return r;
+}
+
+void ide_read_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf)
+{
+	ide_read_sectors(bus, slave, lba, 1, buf);
+}
+
+void ide_write_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf)
+{
+	ide_write_sectors(bus, slave, lba, 1, buf);
+}
+
+/*
+ * 系统调用diskread的执行函数，从主通道的主盘直接读count个扇区到用户的buf，
+ * 供性能测试用。flags中有DISKIO_PIO时不用DMA，有DISKIO_POLL时查询磁盘的状态
+ * 而不等待中断。返回这期间等待中断的周期数，出错返回-1
+ */
+int sys_diskread(uint32_t lba, uint8_t *buf, uint32_t count, int flags)
+{
+	struct ide_channel *ch = IDE_CHANNEL(0x1f0);
+	uint64_t idle = ch->idle;
+	uint8_t *kbuf;
+	uint32_t i;
+	int r = 1;
+
+	if (count == 0 || count > IDE_MAX_SECTORS ||
+		!IN_USER_VM((uint32_t)buf, count * 512))
+		return -1;
+
+	/*
+	 * 用户页面在等待中断时可能被换出或迁移，DMA会写进已经另作他用的帧，
+	 * PIO会在持有通道锁时引发PF。所以先读进内核的缓冲区，再复制给用户
+	 */
+	kbuf = (uint8_t *)kmemalign(PAGE_SIZE, count * 512);
+	if (kbuf == NULL)
+		return -1;
+
+	/*先访问一遍，让页面在开中断时就映射好*/
+	for (i = 0; i < count * 512; i += PAGE_SIZE)
+		((volatile uint8_t *)kbuf)[i] = 0;
+
+	if (!(flags & DISKIO_PIO))
+		r = ide_dma(ch, 0, lba, count, kbuf, 0, flags & DISKIO_POLL);
+	if (r == 1)
+		r = ide_pio_read(ch, 0, lba, count, kbuf, flags & DISKIO_POLL);
+	if (r == 0)
+		memcpy(buf, kbuf, count * 512);
+	kfree(kbuf);
+	if (r != 0)
+		return -1;
+
+	return (int)(ch->idle - idle);
 }
@@ -51,6 +51,41 @@ extern time_t g_startup_time;
 
 time_t mktime(struct tm *tm);
 
+struct vmzone;
+struct file;
+
+/*每个进程最多能打开的文件数*/
+#define NR_OPEN 16
+
+/**
+ * 进程控制块
+ *
+ * 同一进程内的线程共享页目录和用户地址空间。
+ * 内核空间的页表（页目录的第768-1023项）被所有进程共享
+ */
+struct proc {
+    int          pid;
+    uint32_t     pgdir;      //页目录的物理地址，即CR3的值
+    uint32_t    *vpgdir;     //页目录的内核虚拟地址
+    struct vmzone *vmzone;   //用户地址空间已分配的区域
+    int          nthreads;   //属于该进程的线程数
+    struct file *files[NR_OPEN]; //打开的文件，下标就是文件描述符
+    struct proc *next;
+};
+
+/*proc0是内核进程，task0和内核线程都属于它*/
+extern struct proc  proc0;
+
+/*CR3当前所指向的进程*/
+extern struct proc *g_proc_active;
+
+void         init_proc(void);
+struct proc *proc_create(void);
+void         proc_activate(struct proc *p);
+void         proc_destroy(struct proc *p);
+void         proc_sync_kpde(uint32_t pdi);
+struct proc *proc_find(uint32_t pgdir);
+
 /**
  * 线程控制块
  *
@@ -98,8 +133,12 @@ struct tcb {
     struct wait_queue *wq_exit; //等待该线程退出的队列
 
     struct tcb  *next;
+    struct proc *proc;       //所属的进程
     struct fpu   fpu;        //数学协处理器的寄存器
 
+    uint32_t     minflt;     //不需要I/O的PF次数
+    uint32_t     majflt;     //从交换区读回页面的PF次数
+
     uint32_t     signature;  //必须是最后一个字段
 #define TASK_SIGNATURE 0x20160201
 };
@@ -155,11 +194,29 @@ extern uint32_t *PTD;
 #define vtopte(va) (PT+((va)>>PAGE_SHIFT))
 #define vtop(va) (((*vtopte(va))&(~PAGE_MASK))|((va)&PAGE_MASK))
 
+/**
+ * 被换出的页面，PTE_V为0，PTE_SWAP为1，高20位是交换槽号
+ */
+#define PTE_SWAP           0x200
+#define SWAP_ENTRY(slot)   (((slot)<<PAGE_SHIFT)|PTE_SWAP)
+#define SWAP_SLOT(pte)     ((pte)>>PAGE_SHIFT)
+#define IS_SWAP_ENTRY(pte) (((pte)&(PTE_V|PTE_SWAP)) == PTE_SWAP)
+
 void  init_kmalloc(void *mem, size_t bytes);
 void *kmalloc(size_t bytes);
 void *krealloc(void *oldptr, size_t size);
 void  kfree(void *ptr);
 void *kmemalign(size_t align, size_t bytes);
+void  kmalloc_stat(size_t *size, size_t *used, size_t *peak);
+
+struct kmem_cache;
+void  init_slab(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *c);
+void  kmem_cache_free(struct kmem_cache *c, void *obj);
+void  kmem_cache_stat(struct kmem_cache *c, uint32_t *nslabs,
+                      uint32_t *inuse, uint32_t *objsize);
 
 #define RAM_ZONE_LEN (2 * 8)
 extern uint32_t g_ram_zone[RAM_ZONE_LEN];
@@ -178,6 +235,7 @@ void        sys_task_yield();
 int printk(const char *fmt,...);
 
 void     init_vmspace(uint32_t brk);
+void     init_vmcache(void);
 uint32_t page_alloc(int npages, uint32_t prot, uint32_t user);
 uint32_t page_alloc_in_addr(uint32_t va, int npages, uint32_t prot);
 int      page_free(uint32_t va, int npages);
@@ -189,6 +247,54 @@ uint32_t page_prot(uint32_t va);
 #define VM_PROT_RW     (VM_PROT_READ|VM_PROT_WRITE)
 #define VM_PROT_ALL    (VM_PROT_RW  |VM_PROT_EXEC)
 
+void     free_vmspace(void);
+int      page_map_file(uint32_t va, int npages, struct file *fp,
+                       uint32_t offset, int shared);
+void     page_unmap_file(uint32_t va, int npages);
+int      page_fill_file(uint32_t va, uint32_t pteflags);
+int      page_sync(uint32_t va, int npages);
+void     page_release(uint32_t va);
+int      page_populate(uint32_t va);
+int      page_advise(uint32_t va, int npages, int advice);
+void     page_fault_around(uint32_t va);
+#define FAULT_AROUND_SEQ 16 /*MADV_SEQUENTIAL的区域，PF时预先映射后面的页面数*/
+
+struct pvmap;
+void          init_pvmap(void);
+struct pvmap *pv_alloc(void);
+void          pv_free(struct pvmap *pv);
+void          pv_insert(struct pvmap *pv, uint32_t paddr, uint32_t vaddr);
+int           page_swap_out(void);
+int           page_swap_in(uint32_t va, uint32_t pteflags);
+int           page_migrate(uint32_t from, uint32_t to);
+
+/*内存管理的统计计数*/
+struct vmstat {
+    uint32_t minflt, majflt;
+    uint32_t zero_fills;
+    uint64_t zero_fill_cycles;
+    uint32_t swapouts;
+    uint32_t mmaps, munmaps;
+    uint32_t compact_runs;      //内存紧缩的次数
+    uint32_t compact_moved;     //迁移的页面数
+    uint32_t compact_failed;    //遇到的不可移动页面数
+    uint32_t compact_gained;    //最长连续空闲帧数增加的总和
+};
+extern struct vmstat g_vmstat;
+struct meminfo;
+int           sys_meminfo(struct meminfo *mi, int tid);
+int           task_faults(int tid, uint32_t *minflt, uint32_t *majflt);
+
+#define SWAP_CLUSTER 8  /*一次最多换出的相邻页面数*/
+void     init_swap(uint8_t *scratch);
+int      swap_enabled(void);
+void     swap_lock(void);
+void     swap_unlock(void);
+uint32_t swap_alloc(int n);
+void     swap_free(uint32_t slot);
+void     swap_write(uint32_t slot, uint32_t *paddrs, int n);
+void     swap_read(uint32_t slot, uint32_t paddr);
+
 void     page_map(uint32_t vaddr, uint32_t paddr, uint32_t npages, uint32_t flags);
 void     page_unmap(uint32_t vaddr, uint32_t npages);
 
@@ -196,12 +302,60 @@ uint32_t init_frame(uint32_t brk);
 uint32_t frame_alloc(uint32_t npages);
 uint32_t frame_alloc_in_addr(uint32_t pa, uint32_t npages);
 void     frame_free(uint32_t paddr, uint32_t npages);
+struct meminfo_zone;
+int      frame_stat(struct meminfo_zone *mz, int max);
+int      frame_compact(uint32_t nframes);
+void     frame_compact_idle(void);
 
 void     calibrate_delay(void);
 unsigned sys_sleep(unsigned seconds);
 int      sys_nanosleep(const struct timespec *rqtp, struct timespec *rmtp);
 
 void     mi_startup();
+
+void         init_file(void);
+struct file *file_get(int fd);
+void         file_dup(struct file *fp);
+void         file_put(struct file *fp);
+int          file_writable(struct file *fp);
+uint32_t     file_size(struct file *fp);
+uint32_t     file_ino(struct file *fp);
+int          file_pread(struct file *fp, uint32_t offset, void *buf, uint32_t len);
+int          file_pwrite(struct file *fp, uint32_t offset, void *buf, uint32_t len);
+void         file_close_all(struct proc *p);
+int          sys_open(char *path, int flags);
+int          sys_close(int fd);
+ssize_t      sys_read(int fd, void *buf, size_t nbytes);
+ssize_t      sys_write(int fd, void *buf, size_t nbytes);
+off_t        sys_lseek(int fd, off_t offset, int whence);
+int          sys_fadvise(int fd, int advice);
+
+struct cpage;
+struct pcache_stat;
+void         init_pcache(void);
+struct cpage *pcache_get(struct file *fp, uint32_t offset);
+void         pcache_put(struct cpage *cp);
+void         pcache_release(struct file *fp, uint32_t offset);
+uint32_t     pcache_paddr(struct cpage *cp);
+void         pcache_copy_frame(struct cpage *cp, uint32_t paddr);
+int          pcache_cached(struct file *fp, uint32_t offset);
+void         pcache_readahead(struct file *fp, uint32_t offset, int npages);
+int          pcache_read(struct file *fp, uint32_t offset, void *buf, uint32_t len);
+void         pcache_update(struct file *fp, uint32_t offset, void *buf, uint32_t len);
+int          pcache_reclaim(int n);
+void         pcache_getstat(struct pcache_stat *st);
+
+/*块缓存的默认大小，可以在编译时用-DBCACHE_SIZE=...改变*/
+#ifndef BCACHE_SIZE
+#define BCACHE_SIZE (256*1024)
+#endif
+struct bcache_stat;
+void         init_bcache(uint32_t size);
+int          bcache_read(uint8_t unit, uint8_t *buffer, uint32_t lba, uint32_t count);
+int          bcache_write(uint8_t unit, uint8_t *buffer, uint32_t lba, uint32_t count);
+int          bcache_sync(void);
+void         bcache_timer(void);
+void         bcache_getstat(struct bcache_stat *st);
 #endif /*_KERNEL_H*/
 
 //first
@@ -219,6 +373,7 @@ struct Semaphore{
     struct wait_queue *waitqueue;
 };
 
+void init_sem();
 int sys_sem_create(int value);
 int sys_sem_destroy(int semid);
 int sys_sem_wait(int semid);
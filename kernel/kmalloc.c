@@ -17,11 +17,171 @@
  *
  */
 #include <stddef.h>
-#include "cpu.h"
+#include "kernel.h"
 #include "../lib/tlsf/tlsf.h"
 
 static tlsf_t g_kheap;
 
+/**
+ * 内核堆由若干内存池组成。第0个是启动时预留的，其余的是用完时用
+ * page_alloc新分配的，完全空闲时归还
+ */
+#define KHEAP_MAXPOOLS 64
+#define KHEAP_GROW_MIN (64*PAGE_SIZE)   /*每次至少增长256KiB*/
+#define KHEAP_RESERVE  (16*PAGE_SIZE)   /*空闲空间少于它就增长，增长本身也要kmalloc*/
+
+static struct kpool {
+    uint32_t base;
+    uint32_t size;
+    uint32_t used;      /*池中已分配的字节数*/
+    pool_t   pool;
+} g_kpool[KHEAP_MAXPOOLS];
+static int g_nr_kpool;
+
+static size_t g_kheap_size;     /*所有池的大小*/
+static size_t g_kheap_used;     /*已分配的字节数*/
+static size_t g_kheap_peak;     /*g_kheap_used的最大值*/
+static int    g_kheap_busy;     /*正在增长或收缩，防止递归*/
+
+static struct kpool *kpool_of(void *ptr)
+{
+    int i;
+    for(i = 0; i < g_nr_kpool; i++)
+        if((uint32_t)ptr >= g_kpool[i].base &&
+           (uint32_t)ptr <  g_kpool[i].base + g_kpool[i].size)
+            return &g_kpool[i];
+    return NULL;
+}
+
+/**
+ * 为内核堆增加一个至少能分配bytes字节的内存池
+ * 成功返回0，失败返回-1
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static int kheap_grow(size_t bytes)
+{
+    uint32_t va, paddr, size, i;
+    pool_t pool;
+
+    if(g_kheap_busy || g_nr_kpool == KHEAP_MAXPOOLS)
+        return -1;
+    g_kheap_busy = 1;
+
+    size = PAGE_ROUNDUP(bytes + tlsf_pool_overhead() + tlsf_alloc_overhead() + PAGE_SIZE);
+    if(size < KHEAP_GROW_MIN)
+        size = KHEAP_GROW_MIN;
+
+    va = page_alloc(size/PAGE_SIZE, VM_PROT_RW, 0);
+    if(va == SIZE_MAX) {
+        g_kheap_busy = 0;
+        return -1;
+    }
+
+    /*立即分配物理帧，访问内核堆时不会再引发PF*/
+    for(i = 0; i < size; i += PAGE_SIZE) {
+        paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX && pcache_reclaim(16) > 0)
+            paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX)
+            break;
+        page_map(va + i, paddr, 1, PTE_V|PTE_W);
+        invlpg(va + i);
+    }
+
+    if(i < size ||
+       (pool = tlsf_add_pool(g_kheap, (void *)va, size)) == NULL) {
+        while(i > 0) {
+            i -= PAGE_SIZE;
+            frame_free(PAGE_TRUNCATE(*vtopte(va + i)), 1);
+            page_unmap(va + i, 1);
+        }
+        page_free(va, size/PAGE_SIZE);
+        g_kheap_busy = 0;
+        return -1;
+    }
+
+    g_kpool[g_nr_kpool].base = va;
+    g_kpool[g_nr_kpool].size = size;
+    g_kpool[g_nr_kpool].used = 0;
+    g_kpool[g_nr_kpool].pool = pool;
+    g_nr_kpool++;
+    g_kheap_size += size;
+
+    g_kheap_busy = 0;
+    return 0;
+}
+
+/**
+ * 归还完全空闲的内存池kp
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static void kheap_shrink(struct kpool *kp)
+{
+    uint32_t va, size, i;
+
+    if(g_kheap_busy)
+        return;
+
+    /*归还后仍要留有足够的空闲空间*/
+    if(g_kheap_size - kp->size - g_kheap_used < 2 * KHEAP_RESERVE)
+        return;
+
+    g_kheap_busy = 1;
+
+    tlsf_remove_pool(g_kheap, kp->pool);
+    va = kp->base;
+    size = kp->size;
+    g_kheap_size -= size;
+    *kp = g_kpool[--g_nr_kpool];
+
+    for(i = 0; i < size; i += PAGE_SIZE) {
+        frame_free(PAGE_TRUNCATE(*vtopte(va + i)), 1);
+        page_unmap(va + i, 1);
+    }
+    page_free(va, size/PAGE_SIZE);
+
+    g_kheap_busy = 0;
+}
+
+/**
+ * 记录ptr被分配，空闲空间不多时增长内核堆
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static void kheap_charge(void *ptr)
+{
+    struct kpool *kp = kpool_of(ptr);
+    size_t size = tlsf_block_size(ptr);
+
+    g_kheap_used += size;
+    if(g_kheap_used > g_kheap_peak)
+        g_kheap_peak = g_kheap_used;
+    if(kp != NULL)
+        kp->used += size;
+
+    if(g_kheap_size - g_kheap_used < KHEAP_RESERVE)
+        kheap_grow(KHEAP_GROW_MIN);
+}
+
+/**
+ * 记录ptr即将被释放。如果它所在的池因此完全空闲，返回这个池
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct kpool *kheap_uncharge(void *ptr)
+{
+    struct kpool *kp = kpool_of(ptr);
+    size_t size = tlsf_block_size(ptr);
+
+    g_kheap_used -= size;
+    if(kp == NULL)
+        return NULL;
+    kp->used -= size;
+    return (kp->used == 0 && kp != &g_kpool[0])?kp:NULL;
+}
+
 void *kmalloc(size_t bytes)
 {
     uint32_t flags;
@@ -29,6 +189,10 @@ void *kmalloc(size_t bytes)
 
     save_flags_cli(flags);
     ptr = tlsf_malloc(g_kheap, bytes);
+    if(ptr == NULL && bytes != 0 && kheap_grow(bytes) == 0)
+        ptr = tlsf_malloc(g_kheap, bytes);
+    if(ptr != NULL)
+        kheap_charge(ptr);
     restore_flags(flags);
 
     return ptr;
@@ -36,11 +200,22 @@ void *kmalloc(size_t bytes)
 
 void *krealloc(void *oldptr, size_t bytes)
 {
+    struct kpool *kp = NULL;
     uint32_t flags;
     void *ptr;
 
     save_flags_cli(flags);
+    if(oldptr != NULL)
+        kp = kheap_uncharge(oldptr);
     ptr = tlsf_realloc(g_kheap, oldptr, bytes);
+    if(ptr == NULL && bytes != 0 && kheap_grow(bytes) == 0)
+        ptr = tlsf_realloc(g_kheap, oldptr, bytes);
+    if(ptr != NULL)
+        kheap_charge(ptr);
+    else if(oldptr != NULL && bytes != 0)
+        kheap_charge(oldptr);       /*失败时原来的块保持不变*/
+    if(kp != NULL && kp->used == 0)
+        kheap_shrink(kp);
     restore_flags(flags);
 
     return ptr;
@@ -48,10 +223,17 @@ void *krealloc(void *oldptr, size_t bytes)
 
 void kfree(void *ptr)
 {
+    struct kpool *kp;
     uint32_t flags;
 
+    if(ptr == NULL)
+        return;
+
     save_flags_cli(flags);
+    kp = kheap_uncharge(ptr);
     tlsf_free(g_kheap, ptr);
+    if(kp != NULL)
+        kheap_shrink(kp);
     restore_flags(flags);
 }
 
@@ -62,12 +244,41 @@ void *kmemalign(size_t align, size_t bytes)
 
     save_flags_cli(flags);
     ptr = tlsf_memalign(g_kheap, align, bytes);
+    if(ptr == NULL && bytes != 0 && kheap_grow(bytes + align) == 0)
+        ptr = tlsf_memalign(g_kheap, align, bytes);
+    if(ptr != NULL)
+        kheap_charge(ptr);
     restore_flags(flags);
 
 	return ptr;
 }
 
+/**
+ * 取得内核堆的大小、已分配的字节数以及已分配字节数的最大值
+ */
+void kmalloc_stat(size_t *size, size_t *used, size_t *peak)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    *size = g_kheap_size;
+    *used = g_kheap_used;
+    *peak = g_kheap_peak;
+    restore_flags(flags);
+}
+
 void init_kmalloc(void *mem, size_t bytes)
 {
 	g_kheap = tlsf_create_with_pool(mem, bytes);
+
+    g_kpool[0].base = (uint32_t)mem;
+    g_kpool[0].size = bytes;
+    g_kpool[0].used = 0;
+    g_kpool[0].pool = tlsf_get_pool(g_kheap);
+    g_nr_kpool = 1;
+
+    g_kheap_size = bytes;
+    g_kheap_used = 0;
+    g_kheap_peak = 0;
+    g_kheap_busy = 0;
 }
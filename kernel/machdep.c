@@ -21,6 +21,9 @@
 #include <syscall-nr.h>
 #include <ioctl.h>
 #include <sys/mman.h>
+#include <sys/pcache.h>
+#include <sys/meminfo.h>
+#include <sys/bcache.h>
 #include <string.h>
 
 #include "kernel.h"
@@ -125,6 +128,13 @@ void disable_irq(uint32_t irq)
  */
 void switch_to(struct tcb *new)
 {
+    /*
+     * 同一进程内的线程切换不用重新加载CR3；
+     * 内核线程（属于proc0）只访问内核空间，可以借用当前的地址空间
+     */
+    if(new->proc != g_proc_active && new->proc != &proc0)
+        proc_activate(new->proc);
+
     __asm__ __volatile__ (
             "pushal\n\t"
             "pushl $1f\n\t"
@@ -518,6 +528,8 @@ int exception(struct context *ctx)
             __asm__ __volatile__("movl %%cr2,%0" : "=r" (vaddr));
             sti();
             res = do_page_fault(ctx, vaddr, ctx->errorcode);
+            if(res == 0)
+                page_fault_around(vaddr);
             cli();
             if(res == 0)
                 return 0;
@@ -787,6 +799,7 @@ void syscall(struct context *ctx)
     case SYSCALL_reboot:
         {
             /*int howto = *(int *)(ctx->esp+4);*/
+            bcache_sync();
             while(inportb(0x64) & 2)
                 ;
             outportb(0x64, 0xFE);
@@ -803,6 +816,7 @@ void syscall(struct context *ctx)
             off_t offset = *(off_t *)(ctx->esp+24);
             uint32_t npages = PAGE_ROUNDUP(len)/PAGE_SIZE;
             uint32_t va = (uint32_t)addr;
+            struct file *fp = NULL;
 
             ctx->eax = -1;
             if(len == 0)
@@ -814,16 +828,35 @@ void syscall(struct context *ctx)
                 if(flags & MAP_ANON)
                     break;
             }
-            if(!(flags & MAP_PRIVATE))
-                break;
 
-            /*XXX - 0x8000留给/dev/mem*/
-            if((fd == 0x8000) && (offset & PAGE_MASK))
+            /*MAP_SHARED和MAP_PRIVATE必须指定其中一个*/
+            if(!(flags & MAP_PRIVATE) == !(flags & MAP_SHARED))
                 break;
 
+            if(fd == -1 || fd == 0x8000) {
+                /*匿名映射和/dev/mem只支持MAP_PRIVATE*/
+                if(!(flags & MAP_PRIVATE))
+                    break;
+
+                /*XXX - 0x8000留给/dev/mem*/
+                if((fd == 0x8000) && (offset & PAGE_MASK))
+                    break;
+            } else {
+                /*映射FAT文件系统中的文件*/
+                if((offset & PAGE_MASK) || (fp = file_get(fd)) == NULL)
+                    break;
+                if((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+                   !file_writable(fp)) {
+                    file_put(fp);
+                    break;
+                }
+            }
+
             if(flags & MAP_FIXED) {
                 if(!IN_USER_VM(va, len) ||
                    (va & PAGE_MASK)) {
+                    if(fp != NULL)
+                        file_put(fp);
                     break;
                 }
                 ctx->eax = page_alloc_in_addr(va, npages, prot);
@@ -835,6 +868,20 @@ void syscall(struct context *ctx)
                 page_map(ctx->eax, offset,
                          npages, PTE_U|((prot&PROT_WRITE)?PTE_W:0)|PTE_V);
             }
+
+            if(fp != NULL) {
+                if(ctx->eax == -1) {
+                    file_put(fp);
+                } else if(page_map_file(ctx->eax, npages, fp, offset,
+                                        flags & MAP_SHARED) != 0) {
+                    page_free(ctx->eax, npages);
+                    file_put(fp);
+                    ctx->eax = -1;
+                }
+            }
+
+            if(ctx->eax != -1)
+                g_vmstat.mmaps++;
         }
         break;
     case SYSCALL_munmap:
@@ -855,21 +902,133 @@ void syscall(struct context *ctx)
             ctx->eax = page_free(va, npages);
 
             if(ctx->eax != -1) {
-                uint32_t i, x;
+                uint32_t i;
+
+                g_vmstat.munmaps++;
+
+                /*回写并撤销文件映射*/
+                page_unmap_file(va, npages);
+
                 for(i = 0; i < npages; i++) {
-                    x = *vtopte(va);
-                    if(x & PTE_V) {
-                        *vtopte(va) = 0;
-                        invlpg(va);
-
-                        //XXX - 可能不是RAM，不能用frame_free
-                        frame_free(PAGE_TRUNCATE(x), 1);
-                    }
+                    page_release(va);
                     va += PAGE_SIZE;
                 }
             }
         }
         break;
+    case SYSCALL_msync:
+        {
+            void *addr = *(void **)(ctx->esp+4);
+            size_t len = *(size_t *)(ctx->esp+8);
+            uint32_t va = (uint32_t)addr;
+
+            ctx->eax = -1;
+            if(!IN_USER_VM(va, len) || (va & PAGE_MASK))
+                break;
+
+            ctx->eax = page_sync(va, PAGE_ROUNDUP(len)/PAGE_SIZE);
+        }
+        break;
+    case SYSCALL_madvise:
+        {
+            void *addr = *(void **)(ctx->esp+4);
+            size_t len = *(size_t *)(ctx->esp+8);
+            int advice = *(int *)(ctx->esp+12);
+            uint32_t va = (uint32_t)addr;
+
+            ctx->eax = -1;
+            if(len == 0 || !IN_USER_VM(va, len) || (va & PAGE_MASK))
+                break;
+
+            ctx->eax = page_advise(va, PAGE_ROUNDUP(len)/PAGE_SIZE, advice);
+        }
+        break;
+    case SYSCALL_open:
+        {
+            char *path = *(char **)(ctx->esp+4);
+            int flags  = *(int *)(ctx->esp+8);
+            ctx->eax = sys_open(path, flags);
+        }
+        break;
+    case SYSCALL_close:
+        ctx->eax = sys_close(*(int *)(ctx->esp+4));
+        break;
+    case SYSCALL_read:
+        {
+            int fd = *(int *)(ctx->esp+4);
+            void *buf = *(void **)(ctx->esp+8);
+            size_t nbytes = *(size_t *)(ctx->esp+12);
+            ctx->eax = sys_read(fd, buf, nbytes);
+        }
+        break;
+    case SYSCALL_write:
+        {
+            int fd = *(int *)(ctx->esp+4);
+            void *buf = *(void **)(ctx->esp+8);
+            size_t nbytes = *(size_t *)(ctx->esp+12);
+            ctx->eax = sys_write(fd, buf, nbytes);
+        }
+        break;
+    case SYSCALL_lseek:
+        {
+            int fd = *(int *)(ctx->esp+4);
+            off_t offset = *(off_t *)(ctx->esp+8);
+            int whence = *(int *)(ctx->esp+12);
+            ctx->eax = sys_lseek(fd, offset, whence);
+        }
+        break;
+    case SYSCALL_fadvise:
+        {
+            int fd = *(int *)(ctx->esp+4);
+            int advice = *(int *)(ctx->esp+8);
+            ctx->eax = sys_fadvise(fd, advice);
+        }
+        break;
+    case SYSCALL_pcache_stat:
+        {
+            struct pcache_stat *st = *(struct pcache_stat **)(ctx->esp+4);
+            ctx->eax = -1;
+            if(IN_USER_VM(st, sizeof(struct pcache_stat))) {
+                pcache_getstat(st);
+                ctx->eax = 0;
+            }
+        }
+        break;
+    case SYSCALL_sync:
+        ctx->eax = bcache_sync();
+        break;
+    case SYSCALL_bcache_stat:
+        {
+            struct bcache_stat *st = *(struct bcache_stat **)(ctx->esp+4);
+            ctx->eax = -1;
+            if(IN_USER_VM(st, sizeof(struct bcache_stat))) {
+                bcache_getstat(st);
+                ctx->eax = 0;
+            }
+        }
+        break;
+    case SYSCALL_meminfo:
+        {
+            struct meminfo *mi = *(struct meminfo **)(ctx->esp+4);
+            int tid = *(int *)(ctx->esp+8);
+            ctx->eax = -1;
+            if(IN_USER_VM(mi, sizeof(struct meminfo)))
+                ctx->eax = sys_meminfo(mi, tid);
+        }
+        break;
+    case SYSCALL_diskread:
+        {
+            uint32_t lba = *(uint32_t *)(ctx->esp+4);
+            uint8_t *buf = *(uint8_t **)(ctx->esp+8);
+            uint32_t count = *(uint32_t *)(ctx->esp+12);
+            int flags = *(int *)(ctx->esp+16);
+#ifdef USE_FLOPPY
+            ctx->eax = -1;
+#else
+            ctx->eax = sys_diskread(lba, buf, count, flags);
+#endif
+        }
+        break;
     case SYSCALL_sleep:
         ctx->eax = sys_sleep((*((int *)(ctx->esp+4))));
         break;
@@ -910,6 +1069,26 @@ void syscall(struct context *ctx)
     }
 }
 
+/**
+ * 记一次PF，major表示是否读了交换区
+ */
+static void count_fault(int major)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    if(major) {
+        g_vmstat.majflt++;
+        if(g_task_running != NULL)
+            g_task_running->majflt++;
+    } else {
+        g_vmstat.minflt++;
+        if(g_task_running != NULL)
+            g_task_running->minflt++;
+    }
+    restore_flags(flags);
+}
+
 /**
  * page fault处理函数。
  * 特别注意：此时系统的中断处于打开状态
@@ -942,6 +1121,7 @@ int do_page_fault(struct context *ctx, uint32_t vaddr, uint32_t code)
     {
         uint32_t paddr;
         uint32_t flags = PTE_V;
+        struct pvmap *pv = NULL;
 
         if(prot & VM_PROT_WRITE)
             flags |= PTE_W;
@@ -950,14 +1130,88 @@ int do_page_fault(struct context *ctx, uint32_t vaddr, uint32_t code)
         if (vaddr < KERN_MIN_ADDR)
             flags |= PTE_U;
 
-        /*搜索空闲帧*/
+        /*内核空间（包括内核页表）被所有进程共享，标记为全局页面*/
+        if (vaddr >= (uint32_t)vtopte(KERNBASE))
+            flags |= PTE_G;
+
+        if (vaddr < USER_MAX_ADDR) {
+            int res;
+
+            /*页面已被换出，从交换区读回*/
+            if ((PTD[vaddr>>PGDR_SHIFT] & PTE_V) &&
+                IS_SWAP_ENTRY(*vtopte(vaddr))) {
+                res = page_swap_in(vaddr, flags);
+                if(res == 0)
+                    count_fault(1);
+#if VERBOSE
+                printk("->0x%08x(SWAP)\r\n", *vtopte(vaddr));
+#endif
+                return res;
+            }
+
+            /*文件映射的页面来自页缓存*/
+            res = page_fill_file(vaddr, flags);
+            if(res > 0)
+                count_fault(0);
+            if(res != 0) {
+#if VERBOSE
+                printk("->0x%08x(FILE)\r\n", *vtopte(vaddr));
+#endif
+                return (res < 0)?-1:0;
+            }
+
+            /*匿名页面，可以换出*/
+            pv = pv_alloc();
+        }
+
+        /*搜索空闲帧，没有就回收页缓存或换出页面*/
         paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX && (pcache_reclaim(16) > 0 || page_swap_out() > 0))
+            paddr = frame_alloc(1);
         if(paddr != SIZE_MAX) {
+            uint32_t eflags;
+            uint64_t t0;
+
+            /*预先映射时，其他线程可能已经处理了这个页面*/
+            save_flags_cli(eflags);
+            if (vaddr < USER_MAX_ADDR &&
+                (PTD[vaddr>>PGDR_SHIFT] & PTE_V) && (*vtopte(vaddr) & PTE_V)) {
+                restore_flags(eflags);
+                frame_free(paddr, 1);
+                if (pv != NULL)
+                    pv_free(pv);
+                return 0;
+            }
+            restore_flags(eflags);
+
             /*找到空闲帧*/
             *vtopte(vaddr) = paddr|flags;
+            t0 = rdtsc();
             memset((void *)(PAGE_TRUNCATE(vaddr)), 0, PAGE_SIZE);
             invlpg(vaddr);
 
+            save_flags_cli(eflags);
+            g_vmstat.zero_fills++;
+            g_vmstat.zero_fill_cycles += rdtsc() - t0;
+            restore_flags(eflags);
+            count_fault(0);
+
+            if (pv != NULL) {
+                save_flags_cli(eflags);
+                if (PAGE_TRUNCATE(*vtopte(vaddr)) == paddr) {
+                    pv_insert(pv, paddr, vaddr);
+                    pv = NULL;
+                }
+                restore_flags(eflags);
+                if (pv != NULL)
+                    pv_free(pv);
+            }
+
+            /*新建了内核页表，其他进程的页目录也要有它*/
+            if (vaddr >= (uint32_t)vtopte(KERNBASE) &&
+                vaddr <  (uint32_t)vtopte(KERN_MAX_ADDR) + sizeof(uint32_t))
+                proc_sync_kpde((vaddr - (uint32_t)PT)>>PAGE_SHIFT);
+
 #if VERBOSE
             printk("->0x%08x\r\n", *vtopte(vaddr));
 #endif
@@ -965,6 +1219,8 @@ int do_page_fault(struct context *ctx, uint32_t vaddr, uint32_t code)
             return 0;
         } else {
             /*物理内存已耗尽*/
+            if (pv != NULL)
+                pv_free(pv);
 #if VERBOSE
             printk("->OUT OF RAM\r\n");
 #endif
@@ -974,6 +1230,17 @@ int do_page_fault(struct context *ctx, uint32_t vaddr, uint32_t code)
     return -1;
 }
 
+/**
+ * 预先映射页面va，就像访问它引发了PF一样。页面已经映射时什么也不做
+ * 成功返回0，失败返回-1
+ */
+int page_populate(uint32_t va)
+{
+    if ((PTD[va>>PGDR_SHIFT] & PTE_V) && (*vtopte(va) & PTE_V))
+        return 0;
+    return do_page_fault(NULL, va, 0);
+}
+
 /**
  * 初始化分页子系统
  */
@@ -1000,10 +1267,11 @@ static uint32_t init_paging(uint32_t physfree)
     }
 
     /*
-     * 映射映射虚拟地址[0, R(&end)]和[KERNBASE, &end]到物理地址[0, R(&end)]
+     * 映射映射虚拟地址[0, R(&end)]和[KERNBASE, &end]到物理地址[0, R(&end)]，
+     * 连同页目录，使proc0的页目录在内核空间中有固定的地址
      */
     pte=(uint32_t *)(PAGE_TRUNCATE(pgdir[0]));
-    for(i = 0; i < (uint32_t)(pgdir); i+=PAGE_SIZE)
+    for(i = 0; i <= (uint32_t)(pgdir); i+=PAGE_SIZE)
         pte[i>>PAGE_SHIFT]=(i)|PTE_V|PTE_W;
 
     /*
@@ -1124,6 +1392,32 @@ void cstart(uint32_t magic, uint32_t mbi)
         if(i != 0xB8000)
             *vtopte(i+KERNBASE)=0;
 
+    /*
+     * 内核空间被所有进程共享。如果CPU支持，就把内核页面标记为全局页面，
+     * 切换进程时它们的TLB表项不会被刷新
+     */
+    {
+        uint32_t regs[4];
+
+        do_cpuid(1, regs);
+        if(regs[3] & CPUID_PGE) {
+            uint32_t j, *pte;
+
+            for(i = KERNBASE>>PGDR_SHIFT; i < PAGE_SIZE/sizeof(uint32_t); i++) {
+                if(!(PTD[i] & PTE_V))
+                    continue;
+                PTD[i] |= PTE_G;
+
+                pte = vtopte(i<<PGDR_SHIFT);
+                for(j = 0; j < PAGE_SIZE/sizeof(uint32_t); j++)
+                    if(pte[j] & PTE_V)
+                        pte[j] |= PTE_G;
+            }
+
+            load_cr4(rcr4() | CR4_PGE);
+        }
+    }
+
     /*
      * 初始化数学协处理器
      */
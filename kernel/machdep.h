@@ -74,6 +74,8 @@ struct fpu {
 #define IRQ_TIMER     0
 #define IRQ_KEYBOARD  1
 #define IRQ_FDC       6
+#define IRQ_IDE       14
+#define IRQ_IDE2      15
 #define NR_IRQ        16
 
 struct context {
@@ -196,14 +198,22 @@ void     init_floppy();
 uint8_t *floppy_read_sector (uint32_t lba);
 int      floppy_write_sector (size_t lba, uint8_t *buffer);
 #else
+#define IDE_MAX_SECTORS 256   /*一条命令最多传输的扇区数*/
 void ide_init(uint16_t bus);
 void ide_read_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf);
 void ide_write_sector(uint16_t bus, uint8_t slave, uint32_t lba, uint8_t *buf);
+int  ide_read_sectors(uint16_t bus, uint8_t slave, uint32_t lba,
+                      uint32_t count, uint8_t *buf);
+int  ide_write_sectors(uint16_t bus, uint8_t slave, uint32_t lba,
+                       uint32_t count, uint8_t *buf);
+int  ide_dma_init();
+int  sys_diskread(uint32_t lba, uint8_t *buf, uint32_t count, int flags);
 #endif
 
 uint8_t  pci_get_intr_line(uint16_t vendor, uint16_t product);
-uint32_t pci_get_bar_size(uint16_t vendor, uint16_t product);
-uint32_t pci_get_bar_addr(uint16_t vendor, uint16_t product);
+uint32_t pci_get_bar_size(uint16_t vendor, uint16_t product, int index);
+uint32_t pci_get_bar_addr(uint16_t vendor, uint16_t product, int index);
+void     pci_enable_busmaster(uint16_t vendor, uint16_t product);
 void     pci_init();
 
 void e1000_send(uint8_t *pkt, uint32_t length);
@@ -19,8 +19,16 @@
  */
 #include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/meminfo.h>
 #include "kernel.h"
 
+/**
+ * 反向映射：物理帧paddr被映射到哪些虚拟地址
+ *
+ * 只记录可以换出和迁移的用户页面（匿名页面和MAP_PRIVATE文件页面的副本），
+ * 它们只被映射一次。所有的pvmap组成CLOCK算法的环
+ */
 struct pvmap {
     uint32_t paddr;
     struct _vaddr {
@@ -28,23 +36,48 @@ struct pvmap {
         uint32_t vaddr;
         struct _vaddr *next;
     } vaddrs;
-    struct pvmap *next;
+    struct pvmap *next;     //CLOCK环
+    struct pvmap *prev;
+    struct pvmap *hnext;    //哈希链，以paddr为键
 };
 
+#define NR_PVHASH 1024
+#define PVHASH(paddr) (((paddr)>>PAGE_SHIFT)%NR_PVHASH)
+
+static struct pvmap *g_pvhash[NR_PVHASH];
+static struct pvmap *g_pvhand;      //CLOCK的指针
+static uint32_t      g_pvcount;
+
+/*把其他进程的页表临时映射到这个内核地址*/
+static uint32_t      g_pvwindow;
+
+/*迁移页面时源帧和目标帧临时映射到这两个页面*/
+static uint32_t      g_mwindow;
+
+struct vmstat g_vmstat;
+
+/**
+ * 文件映射：页目录为pgdir的进程把文件fp从offset开始的内容映射到
+ * [vaddr, vaddr+length)。页面在PF时才从文件读入
+ */
 struct vsmap {
     uint32_t pgdir;
     uint32_t vaddr;
     uint32_t length;
-    uint32_t fd;
+    struct file *fp;
     uint32_t offset;
+    uint32_t flags;     //MAP_SHARED或MAP_PRIVATE
     struct vsmap *next;
 };
 
+static struct vsmap *g_vsmap;
+
 struct vmzone {
     uint32_t base;
     uint32_t limit;
 
     uint32_t protect;
+    uint32_t advice;    //madvise设置的访问模式，MADV_*
 
     struct vmzone *next;
 };
@@ -52,17 +85,30 @@ struct vmzone {
 static struct vmzone km0;
 static struct vmzone *kvmzone;
 
-static struct vmzone *uvmzone;
+static struct kmem_cache *g_vmzone_cache;
+static struct kmem_cache *g_pvmap_cache;
+
+/*用户地址空间属于当前线程所在的进程*/
+#define uvmzone (g_task_running->proc->vmzone)
 
 void init_vmspace(uint32_t brk)
 {
     km0.base = USER_MAX_ADDR;
     km0.limit = brk - km0.base;
     km0.protect = VM_PROT_ALL;
+    km0.advice = MADV_NORMAL;
     km0.next = NULL;
     kvmzone = &km0;
+}
 
-    uvmzone = NULL;
+/**
+ * 创建区域和反向映射的对象缓存，必须在内核堆初始化之后调用
+ */
+void init_vmcache()
+{
+    g_vmzone_cache = kmem_cache_create("vmzone", sizeof(struct vmzone), 0, NULL);
+    g_pvmap_cache = kmem_cache_create("pvmap", sizeof(struct pvmap), 0, NULL);
+    init_pvmap();
 }
 
 /**
@@ -111,10 +157,15 @@ uint32_t page_alloc_in_addr(uint32_t va, int npages, uint32_t prot)
         }
     }
 
-    struct vmzone *x = (struct vmzone *)kmalloc(sizeof(struct vmzone));
+    struct vmzone *x = (struct vmzone *)kmem_cache_alloc(g_vmzone_cache);
+    if(x == NULL) {
+        restore_flags(flags);
+        return SIZE_MAX;
+    }
     x->base = va;
     x->limit = size;
     x->protect = prot;
+    x->advice = MADV_NORMAL;
 
     if(q == NULL) {
         x->next = p;
@@ -174,10 +225,15 @@ uint32_t page_alloc(int npages, uint32_t prot, uint32_t user)
         }
     }
 
-    struct vmzone *x = (struct vmzone *)kmalloc(sizeof(struct vmzone));
+    struct vmzone *x = (struct vmzone *)kmem_cache_alloc(g_vmzone_cache);
+    if(x == NULL) {
+        restore_flags(flags);
+        return SIZE_MAX;
+    }
     x->base = va;
     x->limit = size;
     x->protect = prot;
+    x->advice = MADV_NORMAL;
 
     if(q == NULL) {
         x->next = p;
@@ -221,7 +277,7 @@ int page_free(uint32_t va, int npages)
                 q->next = p->next;
             }
             restore_flags(flags);
-            kfree(p);
+            kmem_cache_free(g_vmzone_cache, p);
             return 0;
         }
     }
@@ -255,6 +311,748 @@ uint32_t page_prot(uint32_t va)
     return -1;
 }
 
+/**
+ * 在当前进程中建立文件映射，把文件fp从offset开始的内容映射到
+ * page_alloc/page_alloc_in_addr已经分配的[va, va+npages*PAGE_SIZE)。
+ * 映射持有调用者对fp的引用。成功返回0，失败返回-1
+ */
+int page_map_file(uint32_t va, int npages, struct file *fp,
+                  uint32_t offset, int shared)
+{
+    struct vsmap *m;
+    uint32_t flags;
+
+    m = (struct vsmap *)kmalloc(sizeof(struct vsmap));
+    if(m == NULL)
+        return -1;
+
+    m->pgdir = g_task_running->proc->pgdir;
+    m->vaddr = va;
+    m->length = npages * PAGE_SIZE;
+    m->fp = fp;
+    m->offset = offset;
+    m->flags = shared?MAP_SHARED:MAP_PRIVATE;
+
+    save_flags_cli(flags);
+    m->next = g_vsmap;
+    g_vsmap = m;
+    restore_flags(flags);
+
+    return 0;
+}
+
+/**
+ * 在当前进程中查找地址不低于va的第一个文件映射
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct vsmap *next_vsmap(uint32_t va)
+{
+    struct vsmap *m, *found = NULL;
+
+    for(m = g_vsmap; m != NULL; m = m->next) {
+        if(m->pgdir != g_task_running->proc->pgdir)
+            continue;
+        if(m->vaddr + m->length <= va)
+            continue;
+        if(found == NULL || m->vaddr < found->vaddr)
+            found = m;
+    }
+
+    return found;
+}
+
+/**
+ * 撤销当前进程中完全落在[va, end)内的文件映射，不回写
+ */
+static void drop_vsmap(uint32_t va, uint32_t end)
+{
+    struct vsmap *m, *n, *dead = NULL;
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    for(m = g_vsmap, n = NULL; m != NULL; ) {
+        if(m->pgdir == g_task_running->proc->pgdir &&
+           m->vaddr >= va && m->vaddr + m->length <= end) {
+            if(n == NULL)
+                g_vsmap = m->next;
+            else
+                n->next = m->next;
+            m->next = dead;
+            dead = m;
+            m = (n == NULL)?g_vsmap:n->next;
+        } else {
+            n = m;
+            m = m->next;
+        }
+    }
+    restore_flags(flags);
+
+    while(dead != NULL) {
+        m = dead;
+        dead = dead->next;
+        file_put(m->fp);
+        kfree(m);
+    }
+}
+
+/**
+ * 如果va属于文件映射，从页缓存取得对应的文件页面并建立映射，PTE的标志位为pteflags。
+ * MAP_SHARED直接映射缓存页面，MAP_PRIVATE映射它的副本
+ * va不属于文件映射返回0，映射成功返回1，出错返回-1
+ */
+int page_fill_file(uint32_t va, uint32_t pteflags)
+{
+    struct vsmap *m;
+    struct file *fp;
+    struct cpage *cp;
+    struct pvmap *pv = NULL;
+    uint32_t flags, offset, shared, paddr;
+
+    va = PAGE_TRUNCATE(va);
+
+    save_flags_cli(flags);
+    m = next_vsmap(va);
+    if(m == NULL || va < m->vaddr) {
+        restore_flags(flags);
+        return 0;
+    }
+    fp = m->fp;
+    offset = m->offset + (va - m->vaddr);
+    shared = m->flags & MAP_SHARED;
+    file_dup(fp);
+    restore_flags(flags);
+
+    cp = pcache_get(fp, offset);
+    if(cp == NULL) {
+        file_put(fp);
+        return -1;
+    }
+
+    if(shared) {
+        /*映射持有缓存页面的引用，撤销映射时释放*/
+        paddr = pcache_paddr(cp);
+    } else {
+        /*副本是私有的，可以换出*/
+        pv = pv_alloc();
+        paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX && (pcache_reclaim(16) > 0 || page_swap_out() > 0))
+            paddr = frame_alloc(1);
+        if(paddr != SIZE_MAX)
+            pcache_copy_frame(cp, paddr);
+        pcache_put(cp);
+        if(paddr == SIZE_MAX) {
+            if(pv != NULL)
+                pv_free(pv);
+            file_put(fp);
+            return -1;
+        }
+    }
+
+    save_flags_cli(flags);
+    if(*vtopte(va) & PTE_V) {
+        /*其他线程已经处理了这个PF*/
+        if(shared)
+            pcache_put(cp);
+        else
+            frame_free(paddr, 1);
+    } else {
+        *vtopte(va) = paddr|pteflags;
+        invlpg(va);
+        pv_insert(pv, paddr, va);
+        pv = NULL;
+    }
+    restore_flags(flags);
+
+    if(pv != NULL)
+        pv_free(pv);
+    file_put(fp);
+    return 1;
+}
+
+/**
+ * 撤销当前进程在[va, end)中以MAP_SHARED方式映射的页面，释放它们对页缓存的引用。
+ * 这些页面属于页缓存，不能用frame_free释放
+ */
+static void release_shared(uint32_t va, uint32_t end)
+{
+    struct vsmap *m;
+    struct file *fp;
+    uint32_t flags, base, limit, offset, shared, x;
+
+    while(va < end) {
+        save_flags_cli(flags);
+        m = next_vsmap(va);
+        if(m == NULL || m->vaddr >= end) {
+            restore_flags(flags);
+            break;
+        }
+        fp = m->fp;
+        base = m->vaddr;
+        limit = m->vaddr + m->length;
+        offset = m->offset;
+        shared = m->flags & MAP_SHARED;
+        file_dup(fp);
+        restore_flags(flags);
+
+        if(va < base)
+            va = base;
+        if(limit > end)
+            limit = end;
+
+        for(; shared && va < limit; va += PAGE_SIZE) {
+            if(!(PTD[va>>PGDR_SHIFT] & PTE_V))
+                continue;
+            x = *vtopte(va);
+            if(!(x & PTE_V))
+                continue;
+            *vtopte(va) = 0;
+            invlpg(va);
+            pcache_release(fp, offset + (va - base));
+        }
+
+        file_put(fp);
+        va = limit;
+    }
+}
+
+/**
+ * 把当前进程在[va, va+npages*PAGE_SIZE)中以MAP_SHARED方式映射的、
+ * 被修改过的页面写回文件。成功返回0，出错返回-1
+ */
+int page_sync(uint32_t va, int npages)
+{
+    struct vsmap *m;
+    struct file *fp;
+    uint32_t flags, end, base, limit, offset, shared, x, size;
+    int res = 0;
+
+    end = va + npages * PAGE_SIZE;
+    while(va < end) {
+        save_flags_cli(flags);
+        m = next_vsmap(va);
+        if(m == NULL || m->vaddr >= end) {
+            restore_flags(flags);
+            break;
+        }
+        fp = m->fp;
+        base = m->vaddr;
+        limit = m->vaddr + m->length;
+        offset = m->offset;
+        shared = m->flags & MAP_SHARED;
+        file_dup(fp);
+        restore_flags(flags);
+
+        if(va < base)
+            va = base;
+        if(limit > end)
+            limit = end;
+
+        for(; shared && va < limit; va += PAGE_SIZE) {
+            if(!(PTD[va>>PGDR_SHIFT] & PTE_V))
+                continue;
+            x = *vtopte(va);
+            if(!(x & PTE_V) || !(x & PTE_M))
+                continue;
+
+            /*先清除脏位，回写期间的修改会重新置位*/
+            *vtopte(va) = x & ~PTE_M;
+            invlpg(va);
+
+            /*只回写文件长度以内的部分*/
+            size = file_size(fp);
+            if(offset + (va - base) >= size)
+                continue;
+            size -= offset + (va - base);
+            if(size > PAGE_SIZE)
+                size = PAGE_SIZE;
+            if(file_pwrite(fp, offset + (va - base), (void *)va, size) != size)
+                res = -1;
+        }
+
+        file_put(fp);
+        va = limit;
+    }
+
+    return res;
+}
+
+/**
+ * 回写并撤销当前进程在[va, va+npages*PAGE_SIZE)中的文件映射
+ */
+void page_unmap_file(uint32_t va, int npages)
+{
+    page_sync(va, npages);
+    release_shared(va, va + npages * PAGE_SIZE);
+    drop_vsmap(va, va + npages * PAGE_SIZE);
+}
+
+/**
+ * 释放当前进程的整个用户地址空间，包括所有区域、其中的物理帧以及用户页表
+ *
+ * 注意：该函数的执行不能被中断
+ */
+void free_vmspace()
+{
+    struct vmzone *p, *q;
+    uint32_t va, i;
+
+    /*共享映射的页面属于页缓存，先撤销它们*/
+    release_shared(USER_MIN_ADDR, USER_MAX_ADDR);
+
+    for(p = uvmzone; p != NULL; p = q) {
+        for(va = p->base; va < p->base + p->limit; va += PAGE_SIZE) {
+            /*页表不存在，跳到下一个页表*/
+            if(!(PTD[va>>PGDR_SHIFT] & PTE_V)) {
+                va = (va & ~((1<<PGDR_SHIFT)-1)) + (1<<PGDR_SHIFT) - PAGE_SIZE;
+                continue;
+            }
+
+            page_release(va);
+        }
+        q = p->next;
+        kmem_cache_free(g_vmzone_cache, p);
+    }
+    uvmzone = NULL;
+
+    /*撤销所有文件映射，不回写*/
+    drop_vsmap(USER_MIN_ADDR, USER_MAX_ADDR);
+
+    for(i = 0; i < (USER_MAX_ADDR>>PGDR_SHIFT); i++) {
+        if(PTD[i] & PTE_V) {
+            frame_free(PAGE_TRUNCATE(PTD[i]), 1);
+            PTD[i] = 0;
+        }
+    }
+
+    invltlb();
+}
+
+/**
+ * 在[va, va+npages*PAGE_SIZE)上执行madvise，这个范围必须都在用户区域中
+ * 成功返回0，失败返回-1
+ */
+int page_advise(uint32_t va, int npages, int advice)
+{
+    struct vmzone *p;
+    uint32_t flags, end = va + npages * PAGE_SIZE, x;
+
+    for(x = va; x < end; x += PAGE_SIZE)
+        if(page_prot(x) == -1)
+            return -1;
+
+    switch(advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+        /*访问模式针对整个区域，决定PF时预先映射多少页面*/
+        save_flags_cli(flags);
+        for(p = uvmzone; p != NULL; p = p->next)
+            if(p->base < end && p->base + p->limit > va)
+                p->advice = advice;
+        restore_flags(flags);
+        break;
+    case MADV_WILLNEED:
+        for(x = va; x < end; x += PAGE_SIZE)
+            if(page_populate(x) != 0)
+                return -1;
+        break;
+    case MADV_DONTNEED:
+        /*
+         * 释放物理帧和交换槽，区域仍然有效，再次访问时重新清零或从文件读入。
+         * 共享文件映射中被修改的页面先写回文件
+         */
+        page_sync(va, npages);
+        release_shared(va, end);
+        for(x = va; x < end; x += PAGE_SIZE)
+            if(PTD[x>>PGDR_SHIFT] & PTE_V)
+                page_release(x);
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * va处的PF已经处理完毕，按所在区域的访问模式预先映射它后面的页面
+ */
+void page_fault_around(uint32_t va)
+{
+    struct vmzone *p;
+    uint32_t flags, end = 0;
+    int n = 0;
+
+    if(va < USER_MIN_ADDR || va >= USER_MAX_ADDR)
+        return;
+    va = PAGE_TRUNCATE(va);
+
+    save_flags_cli(flags);
+    for(p = uvmzone; p != NULL; p = p->next) {
+        if(va >= p->base && va < p->base + p->limit) {
+            if(p->advice == MADV_SEQUENTIAL)
+                n = FAULT_AROUND_SEQ;
+            end = p->base + p->limit;
+            break;
+        }
+    }
+    restore_flags(flags);
+
+    for(va += PAGE_SIZE; n > 0 && va < end; n--, va += PAGE_SIZE)
+        if(page_populate(va) != 0)
+            break;
+}
+
+/**
+ * 初始化反向映射，有了交换区才需要它
+ */
+void init_pvmap()
+{
+    g_pvwindow = page_alloc(3, VM_PROT_RW, 0);
+    g_mwindow = g_pvwindow + PAGE_SIZE;
+
+    /*预先建立窗口的页表*/
+    *vtopte(g_pvwindow) = 0;
+    *vtopte(g_mwindow) = 0;
+    *vtopte(g_mwindow + PAGE_SIZE) = 0;
+}
+
+/**
+ * 取得页目录为pgdir的进程中虚拟地址vaddr对应的PTE，页表不存在返回NULL
+ *
+ * 注意：该函数的执行不能被中断，返回的指针在开中断前有效
+ */
+static uint32_t *pv_pte(uint32_t pgdir, uint32_t vaddr)
+{
+    struct proc *p;
+    uint32_t pde;
+
+    if(pgdir == g_proc_active->pgdir) {
+        if(!(PTD[vaddr>>PGDR_SHIFT] & PTE_V))
+            return NULL;
+        return vtopte(vaddr);
+    }
+
+    if((p = proc_find(pgdir)) == NULL)
+        return NULL;
+    pde = p->vpgdir[vaddr>>PGDR_SHIFT];
+    if(!(pde & PTE_V))
+        return NULL;
+
+    page_map(g_pvwindow, PAGE_TRUNCATE(pde), 1, PTE_V|PTE_W);
+    invlpg(g_pvwindow);
+    return (uint32_t *)g_pvwindow + ((vaddr>>PAGE_SHIFT) & (PAGE_SIZE/sizeof(uint32_t)-1));
+}
+
+static struct pvmap *pv_lookup(uint32_t paddr)
+{
+    struct pvmap *pv;
+    for(pv = g_pvhash[PVHASH(paddr)]; pv != NULL; pv = pv->hnext)
+        if(pv->paddr == paddr)
+            return pv;
+    return NULL;
+}
+
+/**
+ * 为即将映射的可换出、可迁移的页面准备一个pvmap
+ */
+struct pvmap *pv_alloc()
+{
+    return (struct pvmap *)kmem_cache_alloc(g_pvmap_cache);
+}
+
+void pv_free(struct pvmap *pv)
+{
+    kmem_cache_free(g_pvmap_cache, pv);
+}
+
+/**
+ * 记录当前进程把物理帧paddr映射到了vaddr，pv来自pv_alloc
+ *
+ * 注意：该函数的执行不能被中断
+ */
+void pv_insert(struct pvmap *pv, uint32_t paddr, uint32_t vaddr)
+{
+    if(pv == NULL)
+        return;
+
+    pv->paddr = paddr;
+    pv->vaddrs.pgdir = g_proc_active->pgdir;
+    pv->vaddrs.vaddr = vaddr;
+    pv->vaddrs.next = NULL;
+
+    pv->hnext = g_pvhash[PVHASH(paddr)];
+    g_pvhash[PVHASH(paddr)] = pv;
+
+    /*插在指针的后面，它要等CLOCK转一圈才会被考察*/
+    if(g_pvhand == NULL) {
+        pv->next = pv->prev = pv;
+        g_pvhand = pv;
+    } else {
+        pv->next = g_pvhand;
+        pv->prev = g_pvhand->prev;
+        g_pvhand->prev->next = pv;
+        g_pvhand->prev = pv;
+    }
+    g_pvcount++;
+}
+
+/**
+ * 撤销物理帧paddr的反向映射，返回它的pvmap，由调用者释放
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct pvmap *pv_unlink(uint32_t paddr)
+{
+    struct pvmap **pp, *pv;
+
+    for(pp = &g_pvhash[PVHASH(paddr)]; *pp != NULL; pp = &(*pp)->hnext)
+        if((*pp)->paddr == paddr)
+            break;
+    if((pv = *pp) == NULL)
+        return NULL;
+    *pp = pv->hnext;
+
+    if(pv->next == pv)
+        g_pvhand = NULL;
+    else {
+        if(g_pvhand == pv)
+            g_pvhand = pv->next;
+        pv->prev->next = pv->next;
+        pv->next->prev = pv->prev;
+    }
+    g_pvcount--;
+
+    return pv;
+}
+
+/**
+ * 把用户页面从物理帧from迁移到空闲帧to：复制内容，改写PTE，刷新TLB。
+ * from没有反向映射（不可移动）时返回-1，成功返回0，之后由调用者释放from
+ */
+int page_migrate(uint32_t from, uint32_t to)
+{
+    struct pvmap *pv, **pp;
+    uint32_t flags, *pte;
+
+    save_flags_cli(flags);
+
+    if((pv = pv_lookup(from)) == NULL) {
+        restore_flags(flags);
+        return -1;
+    }
+    pte = pv_pte(pv->vaddrs.pgdir, pv->vaddrs.vaddr);
+    if(pte == NULL || !(*pte & PTE_V) || PAGE_TRUNCATE(*pte) != from) {
+        restore_flags(flags);
+        return -1;
+    }
+
+    page_map(g_mwindow, from, 1, PTE_V);
+    page_map(g_mwindow + PAGE_SIZE, to, 1, PTE_V|PTE_W);
+    invlpg(g_mwindow);
+    invlpg(g_mwindow + PAGE_SIZE);
+    memcpy((void *)(g_mwindow + PAGE_SIZE), (void *)g_mwindow, PAGE_SIZE);
+    page_unmap(g_mwindow, 2);
+
+    *pte = to | (*pte & PAGE_MASK);
+    if(pv->vaddrs.pgdir == g_proc_active->pgdir)
+        invlpg(pv->vaddrs.vaddr);
+
+    /*pvmap在CLOCK环中的位置不变，只是换到新的哈希链*/
+    for(pp = &g_pvhash[PVHASH(from)]; *pp != pv; pp = &(*pp)->hnext)
+        ;
+    *pp = pv->hnext;
+    pv->paddr = to;
+    pv->hnext = g_pvhash[PVHASH(to)];
+    g_pvhash[PVHASH(to)] = pv;
+
+    restore_flags(flags);
+    return 0;
+}
+
+/**
+ * CLOCK算法：从指针处开始考察页面，最近被访问过的清除PTE_A并跳过，
+ * 返回第一个最近没有被访问的页面。最多转两圈
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct pvmap *pv_clock()
+{
+    struct pvmap *pv;
+    uint32_t *pte, n;
+
+    for(n = 0; n <= 2 * g_pvcount && g_pvhand != NULL; n++) {
+        pv = g_pvhand;
+        g_pvhand = pv->next;
+
+        pte = pv_pte(pv->vaddrs.pgdir, pv->vaddrs.vaddr);
+        if(pte == NULL || !(*pte & PTE_V) || PAGE_TRUNCATE(*pte) != pv->paddr)
+            continue;
+
+        if(*pte & PTE_A) {
+            *pte &= ~PTE_A;
+            if(pv->vaddrs.pgdir == g_proc_active->pgdir)
+                invlpg(pv->vaddrs.vaddr);
+            continue;
+        }
+
+        return pv;
+    }
+
+    return NULL;
+}
+
+/**
+ * 用CLOCK算法选择一个页面，连同它后面相邻的、最近没有被访问的页面一起
+ * 写到交换区，释放它们的物理帧。返回释放的帧数
+ */
+int page_swap_out()
+{
+    struct pvmap *pv, *dead[SWAP_CLUSTER];
+    uint32_t paddrs[SWAP_CLUSTER];
+    uint32_t flags, pgdir, vaddr, va, slot, x, *pte;
+    int i, n;
+
+    if(!swap_enabled())
+        return 0;
+
+    swap_lock();
+    save_flags_cli(flags);
+
+    if((pv = pv_clock()) == NULL) {
+        restore_flags(flags);
+        swap_unlock();
+        return 0;
+    }
+    pgdir = pv->vaddrs.pgdir;
+    vaddr = pv->vaddrs.vaddr;
+
+    for(n = 0; n < SWAP_CLUSTER; n++) {
+        va = vaddr + n * PAGE_SIZE;
+        if(va >= USER_MAX_ADDR || (pte = pv_pte(pgdir, va)) == NULL)
+            break;
+        x = *pte;
+        if(!(x & PTE_V) || (n > 0 && (x & PTE_A)))
+            break;
+        pv = pv_lookup(PAGE_TRUNCATE(x));
+        if(pv == NULL || pv->vaddrs.pgdir != pgdir || pv->vaddrs.vaddr != va)
+            break;
+        paddrs[n] = PAGE_TRUNCATE(x);
+    }
+
+    /*交换区没有足够的连续槽，就少换出几个页面*/
+    while(n > 0 && (slot = swap_alloc(n)) == SIZE_MAX)
+        n--;
+    if(n == 0) {
+        restore_flags(flags);
+        swap_unlock();
+        return 0;
+    }
+
+    /*
+     * 先把PTE改为换出状态，之后访问这些页面的线程会在page_swap_in中
+     * 等待swap_lock，直到它们被写到交换区
+     */
+    for(i = 0; i < n; i++) {
+        va = vaddr + i * PAGE_SIZE;
+        pte = pv_pte(pgdir, va);
+        *pte = SWAP_ENTRY(slot + i);
+        if(pgdir == g_proc_active->pgdir)
+            invlpg(va);
+        dead[i] = pv_unlink(paddrs[i]);
+    }
+    restore_flags(flags);
+
+    swap_write(slot, paddrs, n);
+
+    for(i = 0; i < n; i++) {
+        frame_free(paddrs[i], 1);
+        pv_free(dead[i]);
+    }
+    g_vmstat.swapouts += n;
+
+    swap_unlock();
+    return n;
+}
+
+/**
+ * 把当前进程中已被换出的页面va换入，PTE的标志位为pteflags
+ * 成功返回0，失败返回-1
+ */
+int page_swap_in(uint32_t va, uint32_t pteflags)
+{
+    struct pvmap *pv;
+    uint32_t flags, paddr, x;
+
+    va = PAGE_TRUNCATE(va);
+
+    pv = pv_alloc();
+    paddr = frame_alloc(1);
+    if(paddr == SIZE_MAX && (pcache_reclaim(16) > 0 || page_swap_out() > 0))
+        paddr = frame_alloc(1);
+    if(paddr == SIZE_MAX) {
+        if(pv != NULL)
+            pv_free(pv);
+        return -1;
+    }
+
+    swap_lock();
+
+    x = *vtopte(va);
+    if(IS_SWAP_ENTRY(x)) {
+        swap_read(SWAP_SLOT(x), paddr);
+
+        save_flags_cli(flags);
+        if(*vtopte(va) == x) {
+            *vtopte(va) = paddr|pteflags;
+            invlpg(va);
+            swap_free(SWAP_SLOT(x));
+            pv_insert(pv, paddr, va);
+            pv = NULL;
+            paddr = SIZE_MAX;
+        }
+        restore_flags(flags);
+    }
+
+    swap_unlock();
+
+    /*其他线程已经处理了这个PF，或者页面已被撤销*/
+    if(paddr != SIZE_MAX)
+        frame_free(paddr, 1);
+    if(pv != NULL)
+        pv_free(pv);
+
+    return 0;
+}
+
+/**
+ * 撤销当前进程中虚拟地址va的映射，释放它的物理帧或交换槽
+ */
+void page_release(uint32_t va)
+{
+    struct pvmap *pv = NULL;
+    uint32_t flags, x;
+
+    save_flags_cli(flags);
+    x = *vtopte(va);
+    if(x & PTE_V) {
+        *vtopte(va) = 0;
+        invlpg(va);
+        pv = pv_unlink(PAGE_TRUNCATE(x));
+
+        //XXX - 可能不是RAM，不能用frame_free
+        frame_free(PAGE_TRUNCATE(x), 1);
+    } else if(IS_SWAP_ENTRY(x)) {
+        *vtopte(va) = 0;
+        swap_free(SWAP_SLOT(x));
+    }
+    restore_flags(flags);
+
+    if(pv != NULL)
+        pv_free(pv);
+}
+
 /**
  * 把从vaddr开始的虚拟地址，映射到paddr开始的物理地址。
  * 共映射npages页面，把PTE的标志位设为flags
@@ -262,7 +1060,8 @@ uint32_t page_prot(uint32_t va)
 void page_map(uint32_t vaddr, uint32_t paddr, uint32_t npages, uint32_t flags)
 {
     for (; npages > 0; npages--){
-        *vtopte(vaddr) = paddr | flags;
+        /*内核空间被所有进程共享，标记为全局页面*/
+        *vtopte(vaddr) = paddr | flags | ((vaddr >= KERNBASE)?PTE_G:0);
         vaddr += PAGE_SIZE;
         paddr += PAGE_SIZE;
     }
@@ -279,3 +1078,45 @@ void page_unmap(uint32_t vaddr, uint32_t npages)
         vaddr += PAGE_SIZE;
     }
 }
+
+/**
+ * 系统调用meminfo的执行函数
+ *
+ * 把物理内存、内核堆和PF的统计数据填入mi，tid为-1时取当前线程的PF次数
+ * 线程tid不存在时返回-1
+ */
+int sys_meminfo(struct meminfo *mi, int tid)
+{
+    size_t size, used, peak;
+    uint32_t flags;
+
+    memset(mi, 0, sizeof(struct meminfo));
+
+    if(tid == -1)
+        tid = sys_task_getid();
+    if(task_faults(tid, &mi->task_minflt, &mi->task_majflt) != 0)
+        return -1;
+
+    mi->nzones = frame_stat(mi->zone, MEMINFO_NZONE);
+
+    kmalloc_stat(&size, &used, &peak);
+    mi->kheap_size = size;
+    mi->kheap_used = used;
+    mi->kheap_peak = peak;
+
+    save_flags_cli(flags);
+    mi->minflt = g_vmstat.minflt;
+    mi->majflt = g_vmstat.majflt;
+    mi->zero_fills = g_vmstat.zero_fills;
+    mi->zero_fill_cycles = g_vmstat.zero_fill_cycles;
+    mi->swapouts = g_vmstat.swapouts;
+    mi->mmaps = g_vmstat.mmaps;
+    mi->munmaps = g_vmstat.munmaps;
+    mi->compact_runs = g_vmstat.compact_runs;
+    mi->compact_moved = g_vmstat.compact_moved;
+    mi->compact_failed = g_vmstat.compact_failed;
+    mi->compact_gained = g_vmstat.compact_gained;
+    restore_flags(flags);
+
+    return 0;
+}
@@ -0,0 +1,524 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include <sys/pcache.h>
+#include "kernel.h"
+
+/**
+ * 页缓存
+ *
+ * 以（文件标识，页面偏移）为键，缓存文件中整页的数据。read系统调用和
+ * 文件映射的PF都从这里取数据，MAP_SHARED映射直接映射缓存的帧。
+ * 写文件时同步更新缓存，所以缓存中的页面总是干净的；没有被引用的页面
+ * 在物理内存不足时被回收
+ *
+ * 顺序读文件时，内核线程kreadahead在后台把后面的页面预先读进缓存
+ */
+#define NR_CPAGE  1024          /*最多缓存的页面数，即4MiB*/
+#define NR_CHASH  256
+#define NR_RAQ    16            /*预读请求队列的长度*/
+
+struct cpage {
+    uint32_t  ino;              /*文件标识*/
+    uint32_t  offset;           /*页面在文件中的偏移*/
+    uint32_t  paddr;            /*缓存页面的物理帧，0表示没有*/
+    int       refcnt;           /*正在读取或映射到用户空间的次数*/
+    int       state;
+    int       ra;               /*由预读读入，还没有被读过*/
+#define CPAGE_FREE    0
+#define CPAGE_FILLING 1
+#define CPAGE_VALID   2
+    struct wait_queue *wq;      /*等待页面读入的线程*/
+    struct cpage *hnext;        /*哈希链*/
+    struct cpage *prev, *next;  /*LRU链表，或空闲链表*/
+};
+
+static struct cpage  g_cpage[NR_CPAGE];
+static struct cpage *g_chash[NR_CHASH];
+static struct cpage *g_cfree;               /*空闲的缓存槽*/
+static struct cpage *g_lru_head, *g_lru_tail;
+
+/*第i个缓存槽映射在内核地址g_cbase+i*PAGE_SIZE*/
+static uint32_t g_cbase;
+
+/*把帧临时映射到这个内核地址，用于复制缓存页面*/
+static uint32_t g_cwindow;
+
+static struct pcache_stat g_cstat;
+
+/*预读请求的环形队列，kreadahead在g_ra_wq上等待请求*/
+static struct {
+    struct file *fp;
+    uint32_t     offset;
+    int          npages;
+} g_raq[NR_RAQ];
+static int g_raq_head, g_raq_count;
+static struct wait_queue *g_ra_wq;
+
+static void kreadahead(void *pv);
+
+#define CPAGE_VADDR(cp) (g_cbase + ((cp) - g_cpage) * PAGE_SIZE)
+#define CHASH(ino, offset) ((((ino) * 31) + ((offset) >> PAGE_SHIFT)) % NR_CHASH)
+
+/**
+ * 初始化页缓存，必须在init_file之后、task0加入用户进程之前调用，
+ * kreadahead线程属于proc0
+ */
+void init_pcache()
+{
+    uint32_t i, va;
+
+    g_cbase = page_alloc(NR_CPAGE, VM_PROT_RW, 0);
+    g_cwindow = page_alloc(1, VM_PROT_RW, 0);
+
+    /*预先建立这些地址的页表，之后在关中断时映射不会引发PF*/
+    for(va = g_cbase; va < g_cbase + NR_CPAGE * PAGE_SIZE; va += PAGE_SIZE)
+        *vtopte(va) = 0;
+    *vtopte(g_cwindow) = 0;
+
+    g_cfree = NULL;
+    for(i = 0; i < NR_CPAGE; i++) {
+        memset(&g_cpage[i], 0, sizeof(struct cpage));
+        g_cpage[i].next = g_cfree;
+        g_cfree = &g_cpage[i];
+    }
+    memset(g_chash, 0, sizeof(g_chash));
+    g_lru_head = g_lru_tail = NULL;
+
+    memset(&g_cstat, 0, sizeof(g_cstat));
+    g_cstat.maxpages = NR_CPAGE;
+
+    g_raq_head = g_raq_count = 0;
+    g_ra_wq = NULL;
+    sys_task_create(NULL, kreadahead, NULL);
+}
+
+static void lru_remove(struct cpage *cp)
+{
+    if(cp->prev) cp->prev->next = cp->next; else g_lru_head = cp->next;
+    if(cp->next) cp->next->prev = cp->prev; else g_lru_tail = cp->prev;
+    cp->prev = cp->next = NULL;
+}
+
+static void lru_insert(struct cpage *cp)
+{
+    cp->prev = NULL;
+    cp->next = g_lru_head;
+    if(g_lru_head) g_lru_head->prev = cp; else g_lru_tail = cp;
+    g_lru_head = cp;
+}
+
+static void hash_remove(struct cpage *cp)
+{
+    struct cpage **pp = &g_chash[CHASH(cp->ino, cp->offset)];
+    while(*pp != NULL) {
+        if(*pp == cp) {
+            *pp = cp->hnext;
+            break;
+        }
+        pp = &(*pp)->hnext;
+    }
+    cp->hnext = NULL;
+}
+
+static struct cpage *hash_lookup(uint32_t ino, uint32_t offset)
+{
+    struct cpage *cp;
+    for(cp = g_chash[CHASH(ino, offset)]; cp != NULL; cp = cp->hnext)
+        if(cp->ino == ino && cp->offset == offset)
+            return cp;
+    return NULL;
+}
+
+/**
+ * 把缓存页面cp从缓存中撤下，放回空闲链表
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static void cpage_drop(struct cpage *cp, int keep_frame)
+{
+    hash_remove(cp);
+    lru_remove(cp);
+    if(!keep_frame && cp->paddr) {
+        page_unmap(CPAGE_VADDR(cp), 1);
+        frame_free(cp->paddr, 1);
+        cp->paddr = 0;
+        g_cstat.pages--;
+    }
+    cp->state = CPAGE_FREE;
+    cp->next = g_cfree;
+    g_cfree = cp;
+}
+
+/**
+ * 回收最多n个没有被引用的缓存页面，返回实际回收的页面数
+ */
+int pcache_reclaim(int n)
+{
+    struct cpage *cp, *prev;
+    uint32_t flags;
+    int freed = 0;
+
+    save_flags_cli(flags);
+    for(cp = g_lru_tail; cp != NULL && freed < n; cp = prev) {
+        prev = cp->prev;
+        if(cp->refcnt == 0 && cp->state == CPAGE_VALID) {
+            cpage_drop(cp, 0);
+            freed++;
+        }
+    }
+    g_cstat.reclaims += freed;
+    restore_flags(flags);
+
+    return freed;
+}
+
+/**
+ * 分配一个缓存槽，返回时它已经有物理帧并映射好了
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct cpage *cpage_alloc()
+{
+    struct cpage *cp;
+    uint32_t paddr;
+
+    /*没有空闲槽，淘汰最久没有使用的页面，沿用它的帧*/
+    if(g_cfree == NULL) {
+        for(cp = g_lru_tail; cp != NULL; cp = cp->prev)
+            if(cp->refcnt == 0 && cp->state == CPAGE_VALID)
+                break;
+        if(cp == NULL)
+            return NULL;
+        cpage_drop(cp, 1);
+        g_cstat.reclaims++;
+    }
+
+    cp = g_cfree;
+    if(cp->paddr == 0) {
+        paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX && pcache_reclaim(1) > 0)
+            paddr = frame_alloc(1);
+        if(paddr == SIZE_MAX)
+            return NULL;
+        cp = g_cfree;       /*pcache_reclaim改变了空闲链表*/
+        if(cp->paddr != 0) {
+            frame_free(paddr, 1);
+        } else {
+            cp->paddr = paddr;
+            page_map(CPAGE_VADDR(cp), paddr, 1, PTE_V|PTE_W);
+            g_cstat.pages++;
+        }
+    }
+    g_cfree = cp->next;
+    cp->prev = cp->next = NULL;
+
+    return cp;
+}
+
+/**
+ * 取得文件fp中offset所在的缓存页面并增加其引用计数，不在缓存中就从文件读入。
+ * ra非0表示是预读，读入的页面记作预读页面，不计入命中和缺失
+ * 出错返回NULL
+ */
+static struct cpage *cpage_get(struct file *fp, uint32_t offset, int ra)
+{
+    struct cpage *cp;
+    uint32_t flags, ino = file_ino(fp);
+    int n;
+
+    offset = PAGE_TRUNCATE(offset);
+
+    save_flags_cli(flags);
+    cp = hash_lookup(ino, offset);
+    if(cp != NULL) {
+        cp->refcnt++;
+        while(cp->state == CPAGE_FILLING)
+            sleep_on(&cp->wq);
+        if(cp->state != CPAGE_VALID) {
+            /*读入失败*/
+            restore_flags(flags);
+            pcache_put(cp);
+            return NULL;
+        }
+        lru_remove(cp);
+        lru_insert(cp);
+        if(!ra) {
+            g_cstat.hits++;
+            if(cp->ra) {
+                cp->ra = 0;
+                g_cstat.ra_hits++;
+            }
+        }
+        restore_flags(flags);
+        return cp;
+    }
+
+    cp = cpage_alloc();
+    if(cp == NULL) {
+        restore_flags(flags);
+        return NULL;
+    }
+    cp->ino = ino;
+    cp->offset = offset;
+    cp->refcnt = 1;
+    cp->state = CPAGE_FILLING;
+    cp->ra = ra;
+    cp->wq = NULL;
+    cp->hnext = g_chash[CHASH(ino, offset)];
+    g_chash[CHASH(ino, offset)] = cp;
+    lru_insert(cp);
+    if(ra)
+        g_cstat.ra_pages++;
+    else
+        g_cstat.misses++;
+    restore_flags(flags);
+
+    n = file_pread(fp, offset, (void *)CPAGE_VADDR(cp), PAGE_SIZE);
+    if(n >= 0)
+        memset((void *)(CPAGE_VADDR(cp)+n), 0, PAGE_SIZE-n);
+
+    save_flags_cli(flags);
+    wake_up(&cp->wq, -1);
+    if(n < 0) {
+        /*其他等待的线程看到CPAGE_FREE就会放弃*/
+        cp->refcnt--;
+        hash_remove(cp);
+        lru_remove(cp);
+        cp->state = CPAGE_FREE;
+        if(cp->refcnt == 0) {
+            cp->next = g_cfree;
+            g_cfree = cp;
+        }
+        cp = NULL;
+    } else
+        cp->state = CPAGE_VALID;
+    restore_flags(flags);
+
+    return cp;
+}
+
+struct cpage *pcache_get(struct file *fp, uint32_t offset)
+{
+    return cpage_get(fp, offset, 0);
+}
+
+/**
+ * 文件fp中offset所在的页面是否已经在缓存中，或者正在读入
+ */
+int pcache_cached(struct file *fp, uint32_t offset)
+{
+    struct cpage *cp;
+    uint32_t flags;
+    int ret;
+
+    save_flags_cli(flags);
+    cp = hash_lookup(file_ino(fp), PAGE_TRUNCATE(offset));
+    ret = (cp != NULL && cp->state != CPAGE_FREE);
+    restore_flags(flags);
+
+    return ret;
+}
+
+/**
+ * 请求kreadahead把文件fp中从offset开始的npages个页面读进缓存，不等待读完。
+ * 队列满时放弃这次预读
+ */
+void pcache_readahead(struct file *fp, uint32_t offset, int npages)
+{
+    uint32_t flags;
+    int i;
+
+    if(npages <= 0)
+        return;
+
+    save_flags_cli(flags);
+    if(g_raq_count < NR_RAQ) {
+        i = (g_raq_head + g_raq_count) % NR_RAQ;
+        g_raq[i].fp = fp;
+        g_raq[i].offset = PAGE_TRUNCATE(offset);
+        g_raq[i].npages = npages;
+        g_raq_count++;
+        file_dup(fp);    /*请求处理完之前文件不会被关闭*/
+        wake_up(&g_ra_wq, 1);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * 内核线程，逐个处理预读请求，跳过已经在缓存中的页面
+ */
+static void kreadahead(void *pv)
+{
+    struct file *fp;
+    struct cpage *cp;
+    uint32_t flags, offset;
+    int npages;
+
+    while(1) {
+        save_flags_cli(flags);
+        while(g_raq_count == 0)
+            sleep_on(&g_ra_wq);
+        fp = g_raq[g_raq_head].fp;
+        offset = g_raq[g_raq_head].offset;
+        npages = g_raq[g_raq_head].npages;
+        g_raq_head = (g_raq_head + 1) % NR_RAQ;
+        g_raq_count--;
+        restore_flags(flags);
+
+        for(; npages > 0 && offset < file_size(fp); npages--, offset += PAGE_SIZE) {
+            if(pcache_cached(fp, offset))
+                continue;
+            if((cp = cpage_get(fp, offset, 1)) == NULL)
+                break;
+            pcache_put(cp);
+        }
+
+        file_put(fp);
+    }
+}
+
+/**
+ * 减少缓存页面cp的引用计数
+ */
+void pcache_put(struct cpage *cp)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    if(--cp->refcnt == 0 && cp->state == CPAGE_FREE) {
+        /*读入失败的页面，最后一个引用者把它放回空闲链表*/
+        cp->next = g_cfree;
+        g_cfree = cp;
+    }
+    restore_flags(flags);
+}
+
+/**
+ * 释放对文件fp中offset所在缓存页面的一次引用
+ */
+void pcache_release(struct file *fp, uint32_t offset)
+{
+    struct cpage *cp;
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    cp = hash_lookup(file_ino(fp), PAGE_TRUNCATE(offset));
+    if(cp != NULL)
+        pcache_put(cp);
+    restore_flags(flags);
+}
+
+uint32_t pcache_paddr(struct cpage *cp)
+{
+    return cp->paddr;
+}
+
+/**
+ * 把缓存页面cp的内容复制到物理帧paddr
+ */
+void pcache_copy_frame(struct cpage *cp, uint32_t paddr)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    page_map(g_cwindow, paddr, 1, PTE_V|PTE_W);
+    memcpy((void *)g_cwindow, (void *)CPAGE_VADDR(cp), PAGE_SIZE);
+    page_unmap(g_cwindow, 1);
+    restore_flags(flags);
+}
+
+/**
+ * 从文件fp的offset处读取最多len字节到buf，数据来自页缓存
+ * 返回实际读取的字节数，出错返回-1
+ */
+int pcache_read(struct file *fp, uint32_t offset, void *buf, uint32_t len)
+{
+    struct cpage *cp;
+    uint32_t size = file_size(fp), n;
+    int total = 0;
+
+    if(offset >= size)
+        return 0;
+    if(len > size - offset)
+        len = size - offset;
+
+    while(len > 0) {
+        cp = pcache_get(fp, offset);
+        if(cp == NULL)
+            return (total == 0)?-1:total;
+
+        n = PAGE_SIZE - (offset & PAGE_MASK);
+        if(n > len)
+            n = len;
+
+        /*复制到用户空间时可能引发PF，页面已被引用，不会被回收*/
+        memcpy((uint8_t *)buf+total,
+               (void *)(CPAGE_VADDR(cp) + (offset & PAGE_MASK)), n);
+        pcache_put(cp);
+
+        offset += n;
+        total += n;
+        len -= n;
+    }
+
+    return total;
+}
+
+/**
+ * 文件fp从offset开始的len字节已被改写为buf，更新缓存中对应的页面
+ */
+void pcache_update(struct file *fp, uint32_t offset, void *buf, uint32_t len)
+{
+    struct cpage *cp;
+    uint32_t flags, ino = file_ino(fp), n;
+
+    while(len > 0) {
+        n = PAGE_SIZE - (offset & PAGE_MASK);
+        if(n > len)
+            n = len;
+
+        save_flags_cli(flags);
+        cp = hash_lookup(ino, PAGE_TRUNCATE(offset));
+        if(cp != NULL) {
+            cp->refcnt++;
+            while(cp->state == CPAGE_FILLING)
+                sleep_on(&cp->wq);
+            if(cp->state == CPAGE_VALID)
+                memcpy((void *)(CPAGE_VADDR(cp) + (offset & PAGE_MASK)), buf, n);
+            restore_flags(flags);
+            pcache_put(cp);
+        } else
+            restore_flags(flags);
+
+        offset += n;
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+}
+
+/**
+ * 取得页缓存的统计信息
+ */
+void pcache_getstat(struct pcache_stat *st)
+{
+    uint32_t flags;
+    save_flags_cli(flags);
+    *st = g_cstat;
+    restore_flags(flags);
+}
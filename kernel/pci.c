@@ -3,8 +3,11 @@
 
 #define PCI_CONFIG_ADDR      0xCF8
 #define PCI_CONFIG_DATA      0xCFC
+#define PCI_COMMAND          0x04
 #define PCI_BAR_0            0x10
 
+#define PCI_CMD_BUSMASTER    0x0004
+
 struct pci_device_header {
 	uint16_t vendor_id;
 	uint16_t product_id;
@@ -131,23 +134,26 @@ static struct pci_device *get_device(uint16_t vendor, uint16_t product)
 	return NULL;
 }
 
-uint32_t pci_get_bar_addr(uint16_t vendor, uint16_t product/*, uint32_t index*/)
+uint32_t pci_get_bar_addr(uint16_t vendor, uint16_t product, int index)
 {
 	struct pci_device *dev = get_device(vendor, product);
 	if(dev != NULL) {
-		return (dev->conf.bars[0/*+index*/]) & (~0xf);
+		/*I/O空间的BAR只有低两位是标志*/
+		if(dev->conf.bars[index] & 1)
+			return (dev->conf.bars[index]) & (~0x3);
+		return (dev->conf.bars[index]) & (~0xf);
 	}
 	return -1;
 }
 
-uint32_t pci_get_bar_size(uint16_t vendor, uint16_t product/*, uint32_t index*/)
+uint32_t pci_get_bar_size(uint16_t vendor, uint16_t product, int index)
 {
 	struct pci_device *dev = get_device(vendor, product);
 	if(dev != NULL) {
 		uint32_t addr = PCI_CONF_ADDR(GET_BUS(dev->bsf),
 									  GET_SLOT(dev->bsf),
 									  GET_FUNC(dev->bsf),
-									  PCI_BAR_0/*+index*4*/);
+									  (PCI_BAR_0+index*4));
 		uint32_t old = pci_read(addr);
 		pci_write(addr, 0xFFFFFFFF);
 		uint32_t size = pci_read(addr);
@@ -157,6 +163,23 @@ uint32_t pci_get_bar_size(uint16_t vendor, uint16_t product/*, uint32_t index*/)
 	return -1;
 }
 
+/*
+ * 允许设备成为总线主控，进行DMA
+ */
+void pci_enable_busmaster(uint16_t vendor, uint16_t product)
+{
+	struct pci_device *dev = get_device(vendor, product);
+	if(dev != NULL) {
+		uint32_t addr = PCI_CONF_ADDR(GET_BUS(dev->bsf),
+									  GET_SLOT(dev->bsf),
+									  GET_FUNC(dev->bsf),
+									  PCI_COMMAND);
+		/*高16位是状态寄存器，写0不会改变它*/
+		pci_write(addr, (pci_read(addr) & 0xffff) | PCI_CMD_BUSMASTER);
+		dev->conf.hdr.command |= PCI_CMD_BUSMASTER;
+	}
+}
+
 uint8_t pci_get_intr_line(uint16_t vendor, uint16_t product)
 {
 	struct pci_device *dev = get_device(vendor, product);
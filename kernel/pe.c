@@ -146,6 +146,11 @@ typedef struct _IMAGE_SECTION_HEADER {
 #define IMAGE_SCN_MEM_WRITE   0x80000000
 } IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
 
+/*PE的加载不需要对象缓存*/
+void init_aout()
+{
+}
+
 uint32_t load_aout(VOLINFO *pvi, char *filename)
 {
     unsigned char scratch[SECTOR_SIZE];
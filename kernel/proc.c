@@ -0,0 +1,155 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+
+struct proc  proc0;
+struct proc *g_proc_active;
+
+/*所有进程组成的链表，proc0总在其中*/
+static struct proc *g_proc_head;
+
+/**
+ * 初始化进程子系统。启动时建立的页目录就是proc0的页目录
+ */
+void init_proc()
+{
+    proc0.pid = 0;
+    proc0.pgdir = PAGE_TRUNCATE(rcr3());
+    proc0.vpgdir = (uint32_t *)(proc0.pgdir + KERNBASE);
+    proc0.vmzone = NULL;
+    proc0.nthreads = 0;
+    memset(proc0.files, 0, sizeof(proc0.files));
+    proc0.next = NULL;
+
+    g_proc_head = &proc0;
+    g_proc_active = &proc0;
+}
+
+/**
+ * 创建一个新进程，它的用户地址空间是空的
+ * 失败返回NULL
+ */
+struct proc *proc_create()
+{
+    static int pid = 1;
+    struct proc *p;
+    uint32_t flags, i;
+
+    p = (struct proc *)kmalloc(sizeof(struct proc));
+    if(p == NULL)
+        return NULL;
+
+    p->vpgdir = (uint32_t *)kmemalign(PAGE_SIZE, PAGE_SIZE);
+    if(p->vpgdir == NULL) {
+        kfree(p);
+        return NULL;
+    }
+
+    /*清零页目录，同时确保它已经有了物理帧*/
+    memset(p->vpgdir, 0, PAGE_SIZE);
+
+    p->pgdir = PAGE_TRUNCATE(vtop((uint32_t)p->vpgdir));
+    p->vmzone = NULL;
+    p->nthreads = 0;
+    memset(p->files, 0, sizeof(p->files));
+
+    save_flags_cli(flags);
+
+    p->pid = pid++;
+
+    /*共享内核空间的页表*/
+    for(i = KERNBASE>>PGDR_SHIFT; i < PAGE_SIZE/sizeof(uint32_t); i++)
+        p->vpgdir[i] = PTD[i];
+
+    /*映射页目录及页表*/
+    p->vpgdir[(KERNBASE>>PGDR_SHIFT)-1] = p->pgdir|PTE_V|PTE_W;
+
+    p->next = g_proc_head;
+    g_proc_head = p;
+
+    restore_flags(flags);
+
+    return p;
+}
+
+/**
+ * 把CR3切换到进程p的页目录
+ *
+ * 内核页面是全局的（PTE_G），重新加载CR3不会刷新它们的TLB表项
+ */
+void proc_activate(struct proc *p)
+{
+    load_cr3(p->pgdir);
+    g_proc_active = p;
+}
+
+/**
+ * 销毁进程p，释放它的用户地址空间和页目录。
+ * p必须是当前线程所属的进程，返回时已切换到proc0的地址空间
+ *
+ * 注意：该函数的执行不能被中断
+ */
+void proc_destroy(struct proc *p)
+{
+    struct proc *q;
+
+    free_vmspace();
+    file_close_all(p);
+    proc_activate(&proc0);
+
+    for(q = g_proc_head; q != NULL; q = q->next) {
+        if(q->next == p) {
+            q->next = p->next;
+            break;
+        }
+    }
+    if(g_proc_head == p)
+        g_proc_head = p->next;
+
+    kfree(p->vpgdir);
+    kfree(p);
+}
+
+/**
+ * 查找页目录为pgdir的进程，找不到返回NULL
+ *
+ * 注意：该函数的执行不能被中断
+ */
+struct proc *proc_find(uint32_t pgdir)
+{
+    struct proc *p;
+    for(p = g_proc_head; p != NULL; p = p->next)
+        if(p->pgdir == pgdir)
+            return p;
+    return NULL;
+}
+
+/**
+ * 当前页目录中新建了内核页表（第pdi项），把它同步到所有进程的页目录
+ */
+void proc_sync_kpde(uint32_t pdi)
+{
+    struct proc *p;
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    for(p = g_proc_head; p != NULL; p = p->next)
+        p->vpgdir[pdi] = PTD[pdi];
+    restore_flags(flags);
+}
@@ -8,18 +8,23 @@ struct Semaphore *get_semaphore(int semid);
 void add_semaphore(struct Semaphore *sem);
 void remove_semaphore(struct Semaphore *sem);
 
+static struct kmem_cache *g_sem_cache;
+
+void init_sem(){
+    g_sem_cache=kmem_cache_create("semaphore", sizeof(struct Semaphore), 0, NULL);
+}
+
 int sys_sem_create(int value){
     static int semid=0;
-    struct Semaphore *sem=(struct Semaphore *)kmalloc(sizeof(struct Semaphore));
+    struct Semaphore *sem=(struct Semaphore *)kmem_cache_alloc(g_sem_cache);
+    if(sem==NULL)
+        return -1;
     sem->value=value;
     sem->next=NULL;
     sem->semid=semid++;
     sem->waitqueue=NULL;
     add_semaphore(sem);
-    if(sem==NULL)
-        return -1;
-    else
-        return sem->semid;
+    return sem->semid;
 }
 
 int sys_sem_destroy(int semid){
@@ -28,7 +33,7 @@ int sys_sem_destroy(int semid){
     if(sem==NULL)
         return -1;
     remove_semaphore(sem);
-    kfree(sem);
+    kmem_cache_free(g_sem_cache, sem);
     return 0;
 }
 
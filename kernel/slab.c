@@ -0,0 +1,327 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+
+/**
+ * 对象缓存（slab分配器）
+ *
+ * 每个缓存管理一种大小固定的对象。缓存向内核堆申请整块的slab，
+ * 把它划分成对象，空闲对象串在slab的空闲链表中。
+ * 小对象的slab是一个页面，slab描述符放在页面开头；
+ * 大对象的slab由多个页面组成，描述符另行分配
+ */
+#define SLAB_SMALL_MAX   (PAGE_SIZE/8)  /*不超过它的是小对象*/
+#define SLAB_LARGE_NOBJS 8              /*大对象的slab包含的对象数*/
+#define SLAB_KEEP_EMPTY  1              /*每个缓存最多保留的空slab数*/
+#define CACHE_LINE       32
+
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *prev, *next;
+    uint32_t base;          /*slab的起始地址*/
+    void    *freelist;      /*空闲对象链表*/
+    int      inuse;         /*已分配的对象数*/
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t   objsize;       /*对象占用的字节数，包括链接字*/
+    size_t   align;
+    size_t   linkoff;       /*空闲链表的链接字在对象中的偏移*/
+    void   (*ctor)(void *);
+    uint32_t slabsize;
+    int      nobjs;         /*每个slab中的对象数*/
+    int      offslab;       /*slab描述符是否在slab之外*/
+    uint32_t color;         /*下一个slab的着色偏移*/
+    uint32_t color_max;
+
+    struct slab *partial, *full, *empty;
+    int      nempty;
+
+    uint32_t nslabs;        /*slab的个数*/
+    uint32_t inuse;         /*已分配的对象数*/
+    uint32_t nallocs;       /*累计分配次数*/
+
+    struct kmem_cache *next;
+};
+
+static struct kmem_cache *g_kmem_caches;
+
+#define OBJ_LINK(c, obj) (*(void **)((uint8_t *)(obj) + (c)->linkoff))
+
+void init_slab()
+{
+    g_kmem_caches = NULL;
+}
+
+static void slab_list_add(struct slab **head, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = *head;
+    if(*head != NULL)
+        (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_list_del(struct slab **head, struct slab *s)
+{
+    if(s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if(s->next != NULL)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+/**
+ * 创建对象缓存。size是对象的大小，align是对齐要求（0表示默认），
+ * ctor不为NULL时，对象在slab创建时被它初始化一次，释放对象时应恢复这个状态
+ * 失败返回NULL
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *))
+{
+    struct kmem_cache *c;
+    uint32_t flags, leftover;
+
+    if(align < sizeof(void *))
+        align = sizeof(void *);
+    if(size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + align - 1) & ~(align - 1);
+
+    c = (struct kmem_cache *)kmalloc(sizeof(struct kmem_cache));
+    if(c == NULL)
+        return NULL;
+    memset(c, 0, sizeof(struct kmem_cache));
+
+    c->name = name;
+    c->align = align;
+    c->ctor = ctor;
+
+    /*有构造函数时对象的内容要保留，链接字放在对象之后*/
+    if(ctor != NULL) {
+        c->linkoff = size;
+        size = (size + sizeof(void *) + align - 1) & ~(align - 1);
+    } else
+        c->linkoff = 0;
+    c->objsize = size;
+
+    if(size <= SLAB_SMALL_MAX) {
+        c->offslab = 0;
+        c->slabsize = PAGE_SIZE;
+        leftover = PAGE_SIZE - ((sizeof(struct slab) + align - 1) & ~(align - 1));
+        c->nobjs = leftover / size;
+    } else {
+        c->offslab = 1;
+        c->slabsize = PAGE_ROUNDUP(size * SLAB_LARGE_NOBJS);
+        leftover = c->slabsize;
+        c->nobjs = leftover / size;
+    }
+
+    /*剩余的空间用来给slab着色，错开不同slab中对象的cache行*/
+    c->color_max = (leftover - c->nobjs * size) & ~(align - 1);
+    c->color = 0;
+
+    save_flags_cli(flags);
+    c->next = g_kmem_caches;
+    g_kmem_caches = c;
+    restore_flags(flags);
+
+    return c;
+}
+
+/**
+ * 为缓存c新建一个slab，失败返回NULL
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct slab *slab_create(struct kmem_cache *c)
+{
+    struct slab *s;
+    uint8_t *mem, *obj;
+    uint32_t step;
+    int i;
+
+    mem = (uint8_t *)kmemalign((c->align > PAGE_SIZE)?c->align:PAGE_SIZE,
+                               c->slabsize);
+    if(mem == NULL)
+        return NULL;
+
+    if(c->offslab) {
+        s = (struct slab *)kmalloc(sizeof(struct slab));
+        if(s == NULL) {
+            kfree(mem);
+            return NULL;
+        }
+        obj = mem;
+    } else {
+        s = (struct slab *)mem;
+        obj = mem + ((sizeof(struct slab) + c->align - 1) & ~(c->align - 1));
+    }
+
+    obj += c->color;
+    step = (c->align > CACHE_LINE)?c->align:CACHE_LINE;
+    c->color += step;
+    if(c->color > c->color_max)
+        c->color = 0;
+
+    s->cache = c;
+    s->base = (uint32_t)mem;
+    s->inuse = 0;
+    s->freelist = NULL;
+    for(i = c->nobjs - 1; i >= 0; i--) {
+        if(c->ctor != NULL)
+            c->ctor(obj + i * c->objsize);
+        OBJ_LINK(c, obj + i * c->objsize) = s->freelist;
+        s->freelist = obj + i * c->objsize;
+    }
+
+    c->nslabs++;
+    return s;
+}
+
+/**
+ * 把空slab s还给内核堆
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static void slab_destroy(struct kmem_cache *c, struct slab *s)
+{
+    c->nslabs--;
+    kfree((void *)s->base);
+    if(c->offslab)
+        kfree(s);
+}
+
+/**
+ * 查找对象obj所在的slab
+ *
+ * 注意：该函数的执行不能被中断
+ */
+static struct slab *slab_of(struct kmem_cache *c, void *obj)
+{
+    struct slab *s;
+
+    if(!c->offslab)
+        return (struct slab *)PAGE_TRUNCATE((uint32_t)obj);
+
+    /*大对象的slab不多，逐个查找*/
+    for(s = c->full; s != NULL; s = s->next)
+        if((uint32_t)obj >= s->base && (uint32_t)obj < s->base + c->slabsize)
+            return s;
+    for(s = c->partial; s != NULL; s = s->next)
+        if((uint32_t)obj >= s->base && (uint32_t)obj < s->base + c->slabsize)
+            return s;
+    return NULL;
+}
+
+/**
+ * 从缓存c中分配一个对象，失败返回NULL
+ */
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct slab *s;
+    uint32_t flags;
+    void *obj;
+
+    save_flags_cli(flags);
+
+    s = c->partial;
+    if(s == NULL) {
+        if((s = c->empty) != NULL) {
+            slab_list_del(&c->empty, s);
+            c->nempty--;
+        } else if((s = slab_create(c)) == NULL) {
+            restore_flags(flags);
+            return NULL;
+        }
+        slab_list_add(&c->partial, s);
+    }
+
+    obj = s->freelist;
+    s->freelist = OBJ_LINK(c, obj);
+    if(++s->inuse == c->nobjs) {
+        slab_list_del(&c->partial, s);
+        slab_list_add(&c->full, s);
+    }
+
+    c->inuse++;
+    c->nallocs++;
+
+    restore_flags(flags);
+    return obj;
+}
+
+/**
+ * 把对象obj还给缓存c
+ */
+void kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct slab *s;
+    uint32_t flags;
+
+    if(obj == NULL)
+        return;
+
+    save_flags_cli(flags);
+
+    if((s = slab_of(c, obj)) == NULL) {
+        restore_flags(flags);
+        printk("kmem_cache_free: 0x%08x does not belong to %s\r\n",
+               (uint32_t)obj, c->name);
+        return;
+    }
+
+    OBJ_LINK(c, obj) = s->freelist;
+    s->freelist = obj;
+    c->inuse--;
+
+    if(s->inuse-- == c->nobjs) {
+        slab_list_del(&c->full, s);
+        slab_list_add(&c->partial, s);
+    }
+
+    if(s->inuse == 0) {
+        slab_list_del(&c->partial, s);
+        if(c->nempty < SLAB_KEEP_EMPTY) {
+            slab_list_add(&c->empty, s);
+            c->nempty++;
+        } else
+            slab_destroy(c, s);
+    }
+
+    restore_flags(flags);
+}
+
+/**
+ * 取得缓存c中slab的个数、已分配的对象数和对象大小
+ */
+void kmem_cache_stat(struct kmem_cache *c, uint32_t *nslabs,
+                     uint32_t *inuse, uint32_t *objsize)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    *nslabs = c->nslabs;
+    *inuse = c->inuse;
+    *objsize = c->objsize;
+    restore_flags(flags);
+}
@@ -18,6 +18,7 @@
  *
  */
 #include <stddef.h>
+#include <string.h>
 #include "kernel.h"
 
 /*中断向量表*/
@@ -36,6 +37,7 @@ void isr_default(uint32_t irq, struct context *ctx)
 }
 
 #include "dosfs.h"
+void     init_aout();
 uint32_t load_aout(VOLINFO *pvi, char *filename);
 
 /**
@@ -45,23 +47,25 @@ VOLINFO g_volinfo;
 uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer,
         uint32_t sector, uint32_t count)
 {
+#ifdef USE_FLOPPY
     unsigned long i;
 
     for (i=0;i<count;i++) {
-#ifdef USE_FLOPPY
         unsigned char *p;
         if((p=floppy_read_sector(sector)) == NULL) {
             printk("floppy_read_sector failed\r\n");
             return -1;
         }
         memcpy(buffer, p, SECTOR_SIZE);
-#else
-        ide_read_sector(0x1f0, 0, sector, buffer);
-#endif
 
         sector++;
         buffer += SECTOR_SIZE;
     }
+#else
+    /*经过块缓存*/
+    if(bcache_read(unit, buffer, sector, count) != 0)
+        return -1;
+#endif
 
     return 0;
 }
@@ -69,24 +73,66 @@ uint32_t DFS_ReadSector(uint8_t unit, uint8_t *buffer,
 uint32_t DFS_WriteSector(uint8_t unit, uint8_t *buffer,
         uint32_t sector, uint32_t count)
 {
+#ifdef USE_FLOPPY
     unsigned long i;
 
     for (i=0;i<count;i++) {
-#ifdef USE_FLOPPY
         if(floppy_write_sector(sector, buffer) < 0) {
             printk("floppy_write_sector failed\r\n");
             return -1;
         }
-#else
-        ide_write_sector(0x1f0, 0, sector, buffer);
-#endif
         sector++;
         buffer += SECTOR_SIZE;
     }
+#else
+    /*写进块缓存，稍后写回*/
+    if(bcache_write(unit, buffer, sector, count) != 0)
+        return -1;
+#endif
 
     return 0;
 }
 
+#if VERBOSE
+/**
+ * 检查新建的内核页表会同步到所有进程：task0在进程p中映射一个超出
+ * 预建页表范围的内核页面，再到proc0的地址空间中读它。
+ * 新建的页表不会释放，所以只在调试时做
+ */
+static int check_kpde(struct proc *p)
+{
+    uint32_t va = VADDR(1000, 0), paddr, flags, magic = 0;
+
+    /*这个页目录项已经存在，检查不出问题*/
+    if(PTD[va >> PGDR_SHIFT] != 0)
+        return 0;
+
+    if(page_alloc_in_addr(va, 1, VM_PROT_RW) == SIZE_MAX)
+        return -1;
+    if((paddr = frame_alloc(1)) == SIZE_MAX) {
+        page_free(va, 1);
+        return -1;
+    }
+
+    /*写PTE引发PF，新建的页表要同步到proc0*/
+    page_map(va, paddr, 1, PTE_V|PTE_W);
+    *(uint32_t *)va = 0x4b504445;
+
+    save_flags_cli(flags);
+    proc_activate(&proc0);
+    invlpg(va);           /*全局页面，切换CR3不会刷掉它的TLB表项*/
+    magic = *(uint32_t *)va;
+    proc_activate(p);
+    restore_flags(flags);
+
+    page_unmap(va, 1);
+    frame_free(paddr, 1);
+    page_free(va, 1);
+
+    return (magic == 0x4b504445) ? 0 : -1;
+}
+#endif
+
 /**
  * 这个函数被线程task0执行，负责启动第一个用户级线程。
  */
@@ -110,6 +156,14 @@ void start_user_task()
     pci_init();           //初始化PCI总线控制器
     printk("Done\r\n");
 
+#ifndef USE_FLOPPY
+    printk("task #%d: Initializing IDE DMA...", sys_task_getid());
+    if(ide_dma_init())    //有PIIX的IDE控制器就用DMA
+        printk("Done\r\n");
+    else
+        printk("PIO only\r\n");
+#endif
+
     vm86_init();          //初始化8086模拟器
 
     /*
@@ -119,6 +173,12 @@ void start_user_task()
         uint32_t pstart;
         uint8_t scratch[SECTOR_SIZE];
 
+#ifndef USE_FLOPPY
+        printk("task #%d: Initializing block cache...", sys_task_getid());
+        init_bcache(BCACHE_SIZE);
+        printk("Done\r\n");
+#endif
+
         printk("task #%d: Initializing FAT file system...", sys_task_getid());
 
 #ifdef USE_FLOPPY
@@ -136,12 +196,53 @@ void start_user_task()
             return;
         }
         printk("Done\r\n");
+
+        init_file();
+        init_pcache();
+
+#ifndef USE_FLOPPY
+        /*硬盘上有交换分区就启用交换*/
+        printk("task #%d: Initializing swap...", sys_task_getid());
+        init_swap(scratch);
+        if(swap_enabled())
+            printk("Done\r\n");
+        else
+            printk("No swap partition\r\n");
+#endif
     }
 
     /*
-     * 加载a.out，并创建第一个用户级线程执行a.out中的main函数
+     * 为a.out创建一个进程，加载a.out，并创建第一个用户级线程执行a.out中的main函数
      */
     {
+        struct proc *proc;
+        uint32_t flags;
+
+        printk("task #%d: Creating process for %s...", sys_task_getid(), filename);
+        proc = proc_create();
+        if(proc == NULL) {
+            printk("Failed\r\n");
+            return;
+        }
+        printk("Done\r\n");
+
+        /*task0暂时加入新进程，在它的地址空间中完成加载*/
+        save_flags_cli(flags);
+        g_task_running->proc = proc;
+        proc->nthreads++;
+        proc_activate(proc);
+        restore_flags(flags);
+
+        vm86_init();      //8086模拟器需要的低端内存也映射到新进程
+
+#if VERBOSE
+        printk("task #%d: Checking shared kernel page tables...", sys_task_getid());
+        if(check_kpde(proc) == 0)
+            printk("Done\r\n");
+        else
+            printk("Failed\r\n");
+#endif
+
         printk("task #%d: Loading %s...", sys_task_getid(), filename);
         entry = load_aout(&g_volinfo, filename);
 
@@ -156,6 +257,20 @@ void start_user_task()
                 printk("Failed\r\n");
         } else
             printk("Failed\r\n");
+
+        /*task0回到proc0。如果没能创建用户级线程，销毁新进程*/
+        save_flags_cli(flags);
+        if(--proc->nthreads == 0)
+            proc_destroy(proc);
+        g_task_running->proc = &proc0;
+        restore_flags(flags);
+    }
+
+    {
+        size_t size, used, peak;
+        kmalloc_stat(&size, &used, &peak);
+        printk("task #%d: Kernel heap %dKiB, %dKiB in use, peak %dKiB\r\n",
+               sys_task_getid(), size/1024, used/1024, peak/1024);
     }
 }
 
@@ -185,6 +300,16 @@ void mi_startup()
         enable_irq(IRQ_KEYBOARD);
     }
 
+    /*
+     * 按CPU的特性选择memcpy/memset的实现。内核不保存FPU的状态，不能用MMX
+     */
+    {
+        uint32_t feat = memx_init(MEMX_ALL & ~MEMX_MMX);
+        printk("memcpy: %s%s\r\n",
+               (feat & MEMX_ERMS)?"erms":((feat & MEMX_REP)?"rep":"generic"),
+               (feat & MEMX_NT)?"+nt":"");
+    }
+
     /*
      * 初始化物理内存管理器
      */
@@ -197,10 +322,18 @@ void mi_startup()
     init_vmspace(brk+1024*PAGE_SIZE);
 
     /*
-     * 初始化内核堆，大小为4MiB，由kmalloc/kfree管理.
+     * 初始化内核堆，初始大小为4MiB，由kmalloc/kfree管理，用完时自动增长
      */
     init_kmalloc((uint8_t *)brk, 1024*PAGE_SIZE);
 
+    /*
+     * 初始化常用内核对象的缓存
+     */
+    init_slab();
+    init_vmcache();
+    init_sem();
+    init_aout();
+
     /*
      * 初始化多线程子系统
      */
@@ -209,11 +342,14 @@ void mi_startup()
     /*
      * task0是系统空闲线程，已经由init_task创建。
      * 这里用run_as_task0手工切换到task0运行。
-     * 由task0启动第一个用户线程，然后它将循环执行函数cpu_idle。
+     * 由task0启动第一个用户线程，然后它将循环执行函数cpu_idle，
+     * 并在空闲时紧缩物理内存。
      */
     run_as_task0();
     start_user_task();
-    while(1)
+    while(1) {
+        frame_compact_idle();
         cpu_idle();
+    }
 }
 
@@ -0,0 +1,147 @@
+/**
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+#include "bitmap.h"
+#include "dosfs.h"
+
+/**
+ * 交换区
+ *
+ * 交换区是IDE硬盘上类型为0x82的分区，按页面大小划分为交换槽，
+ * 用位图记录哪些槽已被占用。换出的页面的PTE记录它所在的槽号
+ */
+#define SWAP_PTYPE   0x82
+#define SWAP_UNIT    0
+#define SECT_PER_PAGE (PAGE_SIZE/SECTOR_SIZE)
+
+static uint32_t       g_swap_start;     /*交换分区的起始扇区*/
+static uint32_t       g_swap_nslots;    /*交换槽的个数，0表示没有交换区*/
+static struct bitmap *g_swap_map;       /*交换槽位图*/
+
+/*同一时刻只有一个线程在换入换出，它独占下面的窗口*/
+static int      g_swap_sem;
+static uint32_t g_swap_window;
+
+/**
+ * 在硬盘的分区表中查找交换分区并初始化交换区
+ * scratch指向一个扇区大小的缓冲区
+ */
+void init_swap(uint8_t *scratch)
+{
+    uint32_t start, size, bytes;
+    uint8_t ptype;
+    int i;
+
+    g_swap_nslots = 0;
+
+    for(i = 0; i < 4; i++) {
+        start = DFS_GetPtnStart(SWAP_UNIT, scratch, i, NULL, &ptype, &size);
+        if(start != 0xffffffff && ptype == SWAP_PTYPE && size >= SECT_PER_PAGE)
+            break;
+    }
+    if(i == 4)
+        return;
+
+    bytes = bitmap_buf_size(size / SECT_PER_PAGE);
+    if((g_swap_map = (struct bitmap *)kmalloc(bytes)) == NULL)
+        return;
+    g_swap_map = bitmap_create_in_buf(size / SECT_PER_PAGE, g_swap_map, bytes);
+
+    g_swap_sem = sys_sem_create(1);
+    g_swap_window = page_alloc(SWAP_CLUSTER, VM_PROT_RW, 0);
+
+    /*预先建立窗口的页表，换入换出时不会因此引发PF*/
+    for(i = 0; i < SWAP_CLUSTER; i++)
+        *vtopte(g_swap_window + i * PAGE_SIZE) = 0;
+
+    g_swap_start = start;
+    g_swap_nslots = size / SECT_PER_PAGE;
+}
+
+int swap_enabled()
+{
+    return g_swap_nslots != 0;
+}
+
+void swap_lock()
+{
+    sys_sem_wait(g_swap_sem);
+}
+
+void swap_unlock()
+{
+    sys_sem_signal(g_swap_sem);
+}
+
+/**
+ * 分配n个连续的交换槽，返回第一个槽的槽号，失败返回SIZE_MAX
+ */
+uint32_t swap_alloc(int n)
+{
+    uint32_t flags, slot;
+
+    save_flags_cli(flags);
+    slot = bitmap_scan_and_flip(g_swap_map, 0, n, false);
+    restore_flags(flags);
+
+    return (slot == BITMAP_ERROR)?SIZE_MAX:slot;
+}
+
+void swap_free(uint32_t slot)
+{
+    uint32_t flags;
+
+    save_flags_cli(flags);
+    bitmap_reset(g_swap_map, slot);
+    restore_flags(flags);
+}
+
+/**
+ * 把物理帧paddrs[0..n)依次写入从slot开始的交换槽，一次I/O完成
+ * 调用者必须持有swap_lock
+ */
+void swap_write(uint32_t slot, uint32_t *paddrs, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++) {
+        page_map(g_swap_window + i * PAGE_SIZE, paddrs[i], 1, PTE_V|PTE_W);
+        invlpg(g_swap_window + i * PAGE_SIZE);
+    }
+
+    DFS_WriteSector(SWAP_UNIT, (uint8_t *)g_swap_window,
+                    g_swap_start + slot * SECT_PER_PAGE, n * SECT_PER_PAGE);
+
+    page_unmap(g_swap_window, n);
+}
+
+/**
+ * 把交换槽slot读入物理帧paddr
+ * 调用者必须持有swap_lock
+ */
+void swap_read(uint32_t slot, uint32_t paddr)
+{
+    page_map(g_swap_window, paddr, 1, PTE_V|PTE_W);
+    invlpg(g_swap_window);
+
+    DFS_ReadSector(SWAP_UNIT, (uint8_t *)g_swap_window,
+                   g_swap_start + slot * SECT_PER_PAGE, SECT_PER_PAGE);
+
+    page_unmap(g_swap_window, 1);
+}
@@ -27,6 +27,9 @@ struct tcb *g_task_running;
 struct tcb *task0;
 struct tcb *g_task_own_fpu;
 
+/*TCB页面的对象缓存*/
+static struct kmem_cache *g_tcb_cache;
+
 /**
  * CPU调度器函数，这里只实现了轮转调度算法
  *
@@ -196,7 +199,7 @@ struct tcb *sys_task_create(void *tos,
     if(ustack & 3)
         return NULL;
 
-    p = (char *)kmemalign(PAGE_SIZE, PAGE_SIZE);
+    p = (char *)kmem_cache_alloc(g_tcb_cache);
     if(p == NULL)
         return NULL;
 
@@ -224,6 +227,9 @@ struct tcb *sys_task_create(void *tos,
     INIT_TASK_CONTEXT(ustack, new->kstack, func, pv);
 
     save_flags_cli(flags);
+    /*新线程属于创建者所在的进程*/
+    new->proc = (g_task_running == NULL)?&proc0:g_task_running->proc;
+    new->proc->nthreads++;
     add_task(new);
     restore_flags(flags);
 
@@ -239,6 +245,11 @@ void sys_task_exit(int code_exit)
 {
     uint32_t flags;
 
+    /*进程的最后一个线程退出前，把共享的文件映射写回文件*/
+    if(g_task_running->proc->nthreads == 1 &&
+       g_task_running->proc != &proc0)
+        page_sync(USER_MIN_ADDR, (USER_MAX_ADDR-USER_MIN_ADDR)/PAGE_SIZE);
+
     save_flags_cli(flags);
 
     wake_up(&g_task_running->wq_exit, -1);
@@ -249,6 +260,13 @@ void sys_task_exit(int code_exit)
     if(g_task_own_fpu == g_task_running)
         g_task_own_fpu = NULL;
 
+    /*进程的最后一个线程退出了，销毁该进程*/
+    if(--g_task_running->proc->nthreads == 0 &&
+       g_task_running->proc != &proc0) {
+        proc_destroy(g_task_running->proc);
+        g_task_running->proc = &proc0;
+    }
+
     schedule();
 }
 
@@ -287,7 +305,7 @@ int sys_task_wait(int tid, int *pcode_exit)
         //printk("%d: Task %d reaped\r\n", sys_task_getid(), tsk->tid);
         restore_flags(flags);
 
-        kfree(tsk);
+        kmem_cache_free(g_tcb_cache, tsk);
         return 0;
     }
 
@@ -295,6 +313,26 @@ int sys_task_wait(int tid, int *pcode_exit)
     return 0;
 }
 
+/**
+ * 取得线程tid的PF次数，线程不存在返回-1
+ */
+int task_faults(int tid, uint32_t *minflt, uint32_t *majflt)
+{
+    uint32_t flags;
+    struct tcb *tsk;
+
+    save_flags_cli(flags);
+    if((tsk = get_task(tid)) == NULL) {
+        restore_flags(flags);
+        return -1;
+    }
+    *minflt = tsk->minflt;
+    *majflt = tsk->majflt;
+    restore_flags(flags);
+
+    return 0;
+}
+
 /**
  * 系统调用task_getid的执行函数
  *
@@ -328,6 +366,11 @@ void init_task()
     g_task_head = NULL;
     g_task_own_fpu = NULL;
 
+    init_proc();
+
+    /*TCB和线程的内核栈共用一个页面*/
+    g_tcb_cache = kmem_cache_create("tcb", PAGE_SIZE, PAGE_SIZE, NULL);
+
     /*
      * 创建线程task0，即系统空闲线程
      */
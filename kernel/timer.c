@@ -35,6 +35,8 @@ void isr_timer(uint32_t irq, struct context *ctx)
     g_timer_ticks++;
     //sys_putchar('.');
 
+    bcache_timer();
+
     if(g_task_running != NULL) {
         //如果是task0在运行，则强制调度
         if(g_task_running->tid == 0) {
@@ -299,7 +299,7 @@ typedef UInt32              UIntN;
 
 /********************************************************************
  **
- ** void *memcpy(void *dest, const void *src, size_t count)
+ ** void *memcpy_generic(void *dest, const void *src, size_t count)
  **
  ** Args:     dest        - pointer to destination buffer
  **           src         - pointer to source buffer
@@ -312,7 +312,7 @@ typedef UInt32              UIntN;
  **
  *******************************************************************/
 
-void *memcpy(void *dest, const void *src, size_t count)
+void *memcpy_generic(void *dest, const void *src, size_t count)
 {
     UInt8* dst8 = (UInt8*)dest;
     UInt8* src8 = (UInt8*)src;
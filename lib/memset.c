@@ -83,7 +83,7 @@ bzero(dst0, length)
 #define	WIDEVAL	c
 
 void *
-memset(dst0, c0, length)
+memset_generic(dst0, c0, length)
 	void *dst0;
 	register int c0;
 	register size_t length;
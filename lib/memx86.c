@@ -0,0 +1,423 @@
+/*
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ *
+ * This file is part of the EPOS.
+ *
+ * Redistribution and use in source and binary forms are freely
+ * permitted provided that the above copyright notice and this
+ * paragraph and the following disclaimer are duplicated in all
+ * such forms.
+ *
+ * This software is provided "AS IS" and without any express or
+ * implied warranties, including, without limitation, the implied
+ * warranties of merchantability and fitness for a particular
+ * purpose.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * x86专用的memcpy/memset/memmove，内核和用户程序共用
+ *
+ * 启动时由memx_init根据CPUID选择实现，经函数指针调用：
+ *  - MEMX_REP:  rep movsl/stosl，先按字节对齐目的地址
+ *  - MEMX_ERMS: CPU支持增强的串操作时，直接rep movsb/stosb
+ *  - MEMX_MMX:  一次移动64字节的MMX版本，会用到FPU的状态，内核不能用
+ *  - MEMX_NT:   大块数据用movnti绕过cache写入，不会冲掉cache中有用的数据。
+ *               movnti只用通用寄存器，不涉及XMM寄存器的保存和恢复
+ */
+#define MEMX_MMX_MIN    512         /*不小于它才用MMX*/
+#define MEMX_NT_MIN     (64*1024)   /*不小于它才用非临时写*/
+
+void *memcpy_generic(void *dest, const void *src, size_t count);
+void *memset_generic(void *b, int c, size_t len);
+void *memmove_generic(void *dest, const void *src, size_t count);
+
+static unsigned g_memx;     /*memx_init选中的特性*/
+
+static void *memcpy_x86(void *dest, const void *src, size_t n);
+static void *memset_x86(void *b, int c, size_t n);
+
+static void *(*g_memcpy)(void *, const void *, size_t) = memcpy_generic;
+static void *(*g_memset)(void *, int, size_t) = memset_generic;
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    return g_memcpy(dest, src, n);
+}
+
+void *memset(void *b, int c, size_t n)
+{
+    return g_memset(b, c, n);
+}
+
+/**
+ * 没有重叠或者目的地址在前时，从前往后复制就是正确的
+ */
+void *memmove(void *dest, const void *src, size_t n)
+{
+    uint32_t d = (uint32_t)dest, s = (uint32_t)src, tail;
+
+    if(d - s >= n)
+        return g_memcpy(dest, src, n);
+    if(g_memx == 0)
+        return memmove_generic(dest, src, n);
+
+    /*从后往前：先复制末尾零散的字节，再按字复制*/
+    d += n - 1;
+    s += n - 1;
+    tail = n & 3;
+    __asm__ __volatile__(
+        "std\n\t"
+        "rep movsb\n\t"
+        "subl $3, %%esi\n\t"
+        "subl $3, %%edi\n\t"
+        "movl %3, %%ecx\n\t"
+        "rep movsl\n\t"
+        "cld"
+        : "+D"(d), "+S"(s), "+c"(tail)
+        : "r"(n >> 2)
+        : "memory", "cc");
+
+    return dest;
+}
+
+static void *memcpy_rep(void *dest, const void *src, size_t n)
+{
+    uint32_t d = (uint32_t)dest, s = (uint32_t)src, head, words;
+
+    if(n >= 16) {
+        head = (-d) & 3;
+        words = (n - head) >> 2;
+        n = (n - head) & 3;
+        __asm__ __volatile__(
+            "rep movsb\n\t"
+            "movl %3, %%ecx\n\t"
+            "rep movsl"
+            : "+D"(d), "+S"(s), "+c"(head)
+            : "r"(words)
+            : "memory");
+    }
+    __asm__ __volatile__("rep movsb"
+                         : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+
+    return dest;
+}
+
+static void *memcpy_erms(void *dest, const void *src, size_t n)
+{
+    uint32_t d = (uint32_t)dest, s = (uint32_t)src;
+
+    __asm__ __volatile__("rep movsb"
+                         : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+
+    return dest;
+}
+
+/**
+ * 每次用8个MMX寄存器移动64字节，n不小于64
+ */
+static void *memcpy_mmx(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t blocks = n >> 6;
+
+    __asm__ __volatile__(
+        "1:\n\t"
+        "movq   (%1), %%mm0\n\t"
+        "movq  8(%1), %%mm1\n\t"
+        "movq 16(%1), %%mm2\n\t"
+        "movq 24(%1), %%mm3\n\t"
+        "movq 32(%1), %%mm4\n\t"
+        "movq 40(%1), %%mm5\n\t"
+        "movq 48(%1), %%mm6\n\t"
+        "movq 56(%1), %%mm7\n\t"
+        "movq %%mm0,   (%0)\n\t"
+        "movq %%mm1,  8(%0)\n\t"
+        "movq %%mm2, 16(%0)\n\t"
+        "movq %%mm3, 24(%0)\n\t"
+        "movq %%mm4, 32(%0)\n\t"
+        "movq %%mm5, 40(%0)\n\t"
+        "movq %%mm6, 48(%0)\n\t"
+        "movq %%mm7, 56(%0)\n\t"
+        "addl $64, %1\n\t"
+        "addl $64, %0\n\t"
+        "decl %2\n\t"
+        "jnz 1b\n\t"
+        "emms"
+        : "+r"(d), "+r"(s), "+r"(blocks)
+        :
+        : "memory", "cc", "st", "st(1)", "st(2)", "st(3)",
+          "st(4)", "st(5)", "st(6)", "st(7)");
+
+    memcpy_rep(d, s, n & 63);
+    return dest;
+}
+
+/**
+ * 目的地址按64字节对齐后，每次用movnti写64字节，n不小于64
+ */
+static void *memcpy_nt(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    uint32_t head = (-(uint32_t)d) & 63;
+    size_t blocks;
+
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    blocks = n >> 6;
+
+    if(blocks != 0)
+        __asm__ __volatile__(
+            "1:\n\t"
+            "movl   (%1), %%eax\n\t"
+            "movl  4(%1), %%edx\n\t"
+            "movnti %%eax,   (%0)\n\t"
+            "movnti %%edx,  4(%0)\n\t"
+            "movl  8(%1), %%eax\n\t"
+            "movl 12(%1), %%edx\n\t"
+            "movnti %%eax,  8(%0)\n\t"
+            "movnti %%edx, 12(%0)\n\t"
+            "movl 16(%1), %%eax\n\t"
+            "movl 20(%1), %%edx\n\t"
+            "movnti %%eax, 16(%0)\n\t"
+            "movnti %%edx, 20(%0)\n\t"
+            "movl 24(%1), %%eax\n\t"
+            "movl 28(%1), %%edx\n\t"
+            "movnti %%eax, 24(%0)\n\t"
+            "movnti %%edx, 28(%0)\n\t"
+            "movl 32(%1), %%eax\n\t"
+            "movl 36(%1), %%edx\n\t"
+            "movnti %%eax, 32(%0)\n\t"
+            "movnti %%edx, 36(%0)\n\t"
+            "movl 40(%1), %%eax\n\t"
+            "movl 44(%1), %%edx\n\t"
+            "movnti %%eax, 40(%0)\n\t"
+            "movnti %%edx, 44(%0)\n\t"
+            "movl 48(%1), %%eax\n\t"
+            "movl 52(%1), %%edx\n\t"
+            "movnti %%eax, 48(%0)\n\t"
+            "movnti %%edx, 52(%0)\n\t"
+            "movl 56(%1), %%eax\n\t"
+            "movl 60(%1), %%edx\n\t"
+            "movnti %%eax, 56(%0)\n\t"
+            "movnti %%edx, 60(%0)\n\t"
+            "addl $64, %1\n\t"
+            "addl $64, %0\n\t"
+            "decl %2\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(s), "+r"(blocks)
+            :
+            : "memory", "cc", "eax", "edx");
+
+    memcpy_rep(d, s, n & 63);
+    return dest;
+}
+
+static void *memcpy_x86(void *dest, const void *src, size_t n)
+{
+    if(n >= MEMX_NT_MIN && (g_memx & MEMX_NT))
+        return memcpy_nt(dest, src, n);
+    if(n >= MEMX_MMX_MIN && (g_memx & MEMX_MMX))
+        return memcpy_mmx(dest, src, n);
+    if(g_memx & MEMX_ERMS)
+        return memcpy_erms(dest, src, n);
+    return memcpy_rep(dest, src, n);
+}
+
+static void *memset_rep(void *b, int c, size_t n)
+{
+    uint32_t d = (uint32_t)b, head, words, v;
+
+    v = (uint8_t)c * 0x01010101U;
+    if(n >= 16) {
+        head = (-d) & 3;
+        words = (n - head) >> 2;
+        n = (n - head) & 3;
+        __asm__ __volatile__(
+            "rep stosb\n\t"
+            "movl %2, %%ecx\n\t"
+            "rep stosl"
+            : "+D"(d), "+c"(head)
+            : "r"(words), "a"(v)
+            : "memory");
+    }
+    __asm__ __volatile__("rep stosb"
+                         : "+D"(d), "+c"(n) : "a"(v) : "memory");
+
+    return b;
+}
+
+static void *memset_erms(void *b, int c, size_t n)
+{
+    uint32_t d = (uint32_t)b;
+
+    __asm__ __volatile__("rep stosb"
+                         : "+D"(d), "+c"(n) : "a"(c) : "memory");
+
+    return b;
+}
+
+static void *memset_mmx(void *b, int c, size_t n)
+{
+    uint8_t *d = (uint8_t *)b;
+    uint32_t v = (uint8_t)c * 0x01010101U;
+    size_t blocks = n >> 6;
+
+    __asm__ __volatile__(
+        "movd %2, %%mm0\n\t"
+        "punpckldq %%mm0, %%mm0\n\t"
+        "1:\n\t"
+        "movq %%mm0,   (%0)\n\t"
+        "movq %%mm0,  8(%0)\n\t"
+        "movq %%mm0, 16(%0)\n\t"
+        "movq %%mm0, 24(%0)\n\t"
+        "movq %%mm0, 32(%0)\n\t"
+        "movq %%mm0, 40(%0)\n\t"
+        "movq %%mm0, 48(%0)\n\t"
+        "movq %%mm0, 56(%0)\n\t"
+        "addl $64, %0\n\t"
+        "decl %1\n\t"
+        "jnz 1b\n\t"
+        "emms"
+        : "+r"(d), "+r"(blocks)
+        : "r"(v)
+        : "memory", "cc", "st");
+
+    memset_rep(d, c, n & 63);
+    return b;
+}
+
+static void *memset_nt(void *b, int c, size_t n)
+{
+    uint8_t *d = (uint8_t *)b;
+    uint32_t v = (uint8_t)c * 0x01010101U;
+    uint32_t head = (-(uint32_t)d) & 63;
+    size_t blocks;
+
+    memset_rep(d, c, head);
+    d += head;
+    n -= head;
+    blocks = n >> 6;
+
+    if(blocks != 0)
+        __asm__ __volatile__(
+            "1:\n\t"
+            "movnti %2,   (%0)\n\t"
+            "movnti %2,  4(%0)\n\t"
+            "movnti %2,  8(%0)\n\t"
+            "movnti %2, 12(%0)\n\t"
+            "movnti %2, 16(%0)\n\t"
+            "movnti %2, 20(%0)\n\t"
+            "movnti %2, 24(%0)\n\t"
+            "movnti %2, 28(%0)\n\t"
+            "movnti %2, 32(%0)\n\t"
+            "movnti %2, 36(%0)\n\t"
+            "movnti %2, 40(%0)\n\t"
+            "movnti %2, 44(%0)\n\t"
+            "movnti %2, 48(%0)\n\t"
+            "movnti %2, 52(%0)\n\t"
+            "movnti %2, 56(%0)\n\t"
+            "movnti %2, 60(%0)\n\t"
+            "addl $64, %0\n\t"
+            "decl %1\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(blocks)
+            : "r"(v)
+            : "memory", "cc");
+
+    memset_rep(d, c, n & 63);
+    return b;
+}
+
+static void *memset_x86(void *b, int c, size_t n)
+{
+    if(n >= MEMX_NT_MIN && (g_memx & MEMX_NT))
+        return memset_nt(b, c, n);
+    if(n >= MEMX_MMX_MIN && (g_memx & MEMX_MMX))
+        return memset_mmx(b, c, n);
+    if(g_memx & MEMX_ERMS)
+        return memset_erms(b, c, n);
+    return memset_rep(b, c, n);
+}
+
+static __inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b,
+                           uint32_t *c, uint32_t *d)
+{
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                         : "a"(leaf), "c"(0));
+}
+
+/**
+ * 能改变EFLAGS的ID位（第21位）就说明CPU支持CPUID指令
+ */
+static int has_cpuid()
+{
+    uint32_t f0, f1;
+
+    __asm__ __volatile__(
+        "pushfl\n\t"
+        "pushfl\n\t"
+        "popl %0\n\t"
+        "movl %0, %1\n\t"
+        "xorl $0x200000, %0\n\t"
+        "pushl %0\n\t"
+        "popfl\n\t"
+        "pushfl\n\t"
+        "popl %0\n\t"
+        "popfl"
+        : "=&r"(f0), "=&r"(f1));
+
+    return ((f0 ^ f1) & 0x200000) != 0;
+}
+
+/**
+ * 根据CPUID选择实现，只考虑allowed中的特性，返回选中的特性
+ */
+unsigned memx_init(unsigned allowed)
+{
+    uint32_t max, a, b, c, d;
+    unsigned feat = 0;
+
+    if(has_cpuid()) {
+        cpuid(0, &max, &b, &c, &d);
+        if(max >= 1) {
+            cpuid(1, &a, &b, &c, &d);
+            feat |= MEMX_REP;
+            if(d & (1 << 23))
+                feat |= MEMX_MMX;
+            if(d & (1 << 26))
+                feat |= MEMX_NT;
+        }
+        if(max >= 7) {
+            cpuid(7, &a, &b, &c, &d);
+            if(b & (1 << 9))
+                feat |= MEMX_ERMS;
+        }
+    }
+
+    feat &= allowed;
+
+    /*MMX比不过增强的串操作*/
+    if((feat & MEMX_ERMS) && allowed == MEMX_ALL)
+        feat &= ~MEMX_MMX;
+
+    g_memx = feat;
+    if(feat == 0) {
+        g_memcpy = memcpy_generic;
+        g_memset = memset_generic;
+    } else {
+        g_memcpy = memcpy_x86;
+        g_memset = memset_x86;
+    }
+
+    return feat;
+}
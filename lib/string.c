@@ -20,7 +20,7 @@ memcmp(const void *b1, const void *b2, size_t len)
 	return len;
 }
 
-void *memmove(void *dest, const void *src, size_t count)
+void *memmove_generic(void *dest, const void *src, size_t count)
 {
 	char *tmp;
 	const char *s;
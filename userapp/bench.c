@@ -0,0 +1,767 @@
+/*
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include "../kernel/bitmap.h"
+
+/*读取CPU的时间戳计数器*/
+static __inline uint64_t rdtsc()
+{
+    uint64_t tsc;
+    __asm__ __volatile__("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+#define BENCH_STACK_SIZE (64*1024)
+
+/**
+ * 上下文切换：同一进程内的两个线程反复调用task_yield互相让出CPU。
+ * 它们共享页目录，切换时不会重新加载CR3
+ */
+#define CTXSW_ROUNDS 10000
+
+static void ctxsw_peer(void *pv)
+{
+    int i;
+    for(i = 0; i < CTXSW_ROUNDS; i++)
+        task_yield();
+    task_exit(0);
+}
+
+void bench_ctxsw()
+{
+    unsigned char *stack;
+    uint64_t t0, t1;
+    int i, tid;
+
+    stack = (unsigned char *)malloc(BENCH_STACK_SIZE);
+    if(stack == NULL)
+        return;
+
+    t0 = rdtsc();
+    tid = task_create(stack+BENCH_STACK_SIZE, ctxsw_peer, NULL);
+    for(i = 0; i < CTXSW_ROUNDS; i++)
+        task_yield();
+    task_wait(tid, NULL);
+    t1 = rdtsc();
+
+    free(stack);
+
+    printf("ctxsw: %d yields, %u cycles/yield\r\n",
+           2*CTXSW_ROUNDS, (uint32_t)((t1-t0)/(2*CTXSW_ROUNDS)));
+}
+
+/**
+ * 页缓存：反复读取同一个文件。第一遍从磁盘读入（PIO），
+ * 之后各遍都由页缓存提供，速度接近memcpy
+ */
+#define PCACHE_FILE   "a.out"
+#define PCACHE_PASSES 4
+#define PCACHE_CHUNK  (16*1024)
+
+void bench_pcache()
+{
+    struct pcache_stat st0, st1;
+    unsigned char *buf;
+    uint64_t t0, t1;
+    uint32_t bytes;
+    int i, fd, n;
+
+    buf = (unsigned char *)malloc(PCACHE_CHUNK);
+    if(buf == NULL)
+        return;
+
+    pcache_stat(&st0);
+    for(i = 0; i < PCACHE_PASSES; i++) {
+        fd = open(PCACHE_FILE, O_RDONLY);
+        if(fd < 0)
+            break;
+
+        bytes = 0;
+        t0 = rdtsc();
+        while((n = read(fd, buf, PCACHE_CHUNK)) > 0)
+            bytes += n;
+        t1 = rdtsc();
+        close(fd);
+
+        if(bytes == 0)
+            break;
+        printf("pcache: pass %d, %u bytes, %u cycles/KB\r\n",
+               i, bytes, (uint32_t)((t1-t0)*1024/bytes));
+    }
+    pcache_stat(&st1);
+
+    free(buf);
+
+    printf("pcache: %u hits, %u misses, hit rate %u%%, %u/%u pages\r\n",
+           st1.hits-st0.hits, st1.misses-st0.misses,
+           (st1.hits-st0.hits)*100/
+               ((st1.hits-st0.hits)+(st1.misses-st0.misses)+1),
+           st1.pages, st1.maxpages);
+}
+
+/**
+ * 块缓存：反复打开同一个文件，目录扇区都由块缓存提供；
+ * 再以512字节为单位写一个文件，写操作只进缓存，最后用sync一次写回
+ */
+#define BCACHE_FILE   "bcache.tmp"
+#define BCACHE_OPENS  100
+#define BCACHE_WRITES 64
+
+void bench_bcache()
+{
+    struct bcache_stat st0, st1;
+    unsigned char buf[512];
+    uint64_t t0, t1, t2;
+    int i, fd, n;
+
+    bcache_stat(&st0);
+    t0 = rdtsc();
+    for(i = 0; i < BCACHE_OPENS; i++) {
+        if((fd = open(PCACHE_FILE, O_RDONLY)) < 0)
+            break;
+        close(fd);
+    }
+    t1 = rdtsc();
+    bcache_stat(&st1);
+
+    printf("bcache: %d opens, %u cycles each, %u hits, %u misses\r\n",
+           i, (uint32_t)((t1-t0)/(i?i:1)),
+           st1.hits-st0.hits, st1.misses-st0.misses);
+
+    fd = open(BCACHE_FILE, O_RDWR|O_CREAT);
+    if(fd < 0)
+        return;
+
+    memset(buf, 0x5a, sizeof(buf));
+    bcache_stat(&st0);
+    t0 = rdtsc();
+    for(i = 0; i < BCACHE_WRITES; i++)
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+            break;
+    t1 = rdtsc();
+    close(fd);
+    n = sync();
+    t2 = rdtsc();
+    bcache_stat(&st1);
+
+    printf("bcache: %d writes of %d bytes, %u cycles each, %u sectors absorbed\r\n",
+           i, sizeof(buf), (uint32_t)((t1-t0)/(i?i:1)), st1.writes-st0.writes);
+    printf("bcache: sync wrote %d sectors in %u commands, %u cycles\r\n",
+           n, st1.flushes-st0.flushes, (uint32_t)(t2-t1));
+    printf("bcache: %u hits, %u misses, %u bypassed, %u/%u dirty\r\n",
+           st1.hits, st1.misses, st1.bypassed, st1.dirty, st1.nbufs);
+}
+
+/**
+ * 预读：按4KiB顺序读一个不在页缓存中的文件，每读一块做一些计算。
+ * 打开预读时，kreadahead在计算的同时读入后面的页面。两遍读不同的文件，
+ * 保证都从磁盘读起
+ */
+#define STREAM_SIZE  (1024*1024)
+#define STREAM_CHUNK 4096
+
+static int stream_prepare(const char *path, unsigned char *buf)
+{
+    int fd, i;
+
+    fd = open(path, O_RDWR|O_CREAT);
+    if(fd < 0)
+        return -1;
+
+    if(lseek(fd, 0, SEEK_END) < STREAM_SIZE) {
+        lseek(fd, 0, SEEK_SET);
+        memset(buf, 0xa5, STREAM_CHUNK);
+        for(i = 0; i < STREAM_SIZE/STREAM_CHUNK; i++)
+            if(write(fd, buf, STREAM_CHUNK) != STREAM_CHUNK)
+                break;
+        sync();
+    }
+    close(fd);
+    return 0;
+}
+
+static uint64_t stream_read(const char *path, int advice, unsigned char *buf,
+                            uint32_t *bytes)
+{
+    uint64_t t0, t1;
+    uint32_t sum = 0;
+    int fd, n, i, j;
+
+    *bytes = 0;
+    if((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    fadvise(fd, advice);
+
+    t0 = rdtsc();
+    while((n = read(fd, buf, STREAM_CHUNK)) > 0) {
+        for(j = 0; j < 16; j++)
+            for(i = 0; i < n; i++)
+                sum = sum * 31 + buf[i];
+        *bytes += n;
+    }
+    t1 = rdtsc();
+    close(fd);
+
+    buf[0] = sum;   /*不让编译器去掉计算*/
+    return t1 - t0;
+}
+
+void bench_readahead()
+{
+    static const char *file[2] = {"stream0.tmp", "stream1.tmp"};
+    static const char *name[2] = {"on ", "off"};
+    static const int advice[2] = {POSIX_FADV_NORMAL, POSIX_FADV_RANDOM};
+    struct pcache_stat st0, st1;
+    unsigned char *buf;
+    uint64_t t;
+    uint32_t bytes;
+    int i;
+
+    buf = (unsigned char *)malloc(STREAM_CHUNK);
+    if(buf == NULL)
+        return;
+
+    for(i = 0; i < 2; i++)
+        if(stream_prepare(file[i], buf) < 0) {
+            free(buf);
+            return;
+        }
+
+    for(i = 0; i < 2; i++) {
+        pcache_stat(&st0);
+        t = stream_read(file[i], advice[i], buf, &bytes);
+        pcache_stat(&st1);
+        if(bytes == 0)
+            break;
+
+        printf("readahead: %s, %u bytes, %u cycles/KB, %u misses, "
+               "%u pages read ahead, %u used\r\n",
+               name[i], bytes, (uint32_t)(t*1024/bytes),
+               st1.misses-st0.misses, st1.ra_pages-st0.ra_pages,
+               st1.ra_hits-st0.ra_hits);
+    }
+
+    free(buf);
+}
+
+/**
+ * 内核对象分配：反复创建、回收线程（TCB页面）以及反复mmap/munmap（vmzone），
+ * 这些对象都来自内核的对象缓存
+ */
+#define CHURN_TASKS 1000
+#define CHURN_MAPS  10000
+
+static void churn_task(void *pv)
+{
+    task_exit(0);
+}
+
+void bench_churn()
+{
+    unsigned char *stack;
+    uint64_t t0, t1;
+    void *p;
+    int i, tid;
+
+    stack = (unsigned char *)malloc(BENCH_STACK_SIZE);
+    if(stack == NULL)
+        return;
+
+    t0 = rdtsc();
+    for(i = 0; i < CHURN_TASKS; i++) {
+        tid = task_create(stack+BENCH_STACK_SIZE, churn_task, NULL);
+        if(tid < 0)
+            break;
+        task_wait(tid, NULL);
+    }
+    t1 = rdtsc();
+    free(stack);
+    printf("churn: %d task create/exit, %u cycles each\r\n",
+           i, (uint32_t)((t1-t0)/(i?i:1)));
+
+    t0 = rdtsc();
+    for(i = 0; i < CHURN_MAPS; i++) {
+        p = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+        if(p == MAP_FAILED)
+            break;
+        munmap(p, 4096);
+    }
+    t1 = rdtsc();
+    printf("churn: %d mmap/munmap, %u cycles each\r\n",
+           i, (uint32_t)((t1-t0)/(i?i:1)));
+}
+
+/**
+ * memcpy/memset：依次限定memx_init可用的特性，对不同的长度各测一遍，
+ * 打印每KB所用的周期数。源和目的错开一个字节的那一列测的是不对齐的复制
+ */
+#define MEMX_BUF   (2*1024*1024)
+#define MEMX_TOTAL (8*1024*1024)    /*每个长度累计处理的字节数*/
+
+static const uint32_t memx_sizes[] = {
+    64, 512, 4096, 32*1024, 256*1024, 2*1024*1024
+};
+#define NR_MEMX_SIZES (sizeof(memx_sizes)/sizeof(memx_sizes[0]))
+
+static uint32_t memx_run(int op, uint8_t *dst, uint8_t *src, uint32_t len)
+{
+    uint64_t t0, t1;
+    uint32_t i, n = MEMX_TOTAL/len;
+
+    t0 = rdtsc();
+    for(i = 0; i < n; i++) {
+        if(op == 0)
+            memcpy(dst, src, len);
+        else if(op == 1)
+            memcpy(dst + 1, src, len - 1);
+        else
+            memset(dst, i, len);
+    }
+    t1 = rdtsc();
+
+    return (uint32_t)((t1-t0)/(MEMX_TOTAL/1024));
+}
+
+void bench_memx()
+{
+    static const struct {
+        const char *name;
+        unsigned    feat;
+    } cfg[] = {
+        {"generic", 0},
+        {"rep",     MEMX_REP},
+        {"erms",    MEMX_REP|MEMX_ERMS},
+        {"mmx",     MEMX_REP|MEMX_MMX},
+        {"rep+nt",  MEMX_REP|MEMX_NT},
+        {"best",    MEMX_ALL},
+    };
+    static const char *opname[] = {"copy", "copy-unaligned", "set"};
+    uint8_t *src, *dst;
+    unsigned feat;
+    int c, op, i;
+
+    src = mmap(NULL, 2*MEMX_BUF, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if(src == MAP_FAILED)
+        return;
+    dst = src + MEMX_BUF;
+    memset(src, 0x5a, 2*MEMX_BUF);
+
+    for(c = 0; c < sizeof(cfg)/sizeof(cfg[0]); c++) {
+        feat = memx_init(cfg[c].feat);
+        if(cfg[c].feat != MEMX_ALL && feat != cfg[c].feat)
+            continue;   /*CPU不支持*/
+        for(op = 0; op < 3; op++) {
+            printf("memx: %-7s %-14s", cfg[c].name, opname[op]);
+            for(i = 0; i < NR_MEMX_SIZES; i++)
+                printf(" %u:%u", memx_sizes[i],
+                       memx_run(op, dst, src, memx_sizes[i]));
+            printf(" cycles/KB\r\n");
+        }
+    }
+
+    memx_init(MEMX_ALL);
+    munmap(src, 2*MEMX_BUF);
+}
+
+/**
+ * 位图：在一个碎片化的大位图中查找连续的0，对比逐位检查的做法。
+ * 位图有256K位（相当于1GiB内存的帧），约90%的位是1，0零散地分布在
+ * 长度为1到16的空洞中，末尾留一段较长的0
+ */
+#define BITMAP_BITS (256*1024)
+#define BITMAP_ROUNDS 20
+
+/*原来的做法：在每个候选的起点逐位检查*/
+static size_t naive_scan(struct bitmap *b, size_t start, size_t cnt)
+{
+    size_t i, k, n = bitmap_size(b);
+
+    for(i = start; i + cnt <= n; i++) {
+        for(k = 0; k < cnt; k++)
+            if(bitmap_test(b, i + k))
+                break;
+        if(k == cnt)
+            return i;
+    }
+    return BITMAP_ERROR;
+}
+
+void bench_bitmap()
+{
+    static const size_t runs[] = {1, 8, 64, 1024};
+    struct bitmap *b;
+    void *buf;
+    uint64_t t0, t1, t2;
+    size_t i, r, idx = 0, hole;
+    uint32_t seed = 1;
+
+    buf = malloc(bitmap_buf_size(BITMAP_BITS));
+    if(buf == NULL)
+        return;
+    b = bitmap_create_in_buf(BITMAP_BITS, buf, bitmap_buf_size(BITMAP_BITS));
+
+    bitmap_set_all(b, true);
+    for(i = 0; i < BITMAP_BITS - 4096; i += 160) {
+        seed = seed * 1103515245 + 12345;
+        hole = 1 + (seed >> 16) % 16;
+        bitmap_set_multiple(b, i + (seed >> 8) % 128, hole, false);
+    }
+    bitmap_set_multiple(b, BITMAP_BITS - 2048, 2048, false);
+
+    for(r = 0; r < sizeof(runs)/sizeof(runs[0]); r++) {
+        t0 = rdtsc();
+        for(i = 0; i < BITMAP_ROUNDS; i++)
+            idx = bitmap_scan(b, 0, runs[r], false);
+        t1 = rdtsc();
+        for(i = 0; i < BITMAP_ROUNDS; i++)
+            if(naive_scan(b, 0, runs[r]) != idx)
+                printf("bitmap: scan mismatch for %d bits\r\n", runs[r]);
+        t2 = rdtsc();
+        printf("bitmap: run of %d at %d, %u cycles/scan (bit-by-bit %u)\r\n",
+               runs[r], idx, (uint32_t)((t1-t0)/BITMAP_ROUNDS),
+               (uint32_t)((t2-t1)/BITMAP_ROUNDS));
+    }
+
+    t0 = rdtsc();
+    for(i = 0; i < BITMAP_ROUNDS; i++)
+        idx = bitmap_count(b, 0, BITMAP_BITS, false);
+    t1 = rdtsc();
+    printf("bitmap: %d free bits, %u cycles/count\r\n",
+           idx, (uint32_t)((t1-t0)/BITMAP_ROUNDS));
+
+    free(buf);
+}
+
+/**
+ * realloc：模拟动态数组，每次追加一小段就realloc一次，统计搬家的次数。
+ * 原地扩大时不需要复制已有的数据
+ */
+#define REALLOC_MAX  (256*1024)
+#define REALLOC_STEP 1024
+
+void bench_realloc()
+{
+    uint8_t *p = NULL, *q;
+    uint32_t len, moves = 0;
+    uint64_t t0, t1;
+
+    t0 = rdtsc();
+    for(len = REALLOC_STEP; len <= REALLOC_MAX; len += REALLOC_STEP) {
+        q = (uint8_t *)realloc(p, len);
+        if(q == NULL)
+            break;
+        if(q != p)
+            moves++;
+        p = q;
+        p[len - 1] = (uint8_t)len;
+    }
+    t1 = rdtsc();
+    printf("realloc: grew to %dKiB in %d steps, %d moves, %u cycles/step\r\n",
+           (len - REALLOC_STEP)/1024, REALLOC_MAX/REALLOC_STEP, moves,
+           (uint32_t)((t1-t0)/(REALLOC_MAX/REALLOC_STEP)));
+
+    t0 = rdtsc();
+    for(len = REALLOC_MAX; len >= REALLOC_STEP; len -= REALLOC_STEP)
+        p = (uint8_t *)realloc(p, len);
+    t1 = rdtsc();
+    printf("realloc: shrank back in %u cycles/step\r\n",
+           (uint32_t)((t1-t0)/(REALLOC_MAX/REALLOC_STEP)));
+
+    free(p);
+}
+
+/**
+ * 多线程malloc：1、2、4个线程同时分配、释放小块，分别在打开和关闭
+ * 线程缓存时测吞吐量。每个线程还要释放主线程事先分配的一部分块，
+ * 测的是跨线程的释放
+ */
+#define MTMALLOC_THREADS 4
+#define MTMALLOC_ROUNDS  2000
+#define MTMALLOC_BATCH   32
+#define MTMALLOC_XFER    256
+
+struct mtmalloc_arg {
+    void **xfer;        /*主线程分配、由这个线程释放的块*/
+    int nxfer;
+};
+
+static void mtmalloc_worker(void *pv)
+{
+    struct mtmalloc_arg *arg = (struct mtmalloc_arg *)pv;
+    void *p[MTMALLOC_BATCH];
+    int r, i;
+
+    for(r = 0; r < MTMALLOC_ROUNDS; r++) {
+        for(i = 0; i < MTMALLOC_BATCH; i++)
+            p[i] = malloc(16 + (r + i * 7) % 200);
+        for(i = 0; i < MTMALLOC_BATCH; i++)
+            free(p[i]);
+        if(r < arg->nxfer)
+            free(arg->xfer[r]);
+    }
+
+    task_exit(0);
+}
+
+void bench_mtmalloc()
+{
+    extern int g_tcache_enabled;
+    static void *xfer[MTMALLOC_XFER];
+    struct mtmalloc_arg arg[MTMALLOC_THREADS];
+    unsigned char *stack[MTMALLOC_THREADS];
+    int tid[MTMALLOC_THREADS];
+    int nthreads, i, cached;
+    uint64_t t0, t1;
+    uint32_t ops;
+
+    for(i = 0; i < MTMALLOC_THREADS; i++)
+        if((stack[i] = (unsigned char *)malloc(BENCH_STACK_SIZE)) == NULL)
+            return;
+
+    for(cached = 1; cached >= 0; cached--) {
+        g_tcache_enabled = cached;
+        for(nthreads = 1; nthreads <= MTMALLOC_THREADS; nthreads *= 2) {
+            for(i = 0; i < MTMALLOC_XFER; i++)
+                xfer[i] = malloc(16 + i % 200);
+
+            t0 = rdtsc();
+            for(i = 0; i < nthreads; i++) {
+                arg[i].nxfer = MTMALLOC_XFER / nthreads;
+                arg[i].xfer = xfer + i * arg[i].nxfer;
+                tid[i] = task_create(stack[i]+BENCH_STACK_SIZE,
+                                     mtmalloc_worker, &arg[i]);
+            }
+            for(i = 0; i < nthreads; i++)
+                if(tid[i] >= 0)
+                    task_wait(tid[i], NULL);
+            t1 = rdtsc();
+
+            ops = nthreads * MTMALLOC_ROUNDS * MTMALLOC_BATCH;
+            printf("mtmalloc: %d thread(s), cache %s, %u cycles per malloc/free\r\n",
+                   nthreads, cached?"on":"off", (uint32_t)((t1-t0)/ops));
+        }
+    }
+    g_tcache_enabled = 1;
+
+    for(i = 0; i < MTMALLOC_THREADS; i++)
+        free(stack[i]);
+}
+
+/**
+ * 堆的增长：分配约36MiB的混合大小的块（超过第一个区域的32MiB，其中一些
+ * 大块单独映射），再全部释放。打印分配和释放的吞吐量、占用的物理内存
+ * 峰值，以及释放后还剩多少映射
+ */
+#define HEAP_BLOCKS 9000
+#define HEAP_HUGE   16
+
+/*系统中已经分配出去的物理页面数*/
+static uint32_t frames_in_use()
+{
+    struct meminfo mi;
+    uint32_t i, n = 0;
+
+    if(meminfo(&mi, -1) != 0)
+        return 0;
+    for(i = 0; i < mi.nzones; i++)
+        n += mi.zone[i].frames - mi.zone[i].free;
+    return n;
+}
+
+void bench_heap()
+{
+    extern void malloc_stats(size_t *mapped, size_t *peak, int *narenas);
+    static char *p[HEAP_BLOCKS + HEAP_HUGE];
+    uint32_t base, peak, after;
+    size_t mapped, mpeak, len;
+    uint64_t t0, t1, t2;
+    int i, n, narenas;
+
+    base = frames_in_use();
+
+    t0 = rdtsc();
+    for(i = 0; i < HEAP_BLOCKS + HEAP_HUGE; i++) {
+        len = (i < HEAP_BLOCKS) ? 64 + (i * 2654435761U) % 8128 : 512*1024;
+        if((p[i] = (char *)malloc(len)) == NULL)
+            break;
+        p[i][0] = p[i][len - 1] = 17;
+    }
+    t1 = rdtsc();
+    n = i;
+
+    peak = frames_in_use();
+    malloc_stats(&mapped, &mpeak, &narenas);
+    printf("heap: %d mallocs, %u cycles each, %d arenas, %dKiB mapped\r\n",
+           n, (uint32_t)((t1-t0)/(n?n:1)), narenas, mapped/1024);
+
+    t1 = rdtsc();
+    for(i = 0; i < n; i++)
+        free(p[i]);
+    t2 = rdtsc();
+
+    after = frames_in_use();
+    malloc_stats(&mapped, &mpeak, &narenas);
+    printf("heap: %d frees, %u cycles each, peak RSS +%dKiB, +%dKiB after free\r\n",
+           n, (uint32_t)((t2-t1)/(n?n:1)), (peak - base)*4,
+           (after > base) ? (after - base)*4 : 0);
+    printf("heap: %d arenas, %dKiB mapped, peak %dKiB\r\n",
+           narenas, mapped/1024, mpeak/1024);
+}
+
+/**
+ * 硬盘：用DMA和PIO分别顺序读8MiB，每次128KiB，打印每KB的周期数和
+ * CPU的占用率。diskread返回等待中断的周期数
+ */
+#define DISK_CHUNK  256                 /*每次读的扇区数*/
+#define DISK_TOTAL  (8*1024*1024/512)
+
+void bench_disk()
+{
+    static const char *name[] = {"dma", "pio"};
+    uint64_t t0, t1, idle;
+    uint32_t lba;
+    uint8_t *buf;
+    int mode, r;
+
+    buf = (uint8_t *)malloc(DISK_CHUNK * 512);
+    if(buf == NULL)
+        return;
+
+    for(mode = 0; mode < 2; mode++) {
+        idle = 0;
+        t0 = rdtsc();
+        for(lba = 0; lba < DISK_TOTAL; lba += DISK_CHUNK) {
+            r = diskread(lba, buf, DISK_CHUNK, mode ? DISKIO_PIO : 0);
+            if(r < 0) {
+                printf("disk: %s read failed at lba %d\r\n", name[mode], lba);
+                break;
+            }
+            idle += r;
+        }
+        t1 = rdtsc();
+
+        printf("disk: %s, %dKiB, %u cycles/KB, cpu busy %d%%\r\n",
+               name[mode], lba / 2, (uint32_t)((t1-t0)/(lba/2 ? lba/2 : 1)),
+               100 - (uint32_t)(idle * 100 / (t1 - t0)));
+    }
+
+    free(buf);
+}
+
+/**
+ * 计算和I/O混合：一个线程做纯计算，另一个线程顺序读4MiB。
+ * 分别测两者单独运行和同时运行的时间，比较查询方式和中断方式。
+ * 查询方式下读盘的线程关着中断等待磁盘，计算线程得不到CPU
+ */
+#define MIXED_TOTAL (4*1024*1024/512)
+#define MIXED_SPINS 20000000
+
+static volatile uint32_t mixed_sink;
+
+static void mixed_cpu(void *pv)
+{
+    uint32_t i, x = 1;
+
+    for(i = 0; i < MIXED_SPINS; i++)
+        x = x * 1103515245 + 12345;
+    mixed_sink = x;
+
+    task_exit(0);
+}
+
+static void mixed_io(void *pv)
+{
+    int flags = *(int *)pv;
+    uint8_t *buf;
+    uint32_t lba;
+
+    if((buf = (uint8_t *)malloc(DISK_CHUNK * 512)) != NULL) {
+        for(lba = 0; lba < MIXED_TOTAL; lba += DISK_CHUNK)
+            if(diskread(lba, buf, DISK_CHUNK, flags) < 0)
+                break;
+        free(buf);
+    }
+
+    task_exit(0);
+}
+
+/*运行选中的线程并等待它们结束，返回经过的周期数*/
+static uint64_t mixed_run(unsigned char **stack, int cpu, int io, int *flags)
+{
+    uint64_t t0;
+    int tid[2] = {-1, -1};
+
+    t0 = rdtsc();
+    if(cpu)
+        tid[0] = task_create(stack[0]+BENCH_STACK_SIZE, mixed_cpu, NULL);
+    if(io)
+        tid[1] = task_create(stack[1]+BENCH_STACK_SIZE, mixed_io, flags);
+    if(tid[0] >= 0)
+        task_wait(tid[0], NULL);
+    if(tid[1] >= 0)
+        task_wait(tid[1], NULL);
+    return rdtsc() - t0;
+}
+
+void bench_mixed()
+{
+    static const char *name[] = {"poll", "irq"};
+    unsigned char *stack[2];
+    uint64_t tcpu, tio, tboth;
+    int mode, flags;
+
+    if((stack[0] = (unsigned char *)malloc(BENCH_STACK_SIZE)) == NULL)
+        return;
+    if((stack[1] = (unsigned char *)malloc(BENCH_STACK_SIZE)) == NULL) {
+        free(stack[0]);
+        return;
+    }
+
+    tcpu = mixed_run(stack, 1, 0, NULL);
+
+    for(mode = 0; mode < 2; mode++) {
+        flags = mode ? 0 : DISKIO_POLL;
+        tio = mixed_run(stack, 0, 1, &flags);
+        tboth = mixed_run(stack, 1, 1, &flags);
+
+        printf("mixed: %s, cpu %uK, io %uK, both %uK cycles, %d%% overlapped\r\n",
+               name[mode], (uint32_t)(tcpu/1000), (uint32_t)(tio/1000),
+               (uint32_t)(tboth/1000),
+               (tboth < tcpu + tio) ?
+               (int)((tcpu + tio - tboth) * 100 / (tcpu < tio ? tcpu : tio)) : 0);
+    }
+
+    free(stack[0]);
+    free(stack[1]);
+}
+
+/**
+ * 依次运行所有的性能测试
+ */
+void run_benchmarks()
+{
+    extern void meminfo_dump(int tid);
+
+    bench_ctxsw();
+    bench_pcache();
+    bench_bcache();
+    bench_readahead();
+    bench_churn();
+    bench_memx();
+    bench_bitmap();
+    bench_realloc();
+    bench_mtmalloc();
+    bench_heap();
+    bench_disk();
+    bench_mixed();
+
+    meminfo_dump(-1);
+}
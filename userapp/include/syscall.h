@@ -5,6 +5,10 @@
 #include <inttypes.h>
 #include <time.h>
 #include <ioctl.h>
+#include <sys/pcache.h>
+#include <sys/meminfo.h>
+#include <sys/diskio.h>
+#include <sys/bcache.h>
 
 int task_exit(int code_exit);
 int task_create(void *tos, void (*func)(void *pv), void *pv);
@@ -14,6 +18,20 @@ int task_wait(int tid, int *pcode_exit);
 int reboot(int howto);
 void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
 int   munmap(void *addr, size_t len);
+int   msync(void *addr, size_t len, int flags);
+int   madvise(void *addr, size_t len, int advice);
+int     open(const char *path, int flags);
+int     close(int fd);
+ssize_t read(int fd, void *buf, size_t nbytes);
+ssize_t write(int fd, const void *buf, size_t nbytes);
+off_t   lseek(int fd, off_t offset, int whence);
+int     fadvise(int fd, int advice);
+
+int   pcache_stat(struct pcache_stat *st);
+int   meminfo(struct meminfo *mi, int tid);
+int   diskread(uint32_t lba, void *buf, uint32_t count, int flags);
+int   sync(void);
+int   bcache_stat(struct bcache_stat *st);
 unsigned sleep(unsigned seconds);
 int nanosleep(const struct timespec *rqtp, struct timespec *rmtp);
 
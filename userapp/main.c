@@ -9,6 +9,7 @@
 #include <syscall.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <string.h>
 #include "graphics.h"
 
 int step=2;
@@ -33,9 +34,16 @@ void thread_consumer(void *p);
  */
 void __main()
 {
+    /*
+     * 堆的第一个区域由分配器映射，页面在第一次访问时才分配。
+     * 用完时分配器会映射新的区域
+     */
     size_t heap_size = 32*1024*1024;
-    void  *heap_base = mmap(NULL, heap_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-	g_heap = tlsf_create_with_pool(heap_base, heap_size);
+
+    /*按CPU的特性选择memcpy/memset的实现*/
+    memx_init(MEMX_ALL);
+
+	g_heap = tlsf_create_with_pool(NULL, heap_size);
 }
 
 /**
@@ -58,6 +66,11 @@ void main(void *pv){
     
     extern void test_allocator();
     test_allocator();
+
+#if BENCH
+    extern void run_benchmarks();
+    run_benchmarks();
+#endif
     while(1)
         ;
     task_exit(0);
@@ -0,0 +1,47 @@
+/*
+ * vim: filetype=c:fenc=utf-8:ts=4:et:sw=4:sts=4
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <syscall.h>
+
+/**
+ * 打印内存统计，tid为-1表示当前线程
+ */
+void meminfo_dump(int tid)
+{
+    struct meminfo mi;
+    uint32_t i, frames = 0, nfree = 0;
+
+    if(meminfo(&mi, tid) != 0) {
+        printf("meminfo: no task #%d\r\n", tid);
+        return;
+    }
+
+    for(i = 0; i < mi.nzones; i++) {
+        printf("meminfo: zone %d at 0x%08x, %u frames, %u free, "
+               "largest free run %u\r\n", i, mi.zone[i].base,
+               mi.zone[i].frames, mi.zone[i].free, mi.zone[i].maxrun);
+        frames += mi.zone[i].frames;
+        nfree += mi.zone[i].free;
+    }
+    printf("meminfo: %uKiB RAM, %uKiB free\r\n", frames*4, nfree*4);
+
+    printf("meminfo: kernel heap %uKiB, %uKiB in use, peak %uKiB\r\n",
+           mi.kheap_size/1024, mi.kheap_used/1024, mi.kheap_peak/1024);
+
+    printf("meminfo: %u minor and %u major faults, task #%d %u/%u\r\n",
+           mi.minflt, mi.majflt, (tid == -1)?task_getid():tid,
+           mi.task_minflt, mi.task_majflt);
+
+    printf("meminfo: %u zero-filled pages, %u cycles/page\r\n",
+           mi.zero_fills,
+           mi.zero_fills ? (uint32_t)(mi.zero_fill_cycles/mi.zero_fills) : 0);
+
+    printf("meminfo: %u mmap, %u munmap, %u pages swapped out\r\n",
+           mi.mmaps, mi.munmaps, mi.swapouts);
+
+    printf("meminfo: %u compactions, %u pages moved, %u unmovable, "
+           "%u frames gained\r\n", mi.compact_runs, mi.compact_moved,
+           mi.compact_failed, mi.compact_gained);
+}
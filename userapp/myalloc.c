@@ -7,161 +7,781 @@
 #include <unistd.h>
 #include <syscall.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
-
+/**
+ * 分离适配（segregated fit）的分配器
+ *
+ * 堆被划分为物理上相邻的块，每块以struct chunk开头，size是包括块头在内的
+ * 大小。空闲块按大小挂在不同的空闲链表（箱子）中：小于512字节的块按8字节
+ * 一档，更大的块按2的幂分档。位图g_binmap记录哪些箱子不空。
+ *
+ * 空闲块的负载区开头存放链表的prev指针，最后一个字存放块的大小（边界标记）。
+ * 已分配的块没有尾部标记，它后面的块用PREV_FREE表示前一块是否空闲，
+ * 所以释放时和前后相邻的空闲块合并都是O(1)的
+ *
+ * 堆由若干个用mmap映射的区域组成，每个区域末尾有一个已分配状态的栅栏块，
+ * 合并不会越过区域的边界。区域用完时再映射一个新的区域，除第一个区域外，
+ * 整个空闲的区域会被munmap还给内核。不小于HUGE_THRESHOLD的块单独映射
+ */
 struct chunk {
     char signature[4];  /* "OSEX" */
-    struct chunk *next; /* ptr. to next chunk */
-    int state;          /* 0 - free, 1 - used */
-#define FREE   0
-#define USED   1
-    int size;           /* size of this chunk */
+    struct chunk *next; /* next chunk in the same free list */
+    int state;          /* FREE or USED, and PREV_FREE */
+#define FREE      0
+#define USED      1
+#define PREV_FREE 2     /* the chunk before this one is free */
+#define CACHED    4     /* used, but parked in a thread cache */
+#define HUGE      8     /* used, and has a mapping of its own */
+    int size;           /* size of this chunk, header included */
+};
+
+#define ALIGNMENT  8
+#define MIN_CHUNK  (sizeof(struct chunk) + sizeof(struct chunk *) + sizeof(int))
+
+#define NR_SMALL_BINS 64        /*8字节一档，直到512字节*/
+#define NR_BINS       (NR_SMALL_BINS + 24)
+#define BIN_SCAN      4         /*大块的箱子中最多先看这么多个块*/
+
+#define CHUNK_PREV(a)  (*(struct chunk **)((uint8_t *)(a) + sizeof(struct chunk)))
+#define CHUNK_FOOT(a)  (*(int *)((uint8_t *)(a) + (a)->size - sizeof(int)))
+#define NEXT_CHUNK(a)  ((struct chunk *)((uint8_t *)(a) + (a)->size))
+#define PREV_SIZE(a)   (*((int *)(a) - 1))
+
+#define PAGE_ROUND(n)  (((n) + 4095) & ~4095)
+
+#define ARENA_MAX      16
+#define ARENA_GROW     (4*1024*1024)    /*新映射的区域至少这么大*/
+#define HUGE_THRESHOLD (256*1024)       /*不小于它的块单独映射*/
+#define FENCE_SIZE     sizeof(struct chunk)
+#define MALLOC_MAX     0x7ffff000
+
+struct arena {
+    uint8_t *base;      /*第一个块，NULL表示空槽*/
+    uint8_t *end;       /*末尾的栅栏块*/
+    size_t   maplen;    /*映射的长度，0表示区域不是分配器映射的*/
 };
 
 static struct chunk *chunk_head;
+static struct arena  g_arenas[ARENA_MAX];
+static struct chunk *g_huge;            /*单独映射的块，用next链接*/
+static size_t        g_mapped, g_mapped_peak;
+
+static struct chunk *g_bins[NR_BINS];
+static uint32_t      g_binmap[(NR_BINS + 31) / 32];
+
+static int g_heap_sem = -1;
+
+static void heap_lock()
+{
+    if(g_heap_sem >= 0)
+        sem_wait(g_heap_sem);
+}
+
+static void heap_unlock()
+{
+    if(g_heap_sem >= 0)
+        sem_signal(g_heap_sem);
+}
+
+static int bin_index(size_t size)
+{
+    int idx;
+
+    if(size < NR_SMALL_BINS * ALIGNMENT)
+        return size / ALIGNMENT;
+
+    __asm__("bsrl %1, %0" : "=r"(idx) : "rm"((uint32_t)size) : "cc");
+    idx = NR_SMALL_BINS + idx - 9;
+    return (idx < NR_BINS) ? idx : NR_BINS - 1;
+}
+
+/*从idx开始查找第一个不空的箱子，没有返回-1*/
+static int next_bin(int idx)
+{
+    uint32_t w, i = idx / 32;
+
+    if(idx >= NR_BINS)
+        return -1;
+    w = g_binmap[i] & (~0U << (idx % 32));
+    while(w == 0) {
+        if(++i >= sizeof(g_binmap) / sizeof(g_binmap[0]))
+            return -1;
+        w = g_binmap[i];
+    }
+    __asm__("bsfl %1, %0" : "=r"(idx) : "rm"(w) : "cc");
+    return i * 32 + idx;
+}
+
+static void bin_insert(struct chunk *a)
+{
+    int idx = bin_index(a->size);
+
+    a->next = g_bins[idx];
+    CHUNK_PREV(a) = NULL;
+    if(a->next != NULL)
+        CHUNK_PREV(a->next) = a;
+    g_bins[idx] = a;
+    g_binmap[idx / 32] |= 1U << (idx % 32);
+}
+
+static void bin_remove(struct chunk *a)
+{
+    int idx = bin_index(a->size);
+
+    if(CHUNK_PREV(a) != NULL)
+        CHUNK_PREV(a)->next = a->next;
+    else
+        g_bins[idx] = a->next;
+    if(a->next != NULL)
+        CHUNK_PREV(a->next) = CHUNK_PREV(a);
+    if(g_bins[idx] == NULL)
+        g_binmap[idx / 32] &= ~(1U << (idx % 32));
+    a->next = NULL;
+}
+
+/*把a标记为大小为size的空闲块，放入箱子，并告诉后面的块*/
+static void make_free(struct chunk *a, int size)
+{
+    struct chunk *n;
+
+    strncpy(a->signature, "OSEX", 4);
+    a->state = (a->state & PREV_FREE) | FREE;
+    a->size = size;
+    CHUNK_FOOT(a) = size;
+    bin_insert(a);
+
+    n = NEXT_CHUNK(a);
+    n->state |= PREV_FREE;
+}
+
+static void *map_pages(size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*记录映射的字节数，调用者持有堆锁*/
+static void account(int delta)
+{
+    g_mapped += delta;
+    if(g_mapped > g_mapped_peak)
+        g_mapped_peak = g_mapped;
+}
+
+/*把[base, base+size)加入堆，最后FENCE_SIZE字节是栅栏块*/
+static struct arena *arena_init(uint8_t *base, size_t size, size_t maplen)
+{
+    struct arena *ar;
+    struct chunk *a, *fence;
+    int i;
+
+    for(i = 0; i < ARENA_MAX; i++)
+        if(g_arenas[i].base == NULL)
+            break;
+    if(i == ARENA_MAX)
+        return NULL;
+    ar = &g_arenas[i];
+
+    fence = (struct chunk *)(base + size - FENCE_SIZE);
+    strncpy(fence->signature, "FENC", 4);
+    fence->next = NULL;
+    fence->state = USED;
+    fence->size = FENCE_SIZE;
+
+    a = (struct chunk *)base;
+    a->state = FREE;
+    make_free(a, size - FENCE_SIZE);
+
+    ar->maplen = maplen;
+    ar->end = (uint8_t *)fence;
+    ar->base = base;
+    return ar;
+}
+
+static struct arena *arena_of(void *p)
+{
+    int i;
+
+    for(i = 0; i < ARENA_MAX; i++)
+        if(g_arenas[i].base != NULL &&
+           (uint8_t *)p >= g_arenas[i].base && (uint8_t *)p < g_arenas[i].end)
+            return &g_arenas[i];
+    return NULL;
+}
 
+/*映射一个能放下大小为need的块的新区域，调用者持有堆锁*/
+static int arena_grow(size_t need)
+{
+    size_t len = PAGE_ROUND(need + FENCE_SIZE);
+    uint8_t *base;
+
+    if(len < ARENA_GROW)
+        len = ARENA_GROW;
+    if((base = map_pages(len)) == NULL)
+        return 0;
+    if(arena_init(base, len, len) == NULL) {
+        munmap(base, len);
+        return 0;
+    }
+    account(len);
+    return 1;
+}
 
+/*
+ * 空闲块a占据了整个区域时把区域还给内核，成功返回1。
+ * 调用者持有堆锁
+ */
+static int arena_release(struct chunk *a)
+{
+    struct arena *ar;
+    uint8_t *base;
+
+    if(NEXT_CHUNK(a)->size != FENCE_SIZE || a == chunk_head)
+        return 0;
+    ar = arena_of(a);
+    if(ar == NULL || ar->base != (uint8_t *)a || ar->maplen == 0)
+        return 0;
+
+    bin_remove(a);
+    base = ar->base;
+    ar->base = NULL;
+    munmap(base, ar->maplen);
+    account(-(int)ar->maplen);
+    return 1;
+}
 
+/**
+ * 初始化堆。heap_base为NULL时由分配器映射heap_size字节的第一个区域，
+ * 页面在第一次访问时才由内核分配
+ */
 void *g_heap;
 void *tlsf_create_with_pool(uint8_t *heap_base, size_t heap_size)
 {
+    size_t maplen = 0;
+
+    if(heap_base == NULL) {
+        maplen = PAGE_ROUND(heap_size + FENCE_SIZE);
+        if((heap_base = map_pages(maplen)) == NULL)
+            return NULL;
+        heap_size += FENCE_SIZE;
+        account(maplen);
+    }
+    arena_init(heap_base, heap_size, maplen);
     chunk_head = (struct chunk *)heap_base;
-    strncpy(chunk_head->signature, "OSEX", 4);
-    chunk_head->next = NULL;
-    chunk_head->state = FREE;
-    chunk_head->size  = heap_size;
+
+    g_heap_sem = sem_create(1);
+
+    return chunk_head;
+}
+
+/*在箱子里找一个不小于need的空闲块，并把它从箱子中取出*/
+static struct chunk *find_free_block(size_t need)
+{
+    struct chunk *a;
+    int idx = bin_index(need), i;
+
+    /*小块的箱子里都是同样大小的块*/
+    if(idx < NR_SMALL_BINS && g_bins[idx] != NULL) {
+        a = g_bins[idx];
+        bin_remove(a);
+        return a;
+    }
+
+    /*大块的箱子里大小不一，先看前面几个*/
+    if(idx >= NR_SMALL_BINS) {
+        for(a = g_bins[idx], i = 0; a != NULL && i < BIN_SCAN; a = a->next, i++)
+            if(a->size >= need) {
+                bin_remove(a);
+                return a;
+            }
+    }
+
+    /*更大的箱子里任何一块都够用*/
+    if((i = next_bin(idx + 1)) >= 0) {
+        a = g_bins[i];
+        bin_remove(a);
+        return a;
+    }
+
+    if(idx >= NR_SMALL_BINS) {
+        for(a = g_bins[idx]; a != NULL; a = a->next)
+            if(a->size >= need) {
+                bin_remove(a);
+                return a;
+            }
+    }
 
     return NULL;
 }
 
-struct chunk add_block(int size){
+/*把空闲块a的前need字节留下，剩余的部分足够大时成为新的空闲块*/
+static void split_block(struct chunk *a, size_t need)
+{
+    struct chunk *rest;
+
+    if(a->size - need < MIN_CHUNK)
+        return;
+
+    rest = (struct chunk *)((uint8_t *)a + need);
+    rest->state = FREE;
+    make_free(rest, a->size - need);
+    a->size = need;
+}
+
+static size_t chunk_need(size_t size)
+{
+    size_t need = (size + sizeof(struct chunk) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    return (need < MIN_CHUNK) ? MIN_CHUNK : need;
+}
+
+/*ptr是否是malloc返回的、尚未释放的指针*/
+static struct chunk *ptr_to_chunk(void *ptr)
+{
     struct chunk *a;
-    struct chunk b;
-    a=&b;
-    a->state=FREE;
-    a->size=size;
-    a->next=NULL;
-    strncpy(a->signature,"OSEX",4);
-    return b;
+
+    a = (struct chunk *)((uint8_t *)ptr - sizeof(struct chunk));
+    if((uint8_t *)ptr < (uint8_t *)sizeof(struct chunk) || arena_of(a) == NULL)
+        return NULL;
+    if(strncmp(a->signature, "OSEX", 4) != 0 ||
+       (a->state & (USED | CACHED)) != USED)
+        return NULL;
+    return a;
 }
 
+/*从中心堆分配一个大小为need的块，调用者持有堆锁*/
+static struct chunk *chunk_alloc(size_t need)
+{
+    struct chunk *a, *n;
+
+    a = find_free_block(need);
+    if(a == NULL)
+        return NULL;
+
+    split_block(a, need);
+    a->state = (a->state & PREV_FREE) | USED;
+    n = NEXT_CHUNK(a);
+    n->state &= ~PREV_FREE;
+    return a;
+}
+
+/*同上，堆不够时映射新的区域*/
+static struct chunk *chunk_alloc_grow(size_t need)
+{
+    struct chunk *a = chunk_alloc(need);
+
+    if(a == NULL && arena_grow(need))
+        a = chunk_alloc(need);
+    return a;
+}
+
+/*为大小为need的块单独映射*/
+static struct chunk *huge_alloc(size_t need)
+{
+    size_t len = PAGE_ROUND(need);
+    struct chunk *a;
+
+    if((a = map_pages(len)) == NULL)
+        return NULL;
+    strncpy(a->signature, "OSEX", 4);
+    a->state = USED | HUGE;
+    a->size = len;
+
+    heap_lock();
+    a->next = g_huge;
+    g_huge = a;
+    account(len);
+    heap_unlock();
+    return a;
+}
 
+/*
+ * 在单独映射的块中查找ptr，unlink不为0时从链表中取下。
+ * 只比较指针，ptr无效时也不会访问它。调用者持有堆锁
+ */
+static struct chunk *huge_find(void *ptr, int unlink)
+{
+    struct chunk **pp, *a;
 
-struct chunk *find_free_block(size_t size){
-    struct chunk *a=chunk_head;
-    while(a!=NULL){
-        if(a->size>=size && a->state==FREE)
+    for(pp = &g_huge; (a = *pp) != NULL; pp = &a->next)
+        if((uint8_t *)a + sizeof(struct chunk) == ptr) {
+            if(unlink) {
+                *pp = a->next;
+                account(-a->size);
+            }
             return a;
-        a=a->next;
-    }
+        }
     return NULL;
 }
 
 
+/*
+ * 把空闲块中完整的页面还给内核。区域仍然有效，再次使用时内核重新分配清零的页面
+ * 只考虑[start, end)，它是刚释放的块原来的范围
+ */
+#define RELEASE_THRESHOLD (64*1024)
+static void release_pages(struct chunk *a, uintptr_t start, uintptr_t end){
+    if(end - start < RELEASE_THRESHOLD)
+        return;
+    /*跳过块头、prev指针和尾部标记*/
+    if(start < (uintptr_t)a + sizeof(struct chunk) + sizeof(struct chunk *))
+        start = (uintptr_t)a + sizeof(struct chunk) + sizeof(struct chunk *);
+    if(end > (uintptr_t)a + a->size - sizeof(int))
+        end = (uintptr_t)a + a->size - sizeof(int);
+    start = (start + 4095) & ~4095;
+    end &= ~4095;
+    if(end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/*把块a还给中心堆，并和前后的空闲块合并，调用者持有堆锁*/
+static void chunk_free(struct chunk *a)
+{
+    struct chunk *n, *p;
+    uintptr_t start, end;
+    int size;
+
+    start = (uintptr_t)a;
+    end = start + a->size;
+    size = a->size;
+
+    /*和后面的空闲块合并*/
+    n = NEXT_CHUNK(a);
+    if(!(n->state & USED)) {
+        bin_remove(n);
+        size += n->size;
+        n->signature[0] = 0;
+    }
+
+    /*和前面的空闲块合并*/
+    if(a->state & PREV_FREE) {
+        p = (struct chunk *)((uint8_t *)a - PREV_SIZE(a));
+        bin_remove(p);
+        size += p->size;
+        a->signature[0] = 0;
+        a = p;
+    }
+
+    make_free(a, size);
+    if(!arena_release(a))
+        release_pages(a, start, end);
+}
+
+
+/**
+ * 线程缓存
+ *
+ * 小块（含块头不超过TCACHE_MAX_SIZE字节）的分配和释放先经过线程缓存。
+ * 每组缓存为每个大小档次保存一个空闲块的链表（magazine），空了就从中心堆
+ * 成批取回MAG_BATCH块，满了就成批还回去，只有这时才需要堆锁。
+ * 缓存中的块在中心堆看来仍是已分配的，带有CACHED标记。
+ *
+ * 线程按栈的地址散列到某组缓存，不需要系统调用。每组缓存有一个busy标志，
+ * 用xchg抢占，抢不到（两个线程恰好散列到同一组）就直接使用中心堆。
+ * 块不属于哪个线程，别的线程释放的块直接进入释放者的缓存。
+ *
+ * 用户持有的块数降到0、缓存中又积攒了一些块时，把所有缓存还给中心堆，
+ * 这样堆能重新合并成一整块，已经退出的线程留下的块也不会一直占着
+ */
+#define TCACHE_NR       16
+#define TCACHE_MAX_SIZE 256
+#define TCACHE_CLASSES  (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define MAG_SIZE        32
+#define MAG_BATCH       16
+
+struct tcache {
+    volatile int busy;
+    int nblocks;                            /*缓存的块数*/
+    struct chunk *mag[TCACHE_CLASSES];      /*按块的大小/8分档，用next链接*/
+    int count[TCACHE_CLASSES];
+};
+
+static struct tcache g_tcache[TCACHE_NR];
+static volatile int  g_live;                /*用户持有的块数*/
+int g_tcache_enabled = 1;
+
+static __inline int xchg(volatile int *p, int v)
+{
+    __asm__ __volatile__("xchgl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+/*把v加到*p上，返回原来的值*/
+static __inline int atomic_add(volatile int *p, int v)
+{
+    __asm__ __volatile__("lock; xaddl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+    return v;
+}
+
+/*取得当前线程的缓存，被别的线程占用时返回NULL*/
+static struct tcache *tcache_get()
+{
+    struct tcache *tc;
+    uint32_t esp;
+
+    if(!g_tcache_enabled)
+        return NULL;
+
+    __asm__ __volatile__("movl %%esp, %0" : "=r"(esp));
+    tc = &g_tcache[((esp >> 16) * 2654435761U) >> 28];
+    if(xchg(&tc->busy, 1))
+        return NULL;
+    return tc;
+}
+
+static __inline void tcache_put(struct tcache *tc)
+{
+    xchg(&tc->busy, 0);
+}
+
+/*从中心堆取回一批大小为need的块放入档次cls*/
+static void tcache_refill(struct tcache *tc, int cls, size_t need)
+{
+    struct chunk *a;
+    int i;
+
+    heap_lock();
+    for(i = 0; i < MAG_BATCH; i++) {
+        if((a = chunk_alloc_grow(need)) == NULL)
+            break;
+        a->state |= CACHED;
+        a->next = tc->mag[cls];
+        tc->mag[cls] = a;
+    }
+    heap_unlock();
+
+    tc->count[cls] += i;
+    tc->nblocks += i;
+}
+
+/*把档次cls中的n块还给中心堆*/
+static void tcache_flush(struct tcache *tc, int cls, int n)
+{
+    struct chunk *a;
+
+    heap_lock();
+    while(n-- > 0 && (a = tc->mag[cls]) != NULL) {
+        tc->mag[cls] = a->next;
+        tc->count[cls]--;
+        tc->nblocks--;
+        a->state &= ~CACHED;
+        chunk_free(a);
+    }
+    heap_unlock();
+}
+
+/*把所有空闲的缓存还给中心堆*/
+static void tcache_drain()
+{
+    struct tcache *tc;
+    int i, cls, n = 0;
+
+    for(i = 0; i < TCACHE_NR; i++)
+        n += g_tcache[i].nblocks;
+    if(n <= MAG_BATCH)
+        return;
+
+    for(i = 0; i < TCACHE_NR; i++) {
+        tc = &g_tcache[i];
+        if(tc->nblocks == 0 || xchg(&tc->busy, 1))
+            continue;
+        for(cls = 0; cls < TCACHE_CLASSES; cls++)
+            if(tc->mag[cls] != NULL)
+                tcache_flush(tc, cls, MAG_SIZE + 1);
+        tcache_put(tc);
+    }
+}
+
 void *malloc(size_t size){
-    if(size!=0){
-        struct chunk *a=find_free_block(size);
-        if(a==NULL){
+    struct tcache *tc;
+    struct chunk *a = NULL;
+    size_t need;
+    int cls;
+
+    if(size == 0 || size > MALLOC_MAX)
+        return NULL;
+    need = chunk_need(size);
+
+    if(need >= HUGE_THRESHOLD) {
+        if((a = huge_alloc(need)) == NULL)
             return NULL;
+    } else if(need <= TCACHE_MAX_SIZE && (tc = tcache_get()) != NULL) {
+        cls = need / ALIGNMENT;
+        if(tc->mag[cls] == NULL)
+            tcache_refill(tc, cls, need);
+        if((a = tc->mag[cls]) != NULL) {
+            tc->mag[cls] = a->next;
+            tc->count[cls]--;
+            tc->nblocks--;
+            a->state &= ~CACHED;
         }
-        else{
-            void *ptr;
-            if(strncmp(a->signature,"OSEX",4)==0)
-                ptr=(uint8_t *)a+sizeof(struct chunk);
-            else
-                return NULL;
-            int freesize=a->size-size-sizeof(struct chunk);
-            if(freesize<=0){
-                a->state=USED;
-                return ptr;
-            }
-            else{
-                struct chunk *new=(struct chunk *)((uint8_t *)ptr+size);
-                *new=add_block(freesize);
-                a->size=size;
-                a->state=USED;
-                new->next=a->next;
-                a->next=new;
-                return ptr;
-                
-            }
-        }
+        tcache_put(tc);
     }
-    else
-        return NULL;
+
+    if(a == NULL) {
+        heap_lock();
+        a = chunk_alloc_grow(need);
+        heap_unlock();
+        if(a == NULL)
+            return NULL;
+    }
+
+    atomic_add(&g_live, 1);
+    return (uint8_t *)a + sizeof(struct chunk);
 }
 
 
 void free(void *ptr){
-    if(ptr!=NULL){
-        struct chunk *a=(struct chunk *)(((uint8_t *)ptr)-sizeof(struct chunk));
-        if(strncmp(a->signature,"OSEX",4)!=0)
+    struct tcache *tc;
+    struct chunk *a;
+    int cls;
+
+    if(ptr == NULL)
+        return;
+
+    if((a = ptr_to_chunk(ptr)) == NULL) {
+        heap_lock();
+        a = huge_find(ptr, 1);
+        heap_unlock();
+        if(a == NULL)
             return;
-        if(a!=NULL){
-            a->state=FREE;
-            struct chunk *b = chunk_head;
-            if(b!= NULL){
-                struct chunk* c = b->next;
-                if(b->state == FREE){
-                    size_t size = b->size;
-                    while(c->state == FREE && c!= NULL ){
-                        size =size+ (c->size + sizeof(struct chunk));
-                        c = c->next;
-                    }
-                    b->next = c;
-                    b->size = size;
-                }
-                b = c;
-            }
-        }
+        munmap(a, a->size);
+    } else if(a->size <= TCACHE_MAX_SIZE && (tc = tcache_get()) != NULL) {
+        cls = a->size / ALIGNMENT;
+        a->state |= CACHED;
+        a->next = tc->mag[cls];
+        tc->mag[cls] = a;
+        tc->nblocks++;
+        if(++tc->count[cls] > MAG_SIZE)
+            tcache_flush(tc, cls, MAG_BATCH);
+        tcache_put(tc);
+    } else {
+        heap_lock();
+        chunk_free(a);
+        heap_unlock();
     }
-    else
+
+    if(atomic_add(&g_live, -1) == 1)
+        tcache_drain();
+}
+
+
+/*已分配的块a只保留前need字节，剩余的部分足够大时和后面的空闲块一起成为新的空闲块*/
+static void shrink_chunk(struct chunk *a, size_t need)
+{
+    struct chunk *rest, *n;
+    int size;
+
+    if(a->size - need < MIN_CHUNK)
         return;
+
+    rest = (struct chunk *)((uint8_t *)a + need);
+    size = a->size - need;
+    n = NEXT_CHUNK(a);
+    if(!(n->state & USED)) {
+        bin_remove(n);
+        size += n->size;
+        n->signature[0] = 0;
+    }
+
+    a->size = need;
+    rest->state = FREE;
+    make_free(rest, size);
 }
 
+/*
+ * 尽量原地调整块a的大小：缩小时切掉尾部，扩大时吞并后面的空闲块
+ * 成功返回1，需要另外分配返回0
+ */
+static int resize_in_place(struct chunk *a, size_t need)
+{
+    struct chunk *n;
+
+    if(need > (size_t)a->size) {
+        n = NEXT_CHUNK(a);
+        if((n->state & USED) ||
+           (size_t)(a->size + n->size) < need)
+            return 0;
+
+        bin_remove(n);
+        n->signature[0] = 0;
+        a->size += n->size;
+        NEXT_CHUNK(a)->state &= ~PREV_FREE;
+    }
+
+    shrink_chunk(a, need);
+    return 1;
+}
 
 void *realloc(void *oldptr,size_t size){
-    if(size!=0){
-        void *ptr=malloc(size);
-        if(oldptr!=NULL){
-            struct chunk *ochunk=(struct chunk *)(((uint8_t *)ptr)-sizeof(struct chunk));
-            if(strncmp(ochunk->signature,"OSEX",4)!=0)
-                return NULL;
-            if(ochunk!=NULL){
-                int csize;
-                if(ochunk->size>size)
-                    csize=size;
-                else
-                    csize=ochunk->size;
-                int i;
-                for(i=0;i<csize;i++)
-                    *((uint8_t *)ptr+i)=*((uint8_t *)oldptr+i);
-                free(oldptr);
-                return ptr;
-            }
-        }
-        return ptr;
-    }
-    else{
+    struct chunk *a;
+    size_t osize, need;
+    void *ptr;
+
+    if(size == 0) {
         free(oldptr);
         return NULL;
     }
-    
+    if(oldptr == NULL)
+        return malloc(size);
+    if(size > MALLOC_MAX)
+        return NULL;
+    need = chunk_need(size);
+
+    heap_lock();
+    if((a = ptr_to_chunk(oldptr)) == NULL &&
+       (a = huge_find(oldptr, 0)) == NULL) {
+        heap_unlock();
+        return NULL;
+    }
+    osize = a->size - sizeof(struct chunk);
+    if(a->state & HUGE) {
+        /*单独映射的块缩小得不多时不动它*/
+        if(need <= (size_t)a->size && need > (size_t)a->size / 2) {
+            heap_unlock();
+            return oldptr;
+        }
+    } else if(resize_in_place(a, need)) {
+        heap_unlock();
+        return oldptr;
+    }
+    heap_unlock();
+
+    /*原地放不下，只能搬家*/
+    ptr = malloc(size);
+    if(ptr == NULL)
+        return NULL;
+    memcpy(ptr, oldptr, (osize < size) ? osize : size);
+    free(oldptr);
+    return ptr;
+}
+
+
+/*取得分配器映射的字节数、峰值和区域个数*/
+void malloc_stats(size_t *mapped, size_t *peak, int *narenas)
+{
+    int i;
+
+    heap_lock();
+    *mapped = g_mapped;
+    *peak = g_mapped_peak;
+    for(*narenas = 0, i = 0; i < ARENA_MAX; i++)
+        if(g_arenas[i].base != NULL)
+            (*narenas)++;
+    heap_unlock();
 }
 
 
 void *calloc(size_t num,size_t size){
     size_t sizenumber=num*size;
-    void *ptr=malloc(sizenumber);
-    if(ptr==NULL){
+    void *ptr;
+
+    if(size != 0 && sizenumber / size != num)
         return NULL;
-    }
-    else{
-        size_t i;
-        for(i=0;i<sizenumber;i++)
-            *((uint8_t *)ptr+i)=0;
-        return ptr;
-    }
+    ptr=malloc(sizenumber);
+    if(ptr!=NULL)
+        memset(ptr, 0, sizenumber);
+    return ptr;
 }
 
 